@@ -0,0 +1,377 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* json_bench.c */
+
+/*
+	Throughput of init_json_parser() against the former per-char parser
+	(JSON_parser_char() + callbacks), on typical and MAX_CONTENT_LENGTH sized bodies.
+	Both trees are compared before timing.
+	
+	make bench && ./bin/json_bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/json.h"
+#include "../src/utils.h"
+
+#define BENCH_BODY_SIZE 50000
+
+typedef struct _json_context {
+	int key_under;
+	int start_depth;
+		
+	json_item *head;
+	json_item *current_cx;
+
+	json_arena *arena;
+	
+	char *base;
+	char *pos;
+} json_context;
+
+static json_item *stream_item(json_arena *arena)
+{
+	json_item *jval = json_arena_alloc(arena, sizeof(*jval));
+	
+	memset(jval, 0, sizeof(*jval));
+	jval->type = -1;
+	
+	return jval;
+}
+
+static char *stream_string_slice(json_context *cx, const JSON_value *value)
+{
+	size_t len = value->vu.str.length;
+	char *str;
+	
+	if (*cx->pos == '"' && (size_t)(cx->pos - cx->base) > len) {
+		str = cx->pos - len;
+		
+		if (str[-1] == '"' && memcmp(str, value->vu.str.value, len) == 0) {
+			*cx->pos = '\0';
+			return str;
+		}
+	}
+	str = json_arena_alloc(cx->arena, len + 1);
+	memcpy(str, value->vu.str.value, len + 1);
+	
+	return str;
+}
+
+static int stream_callback(void *ctx, int type, const JSON_value* value)
+{
+	json_context *cx = (json_context *)ctx;
+	json_item *jval = NULL;
+	
+	switch(type) {
+		case JSON_T_OBJECT_BEGIN:
+		case JSON_T_ARRAY_BEGIN:
+			
+			if (!cx->key_under) {
+				jval = stream_item(cx->arena);
+				
+				if (cx->current_cx != NULL) {
+					if (cx->start_depth) {
+						cx->current_cx->child = jval;
+						jval->father = cx->current_cx;
+					} else {
+						jval->father = cx->current_cx->father;
+						cx->current_cx->next = jval;
+					}
+				}
+				cx->current_cx = jval;
+			}
+			cx->start_depth = 1;
+			cx->key_under = 0;
+			break;
+		case JSON_T_OBJECT_END:
+		case JSON_T_ARRAY_END:
+			
+			/* If the father node exists, back to it */
+			if (cx->current_cx->father != NULL) {
+				cx->current_cx = cx->current_cx->father;
+			}
+			cx->start_depth = 0;
+			cx->key_under = 0;
+			break;
+
+		case JSON_T_KEY:
+			jval = stream_item(cx->arena);
+
+			if (cx->start_depth) {
+				cx->current_cx->child = jval;
+				jval->father = cx->current_cx;
+				cx->start_depth = 0;
+			} else {
+				jval->father = cx->current_cx->father;
+				cx->current_cx->next = jval;
+			}				
+
+			
+			cx->current_cx = jval;
+			cx->key_under = 1;
+			cx->current_cx->key.val = stream_string_slice(cx, value);
+			cx->current_cx->key.len = value->vu.str.length;
+			
+			break;  
+			
+		case JSON_T_INTEGER:
+		case JSON_T_FLOAT:
+		case JSON_T_NULL:
+		case JSON_T_TRUE:
+		case JSON_T_FALSE:
+		case JSON_T_STRING:
+						
+			if (!cx->key_under) {
+			
+				jval = stream_item(cx->arena);
+
+				if (cx->start_depth) {
+					cx->current_cx->child = jval;
+					jval->father = cx->current_cx;
+					cx->start_depth = 0;
+				} else {
+					jval->father = cx->current_cx->father;
+					cx->current_cx->next = jval;
+				}	
+		
+				cx->current_cx = jval;				
+			}
+			cx->key_under = 0;
+			
+			switch(type) {
+				case JSON_T_INTEGER:
+					cx->current_cx->jval.vu.integer_value = value->vu.integer_value;
+					break;
+				case JSON_T_FLOAT:
+					cx->current_cx->jval.vu.float_value = value->vu.float_value;
+					break;
+				case JSON_T_NULL:
+				case JSON_T_FALSE:
+					cx->current_cx->jval.vu.integer_value = 0;
+					break;
+				case JSON_T_TRUE:
+					cx->current_cx->jval.vu.integer_value = 1;
+					break;
+				case JSON_T_STRING:
+					cx->current_cx->jval.vu.str.value = stream_string_slice(cx, value);
+					cx->current_cx->jval.vu.str.length = value->vu.str.length;			
+					break;
+			}
+			cx->current_cx->type = type;
+			break;
+		default:
+
+			break;
+	}
+	
+    	if (cx->head == NULL && cx->current_cx != NULL) {
+    		cx->head = cx->current_cx;
+    	}
+    	
+	return 1;
+}
+
+static json_item *stream_parser(char *json_string, json_arena *arena)
+{
+	char *pRaw;
+	JSON_config config;
+
+	struct JSON_parser_struct* jc = NULL;
+	
+	json_context jcx = {0, 0, NULL, NULL, arena, json_string, NULL};
+
+	init_JSON_config(&config);
+	
+	config.depth		= 15;
+	config.callback		= &stream_callback;
+	config.callback_ctx	= &jcx;
+	
+	config.allow_comments	= 0;
+	config.handle_floats_manually = 0;
+
+	jc = new_JSON_parser(&config);
+
+	for (pRaw = json_string; *pRaw; pRaw++) {
+		jcx.pos = pRaw;
+		if (!JSON_parser_char(jc, *pRaw)) {
+		    delete_JSON_parser(jc);
+		    return NULL;
+		}
+	}
+	
+	if (!JSON_parser_done(jc)) {
+		delete_JSON_parser(jc);
+		return NULL;
+	}
+
+	delete_JSON_parser(jc);
+	
+	return jcx.head;	
+}
+
+static int same_tree(json_item *a, json_item *b)
+{
+	for (; a != NULL && b != NULL; a = a->next, b = b->next) {
+		if (a->type != b->type || (a->key.val == NULL) != (b->key.val == NULL) ||
+			(a->key.val != NULL && strcmp(a->key.val, b->key.val) != 0)) {
+			return 0;
+		}
+		switch(a->type) {
+			case JSON_T_STRING:
+				if (a->jval.vu.str.length != b->jval.vu.str.length ||
+					memcmp(a->jval.vu.str.value, b->jval.vu.str.value, a->jval.vu.str.length) != 0) {
+					return 0;
+				}
+				break;
+			case JSON_T_FLOAT:
+				if (a->jval.vu.float_value != b->jval.vu.float_value) {
+					return 0;
+				}
+				break;
+			case -1:
+				break;
+			default:
+				if (a->jval.vu.integer_value != b->jval.vu.integer_value) {
+					return 0;
+				}
+				break;
+		}
+		if (!same_tree(a->child, b->child)) {
+			return 0;
+		}
+	}
+	return (a == b);
+}
+
+static char *body_msg(int escaped)
+{
+	char *buf = xmalloc(BENCH_BODY_SIZE + 1), *p = buf;
+	size_t i;
+	
+	p += sprintf(p, "{\"cmd\":\"SEND\",\"sessid\":\"%032d\",\"params\":{\"pipe\":\"%032d\",\"msg\":\"", 7, 9);
+	
+	for (i = 0; p - buf < BENCH_BODY_SIZE - 16; i++) {
+		if (escaped && i % 64 == 63) {
+			p += sprintf(p, (i % 128 == 127 ? "\\u00e9" : "\\n"));
+		} else {
+			*p++ = 'a' + i % 26;
+		}
+	}
+	strcpy(p, "\"}}");
+	
+	return buf;
+}
+
+static char *body_params()
+{
+	char *buf = xmalloc(BENCH_BODY_SIZE + 1), *p = buf;
+	int i;
+	
+	p += sprintf(p, "{\"cmd\":\"SETPOS\",\"params\":{\"list\":[");
+	
+	for (i = 0; p - buf < BENCH_BODY_SIZE - 128; i++) {
+		p += sprintf(p, "%s{\"x\":%d,\"y\":-%d.5,\"visible\":%s,\"name\":\"item%d\"}", (i ? "," : ""), i, i, (i & 1 ? "true" : "false"), i);
+	}
+	strcpy(p, "]}}");
+	
+	return buf;
+}
+
+static double now()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(json_item *(*parser)(char *, json_arena *), const char *body, char *work, size_t len, int loops)
+{
+	int i;
+	double start = now();
+	json_arena arena = {NULL};
+	
+	for (i = 0; i < loops; i++) {
+		memcpy(work, body, len + 1);
+		
+		if (parser(work, &arena) == NULL) {
+			printf("parse error\n");
+			exit(1);
+		}
+		json_arena_release(&arena);
+	}
+	
+	return (len * (double)loops) / (now() - start) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	struct {
+		const char *name;
+		char *body;
+	} bodies[] = {
+		{"command", NULL},
+		{"50k msg", NULL},
+		{"50k escaped msg", NULL},
+		{"50k params", NULL}
+	};
+	int i;
+	
+	bodies[0].body = xstrdup("{\"cmd\":\"SEND\",\"sessid\":\"0123456789abcdef0123456789abcdef\",\"params\":{\"pipe\":\"fedcba9876543210fedcba9876543210\",\"msg\":\"Hello world\"}}");
+	bodies[1].body = body_msg(0);
+	bodies[2].body = body_msg(1);
+	bodies[3].body = body_params();
+	
+	printf("%-16s %10s %12s %12s %8s\n", "body", "bytes", "char MB/s", "bulk MB/s", "speedup");
+	
+	for (i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++) {
+		size_t len = strlen(bodies[i].body);
+		char *wa = xmalloc(len + 1), *wb = xmalloc(len + 1);
+		json_arena aa = {NULL}, ab = {NULL};
+		int loops = (int)(200000000 / (len + 64));
+		double mchar, mbulk;
+		
+		memcpy(wa, bodies[i].body, len + 1);
+		memcpy(wb, bodies[i].body, len + 1);
+		
+		if (!same_tree(stream_parser(wa, &aa), init_json_parser(wb, &ab))) {
+			printf("%s : trees differ\n", bodies[i].name);
+			return 1;
+		}
+		json_arena_release(&aa);
+		json_arena_release(&ab);
+		
+		mchar = run(stream_parser, bodies[i].body, wa, len, loops / 10);
+		mbulk = run(init_json_parser, bodies[i].body, wb, len, loops);
+		
+		printf("%-16s %10zu %12.1f %12.1f %7.1fx\n", bodies[i].name, len, mchar, mbulk, mbulk / mchar);
+		
+		free(wa);
+		free(wb);
+	}
+	
+	return 0;
+}
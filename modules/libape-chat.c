@@ -50,6 +50,7 @@ static unsigned int chat_connect(callbackp *callbacki)
 	RAW *newraw;
 	
 	struct json *jstr = NULL;
+	char sessid[APE_ID_HEX_LEN + 1];
 
 	
 	if (!isvalidnick(callbacki->param[1])) {
@@ -84,7 +85,7 @@ static unsigned int chat_connect(callbackp *callbacki)
 	
 	subuser_restor(getsubuser(callbacki->call_user, callbacki->host), callbacki->g_ape);
 	
-	set_json("sessid", nuser->sessid, &jstr);
+	set_json("sessid", ape_id_encode(&nuser->id, sessid), &jstr);
 	
 	newraw = forge_raw(RAW_LOGIN, jstr);
 	newraw->priority = 1;
@@ -71,7 +71,7 @@ char *base64_encode(char * src, int len)
 
 	if (len) {
 		while (bytes_remaining) {
-			i_bits = (i_bits << 8) + *src++;
+			i_bits = (i_bits << 8) + (unsigned char)*src++;
 			bytes_remaining--;
 			i_shift += 8;
 	 
@@ -29,6 +29,13 @@
 #include "proxy.h"
 #include "pipe.h"
 #include "raw.h"
+#include "ticks.h"
+#include "slab.h"
+
+static slab_cache userslist_cache = SLAB_CACHE("userslist", userslist);
+static slab_cache chanlist_cache = SLAB_CACHE("CHANLIST", CHANLIST);
+
+static void presence_discard(CHANNEL *chan);
 
 unsigned int isvalidchan(char *name) 
 {
@@ -62,11 +69,20 @@ CHANNEL *mkchan(char *chan, char *topic, acetables *g_ape)
 		
 	memcpy(new_chan->name, chan, strlen(chan)+1);
 	
-	new_chan->head = NULL;
+	new_chan->members = NULL;
+	new_chan->nmembers = 0;
+	new_chan->members_size = 0;
+	new_chan->members_index = NULL;
+	new_chan->members_index_size = 0;
+	
 	new_chan->banned = NULL;
 	new_chan->properties = NULL;
 	
 	new_chan->interactive = (*new_chan->name == '*' ? 0 : 1);
+	
+	new_chan->presence = NULL;
+	new_chan->presence_next = NULL;
+	new_chan->presence_pprev = NULL;
 
 	memcpy(new_chan->topic, topic, strlen(topic)+1);
 
@@ -75,7 +91,7 @@ CHANNEL *mkchan(char *chan, char *topic, acetables *g_ape)
 	hashtbl_append(g_ape->hLusers, chan, (void *)new_chan);
 	
 	/* just to test */
-	//proxy_attach(proxy_init("olol", "localhost", 1337, g_ape), new_chan->pipe->pubid, 0, g_ape);
+	//proxy_attach(proxy_init("olol", "localhost", 1337, g_ape), new_chan->pipe, 0, g_ape);
 	
 	return new_chan;
 	
@@ -92,10 +108,15 @@ CHANNEL *getchan(const char *chan, acetables *g_ape)
 void rmchan(CHANNEL *chan, acetables *g_ape)
 {
 
-	if (chan->head != NULL) {
+	if (chan->nmembers != 0) {
 		return;
 	}
 	rmallban(chan);
+	
+	presence_discard(chan);
+	
+	free(chan->members);
+	free(chan->members_index);
 
 		
 	hashtbl_erase(g_ape->hLusers, chan->name);
@@ -108,76 +129,307 @@ void rmchan(CHANNEL *chan, acetables *g_ape)
 	chan = NULL;
 }
 
+/*
+	Net change of a member during the presence window.
+	Levels : 0 means "not on the channel" (from 0 : add, to 0 : remove)
+*/
+typedef struct _presence_change
+{
+	unsigned int from;
+	unsigned int to;
+	
+	size_t len;
+	char *user; /* user object members, as last seen */
+} presence_change;
+
+struct _presence
+{
+	HTBL *changes; /* pubid -> presence_change */
+	unsigned long expire; /* tick */
+};
+
+/* Aggregated channel, or changes already waiting (they must stay in order) */
+static int presence_aggregated(CHANNEL *chan, acetables *g_ape)
+{
+	return (chan->presence != NULL || g_ape->presence.window || 
+		(g_ape->roster.page && chan->nmembers > g_ape->roster.page));
+}
+
+/* Record a level change of "user" (from/to 0 : join/left). Opposite changes cancel out */
+static void presence_change_add(CHANNEL *chan, USERS *user, unsigned int from, unsigned int to, acetables *g_ape)
+{
+	extend_cache *cache;
+	presence_change *change;
+	char pubid[APE_ID_HEX_LEN + 1];
+	
+	if (chan->presence == NULL) {
+		chan->presence = xmalloc(sizeof(*chan->presence));
+		chan->presence->changes = hashtbl_init();
+		chan->presence->expire = g_ape->timers->now + (g_ape->presence.window ? g_ape->presence.window : 1);
+		
+		if ((chan->presence_next = g_ape->presence.pending) != NULL) {
+			chan->presence_next->presence_pprev = &chan->presence_next;
+		}
+		chan->presence_pprev = &g_ape->presence.pending;
+		g_ape->presence.pending = chan;
+	}
+	
+	ape_id_encode(&user->pipe->id, pubid);
+	
+	if ((change = hashtbl_seek(chan->presence->changes, pubid)) == NULL) {
+		change = xmalloc(sizeof(*change));
+		change->from = from;
+		change->len = 0;
+		change->user = NULL;
+		
+		hashtbl_append(chan->presence->changes, pubid, change);
+	}
+	change->to = to;
+	
+	if (change->from == change->to) {
+		hashtbl_erase(chan->presence->changes, pubid);
+		free(change->user);
+		free(change);
+		
+		return;
+	}
+	cache = get_json_object_user_cache(user);
+	
+	change->user = xrealloc(change->user, cache->len);
+	change->len = cache->len;
+	memcpy(change->user, cache->data, cache->len);
+}
+
+static void presence_discard(CHANNEL *chan)
+{
+	HTBL_ITEM *item;
+	
+	if (chan->presence == NULL) {
+		return;
+	}
+	if ((*chan->presence_pprev = chan->presence_next) != NULL) {
+		chan->presence_next->presence_pprev = chan->presence_pprev;
+	}
+	
+	for (item = chan->presence->changes->first; item != NULL; item = item->lnext) {
+		presence_change *change = item->addrs;
+		
+		free(change->user);
+		free(change);
+	}
+	hashtbl_free(chan->presence->changes);
+	free(chan->presence);
+	
+	chan->presence = NULL;
+	chan->presence_next = NULL;
+	chan->presence_pprev = NULL;
+}
+
+/* "add" : from 0, "remove" : to 0, "level" : both on the channel */
+static int presence_write(json_writer *w, const char *key, HTBL *changes)
+{
+	HTBL_ITEM *item;
+	presence_change *change;
+	char level[8];
+	int n = 0;
+	
+	for (item = changes->first; item != NULL; item = item->lnext) {
+		change = item->addrs;
+		
+		if ((*key == 'a' && change->from != 0) || (*key == 'r' && change->to != 0) || 
+			(*key == 'l' && (change->from == 0 || change->to == 0))) {
+			continue;
+		}
+		if (n++ == 0) {
+			json_writer_key(w, key);
+			json_writer_begin_array(w);
+		}
+		json_writer_begin_object(w);
+		if (change->to != 0) {
+			json_writer_key(w, "level");
+			json_writer_string(w, itos(change->to, level));
+		}
+		json_writer_raw_members(w, change->user, change->len);
+		json_writer_end_object(w);
+	}
+	if (n != 0) {
+		json_writer_end_array(w);
+	}
+	
+	return n;
+}
+
+/* Ticked : channels whose window is over get one PRESENCE raw with the net changes */
+void presence_flush(acetables *g_ape)
+{
+	CHANNEL *chan, *next;
+	
+	for (chan = g_ape->presence.pending; chan != NULL; chan = next) {
+		next = chan->presence_next;
+		
+		if (chan->presence->expire > g_ape->timers->now) {
+			continue;
+		}
+		
+		if (chan->presence->changes->first != NULL) {
+			json_writer w;
+			
+			forge_raw_begin(&w, RAW_PRESENCE);
+			json_writer_begin_object(&w);
+			json_writer_key(&w, "pipe");
+			get_json_object_channel_writer(chan, &w);
+			
+			presence_write(&w, "add", chan->presence->changes);
+			presence_write(&w, "remove", chan->presence->changes);
+			presence_write(&w, "level", chan->presence->changes);
+			json_writer_end_object(&w);
+			
+			presence_discard(chan);
+			
+			post_raw_channel(forge_raw_end(&w), chan, g_ape);
+		} else {
+			presence_discard(chan);
+		}
+	}
+}
+
+/*
+	Members index : open addressing on the USERS pointer (linear probing,
+	backward shift deletion), at most half full.
+*/
+static unsigned int member_slot(CHANNEL *chan, USERS *user)
+{
+	uint64_t h = (uintptr_t)user;
+	
+	h ^= h >> 17;
+	h *= 0x9E3779B97F4A7C15ULL;
+	
+	return (unsigned int)(h >> 32) & (chan->members_index_size - 1);
+}
+
+static void member_index_insert(CHANNEL *chan, userslist *ulist)
+{
+	unsigned int i = member_slot(chan, ulist->userinfo);
+	
+	while (chan->members_index[i] != NULL) {
+		i = (i + 1) & (chan->members_index_size - 1);
+	}
+	chan->members_index[i] = ulist;
+}
+
+static void member_index_remove(CHANNEL *chan, userslist *ulist)
+{
+	unsigned int mask = chan->members_index_size - 1;
+	unsigned int i = member_slot(chan, ulist->userinfo), j, k;
+	
+	while (chan->members_index[i] != ulist) {
+		i = (i + 1) & mask;
+	}
+	
+	/* Move back the following entries that can't be reached anymore */
+	for (j = (i + 1) & mask; chan->members_index[j] != NULL; j = (j + 1) & mask) {
+		k = member_slot(chan, chan->members_index[j]->userinfo);
+		
+		if (((j - k) & mask) >= ((j - i) & mask)) {
+			chan->members_index[i] = chan->members_index[j];
+			i = j;
+		}
+	}
+	chan->members_index[i] = NULL;
+}
+
+static void member_add(CHANNEL *chan, userslist *ulist)
+{
+	if (chan->nmembers == chan->members_size) {
+		chan->members_size = (chan->members_size ? chan->members_size * 2 : 8);
+		chan->members = xrealloc(chan->members, sizeof(*chan->members) * chan->members_size);
+	}
+	if ((chan->nmembers + 1) * 2 > chan->members_index_size) {
+		unsigned int i;
+		
+		free(chan->members_index);
+		
+		chan->members_index_size = (chan->members_index_size ? chan->members_index_size * 2 : 16);
+		chan->members_index = xmalloc(sizeof(*chan->members_index) * chan->members_index_size);
+		memset(chan->members_index, 0, sizeof(*chan->members_index) * chan->members_index_size);
+		
+		for (i = 0; i < chan->nmembers; i++) {
+			member_index_insert(chan, chan->members[i].ulist);
+		}
+	}
+	ulist->index = chan->nmembers++;
+	
+	chan->members[ulist->index].user = ulist->userinfo;
+	chan->members[ulist->index].ulist = ulist;
+	
+	member_index_insert(chan, ulist);
+}
+
+/* The last member takes the place of the removed one */
+static void member_del(CHANNEL *chan, userslist *ulist)
+{
+	unsigned int last = --chan->nmembers;
+	
+	member_index_remove(chan, ulist);
+	
+	if (ulist->index != last) {
+		chan->members[ulist->index] = chan->members[last];
+		chan->members[ulist->index].ulist->index = ulist->index;
+	}
+	slab_free(&userslist_cache, ulist);
+}
+
 void join(USERS *user, CHANNEL *chan, acetables *g_ape)
 {
-	userslist *list, *ulist;
+	userslist *list;
 	
 	CHANLIST *chanl;
 	
 	FIRE_EVENT_NULL(join, user, chan, g_ape);
 	
 	RAW *newraw;
-	json *jlist = NULL;
-	char level[8];
 	
 	if (isonchannel(user, chan)) {
 		return;
 	}
 	
-	list = (userslist *)xmalloc(sizeof(*list)); // is it free ?
+	list = slab_alloc(&userslist_cache);
 	list->userinfo = user;
 	list->level = 1;
-	list->next = chan->head;
-	
-	chan->head = list;
 	
-	chanl = (CHANLIST *)xmalloc(sizeof(*chanl)); // is it free ?
+	chanl = slab_alloc(&chanlist_cache);
 	chanl->chaninfo = chan;
+	chanl->member = list;
+	chanl->prev = NULL;
 	chanl->next = user->chan_foot;
 	
+	if (chanl->next != NULL) {
+		chanl->next->prev = chanl;
+	}
 	user->chan_foot = chanl;
+	
+	list->chanl = chanl;
+	member_add(chan, list);
 
 
-	if (chan->interactive) {
-		jlist = NULL;
+	if (chan->interactive && presence_aggregated(chan, g_ape)) {
+		presence_change_add(chan, user, 0, list->level, g_ape);
+	} else if (chan->interactive) {
+		json_writer w;
 		
-		set_json("user", NULL, &jlist);
-		json_attach(jlist, get_json_object_user(user), JSON_OBJECT);
-		
-		set_json("pipe", NULL, &jlist);
-		json_attach(jlist, get_json_object_channel(chan), JSON_OBJECT);
+		forge_raw_begin(&w, RAW_JOIN);
+		json_writer_begin_object(&w);
+		json_writer_key(&w, "pipe");
+		get_json_object_channel_writer(chan, &w);
+		json_writer_key(&w, "user");
+		get_json_object_user_writer(user, &w);
+		json_writer_end_object(&w);
 		
-		newraw = forge_raw(RAW_JOIN, jlist);
+		newraw = forge_raw_end(&w);
 		post_raw_channel_restricted(newraw, chan, user, g_ape);
-		
-		jlist = NULL;
-		set_json("users", NULL, &jlist);
-
-		ulist = chan->head;
-		while (ulist != NULL) {
-		
-			struct json *juser = NULL;
-			
-			if (ulist->userinfo != user) {
-				//make_link(user, ulist->userinfo);
-			}
-			
-			sprintf(level, "%i", ulist->level);
-			set_json("level", level, &juser);
-			
-			json_concat(juser, get_json_object_user(ulist->userinfo));
-		
-			json_attach(jlist, juser, JSON_ARRAY);
-
-			ulist = ulist->next;
-		}
 	}
 
-	
-	set_json("pipe", NULL, &jlist);
-	json_attach(jlist, get_json_object_channel(chan), JSON_OBJECT);
-	
-	newraw = forge_raw(RAW_CHANNEL, jlist);
+	newraw = forge_channel_raw(chan, g_ape);
 	post_raw(newraw, user, g_ape);
 	
 	#if 0
@@ -209,99 +461,64 @@ void left_all(USERS *user, acetables *g_ape)
 
 void left(USERS *user, CHANNEL *chan, acetables *g_ape) // Vider la liste chaine de l'user
 {
-	userslist *list, *prev;
-
-	CHANLIST *clist, *ctmp;
+	userslist *list;
+	CHANLIST *clist;
 	RAW *newraw;
-	json *jlist;
+	unsigned int level;
 	
 	FIRE_EVENT_NULL(left, user, chan, g_ape);
 	
-	if (!isonchannel(user, chan)) {
+	if ((list = getuchan(user, chan)) == NULL) {
 		return;
 	}
-	list = chan->head;
-	prev = NULL;
-	
-	clist = user->chan_foot;
-	ctmp = NULL;
+	clist = list->chanl;
+	level = list->level;
 	
-	while (clist != NULL) {
-		if (clist->chaninfo == chan) {
-			if (ctmp != NULL) {
-				ctmp->next = clist->next;
-			} else {
-				user->chan_foot = clist->next;
-			}
-			free(clist);
-			clist = NULL;
-			break;
-		}
-		ctmp = clist;
-		clist = clist->next;
+	if (clist->prev != NULL) {
+		clist->prev->next = clist->next;
+	} else {
+		user->chan_foot = clist->next;
 	}
-	
-	
-	while (list != NULL && list->userinfo != NULL) {
-		if (list->userinfo == user) {
-			if (prev != NULL) {
-				prev->next = list->next;
-			} else {
-				chan->head = list->next;
-			}
-			free(list);
-			list = NULL;
-			if (chan->head != NULL && chan->interactive) {
-				jlist = NULL;
-				
-				set_json("user",  NULL, &jlist);
-				json_attach(jlist, get_json_object_user(user), JSON_OBJECT);
-
-				
-				set_json("pipe", NULL, &jlist);
-				json_attach(jlist, get_json_object_channel(chan), JSON_OBJECT);
-				
-				newraw = forge_raw(RAW_LEFT, jlist);
-				post_raw_channel(newraw, chan, g_ape);
-			} else if (chan->head == NULL) {
-				rmchan(chan, g_ape); // A verifier
-			}
-			break;
-		}
-		prev = list;
-		list = list->next;
+	if (clist->next != NULL) {
+		clist->next->prev = clist->prev;
 	}
+	slab_free(&chanlist_cache, clist);
 	
-}
-
-userslist *getlist(const char *chan, acetables *g_ape)
-{
-	CHANNEL *lchan;
+	member_del(chan, list);
 	
-	if (strlen(chan) > MAX_CHAN_LEN) {
-		return NULL;
-	}
-	if ((lchan = (CHANNEL *)hashtbl_seek(g_ape->hLusers, chan)) == NULL) {
-		return NULL;
+	if (chan->nmembers != 0 && chan->interactive && presence_aggregated(chan, g_ape)) {
+		presence_change_add(chan, user, level, 0, g_ape);
+	} else if (chan->nmembers != 0 && chan->interactive) {
+		json_writer w;
+		
+		forge_raw_begin(&w, RAW_LEFT);
+		json_writer_begin_object(&w);
+		json_writer_key(&w, "pipe");
+		get_json_object_channel_writer(chan, &w);
+		json_writer_key(&w, "user");
+		get_json_object_user_writer(user, &w);
+		json_writer_end_object(&w);
+		
+		newraw = forge_raw_end(&w);
+		post_raw_channel(newraw, chan, g_ape);
+	} else if (chan->nmembers == 0) {
+		rmchan(chan, g_ape); // A verifier
 	}
-	return lchan->head;
 }
 
 /* get user info to a specific channel (i.e. level) */
 userslist *getuchan(USERS *user, CHANNEL *chan)
 {
-	userslist *list;
+	unsigned int i;
 	
-	if (user == NULL || chan == NULL) {
-		return 0;
+	if (user == NULL || chan == NULL || chan->nmembers == 0) {
+		return NULL;
 	}
-	list = chan->head;
 	
-	while (list != NULL) {
-		if (list->userinfo == user) {
-			return list;
+	for (i = member_slot(chan, user); chan->members_index[i] != NULL; i = (i + 1) & (chan->members_index_size - 1)) {
+		if (chan->members_index[i]->userinfo == user) {
+			return chan->members_index[i];
 		}
-		list = list->next;
 	}
 	return NULL;
 }
@@ -312,6 +529,7 @@ unsigned int setlevel(USERS *user_actif, USERS *user_passif, CHANNEL *chan, unsi
 	RAW *newraw;
 	userslist *user_passif_chan, *user_actif_chan;
 	json *jlist;
+	unsigned int old;
 
 	char level[8];
 	
@@ -326,9 +544,12 @@ unsigned int setlevel(USERS *user_actif, USERS *user_passif, CHANNEL *chan, unsi
 			return 0;
 		}
 		
+		old = user_passif_chan->level;
 		user_passif_chan->level = lvl;
 		
-		if (chan->interactive) {
+		if (chan->interactive && presence_aggregated(chan, g_ape)) {
+			presence_change_add(chan, user_passif, old, lvl, g_ape);
+		} else if (chan->interactive) {
 			jlist = NULL;
 
 			set_json("ope", NULL, &jlist);
@@ -346,9 +567,12 @@ unsigned int setlevel(USERS *user_actif, USERS *user_passif, CHANNEL *chan, unsi
 		}
 		return 1;
 	} else if (user_passif_chan != NULL && lvl > 0 && lvl < 32) {		
+		old = user_passif_chan->level;
 		user_passif_chan->level = lvl;
 		
-		if (chan->interactive) {
+		if (chan->interactive && presence_aggregated(chan, g_ape)) {
+			presence_change_add(chan, user_passif, old, lvl, g_ape);
+		} else if (chan->interactive) {
 			jlist = NULL;
 		
 			set_json("ope", NULL, &jlist);
@@ -403,12 +627,12 @@ unsigned int settopic(USERS *user, CHANNEL *chan, const char *topic, acetables *
 
 void ban(CHANNEL *chan, USERS *banner, const char *ip, char *reason, unsigned int expire, acetables *g_ape) // Ban IP
 {
-	userslist *uTmp, *tUtmp;
+	USERS *uTmp;
 	RAW *newraw;
 	json *jlist;
 	BANNED *blist, *bTmp;
 	
-	unsigned int isban = 0;
+	unsigned int isban = 0, i = 0, nmembers;
 	
 	long int nextime = (expire * 60)+time(NULL); // NOW !
 	
@@ -416,12 +640,12 @@ void ban(CHANNEL *chan, USERS *banner, const char *ip, char *reason, unsigned in
 		return;
 	}
 	
-	uTmp = chan->head;
 	bTmp = chan->banned;
 	
-	while (uTmp != NULL) {
-
-		if (strcmp(ip, uTmp->userinfo->ip) == 0) { // We find somebody with the same IP
+	while (i < chan->nmembers) {
+		uTmp = chan->members[i].user;
+		
+		if (strcmp(ip, uTmp->ip) == 0) { // We find somebody with the same IP
 			jlist = NULL;
 			
 			set_json("reason", reason, &jlist);
@@ -437,7 +661,7 @@ void ban(CHANNEL *chan, USERS *banner, const char *ip, char *reason, unsigned in
 			
 			newraw = forge_raw(RAW_BAN, jlist);
 			
-			post_raw(newraw, uTmp->userinfo, g_ape);
+			post_raw(newraw, uTmp, g_ape);
 			
 			if (isban == 0) {
 				blist = xmalloc(sizeof(*blist));
@@ -449,12 +673,19 @@ void ban(CHANNEL *chan, USERS *banner, const char *ip, char *reason, unsigned in
 				chan->banned = blist;
 				isban = 1;
 			}
-			tUtmp = uTmp->next;
-			left(uTmp->userinfo, chan, g_ape); // if the user is the last : "chan" is free (rmchan())
-			uTmp = tUtmp;
+			if ((nmembers = chan->nmembers) == 1) {
+				left(uTmp, chan, g_ape); // The user is the last : "chan" is free (rmchan())
+				break;
+			}
+			left(uTmp, chan, g_ape); // The last member is moved at "i"
+			
+			/* A module handling "left" may keep the user on the channel */
+			if (chan->nmembers == nmembers) {
+				i++;
+			}
 			continue;
 		}
-		uTmp = uTmp->next;
+		i++;
 	}
 
 }
@@ -531,10 +762,11 @@ void rmallban(CHANNEL *chan)
 struct json *get_json_object_channel(CHANNEL *chan)
 {
 	json *jstr = NULL;
+	char pubid[APE_ID_HEX_LEN + 1];
 	
 	//set_json("topic", chan->topic, &jstr);
 	//set_json("name", chan->name, &jstr); // See below
-	set_json("pubid", chan->pipe->pubid, &jstr);
+	set_json("pubid", ape_id_encode(&chan->pipe->id, pubid), &jstr);
 	set_json("casttype", "multi", &jstr);
 	
 	//if (chan->properties != NULL) {
@@ -566,3 +798,151 @@ struct json *get_json_object_channel(CHANNEL *chan)
 	return jstr;
 }
 
+/* Serialized get_json_object_channel(), cached on the channel until its properties change */
+extend_cache *get_json_object_channel_cache(CHANNEL *chan)
+{
+	extend_cache *cache;
+	extend *eTmp;
+	json_writer w;
+	char pubid[APE_ID_HEX_LEN + 1];
+	
+	if ((cache = get_property_cache(chan->properties)) != NULL) {
+		return cache;
+	}
+	
+	json_writer_init(&w);
+	json_writer_begin_object(&w);
+	
+	json_writer_key(&w, "properties");
+	json_writer_begin_object(&w);
+	
+	for (eTmp = chan->properties; eTmp != NULL; eTmp = eTmp->next) {
+		if (eTmp->visibility != EXTEND_ISPUBLIC) {
+			continue;
+		}
+		json_writer_key(&w, eTmp->key);
+		
+		if (eTmp->type == EXTEND_JSON) {
+			json_writer_json(&w, eTmp->val);
+		} else {
+			json_writer_string(&w, eTmp->val);
+		}
+	}
+	json_writer_key(&w, "name");
+	json_writer_string(&w, chan->name);
+	
+	json_writer_end_object(&w);
+	
+	json_writer_key(&w, "casttype");
+	json_writer_string(&w, "multi");
+	json_writer_key(&w, "pubid");
+	json_writer_string(&w, ape_id_encode(&chan->pipe->id, pubid));
+	
+	json_writer_end_object(&w);
+	
+	cache = set_property_cache(&chan->properties, w.buf, w.len);
+	json_writer_release(&w);
+	
+	return cache;
+}
+
+/* Same as get_json_object_channel() but written by a json_writer */
+void get_json_object_channel_writer(CHANNEL *chan, json_writer *w)
+{
+	extend_cache *cache = get_json_object_channel_cache(chan);
+	
+	json_writer_raw(w, cache->data, cache->len);
+}
+
+/* [{"level":..., (user object members)}, ...] using the cached user objects, "limit" members from "offset" */
+void get_json_channel_users_writer(CHANNEL *chan, unsigned int offset, unsigned int limit, json_writer *w)
+{
+	userslist *ulist;
+	unsigned int i;
+	char level[8];
+	
+	json_writer_begin_array(w);
+	
+	for (i = offset; i < chan->nmembers && i - offset < limit; i++) {
+		extend_cache *cache = get_json_object_user_cache(chan->members[i].user);
+		
+		ulist = chan->members[i].ulist;
+		
+		sprintf(level, "%i", ulist->level);
+		
+		json_writer_begin_object(w);
+		json_writer_key(w, "level");
+		json_writer_string(w, level);
+		json_writer_raw_members(w, cache->data, cache->len);
+		json_writer_end_object(w);
+	}
+	
+	json_writer_end_array(w);
+}
+
+/*
+	CHANNEL raw : the channel and its users (if interactive).
+	Large channels only give the first page and the members "count" (see forge_roster_raw())
+*/
+RAW *forge_channel_raw(CHANNEL *chan, acetables *g_ape)
+{
+	json_writer w;
+	
+	forge_raw_begin(&w, RAW_CHANNEL);
+	json_writer_begin_object(&w);
+	
+	json_writer_key(&w, "pipe");
+	get_json_object_channel_writer(chan, &w);
+	
+	if (chan->interactive) {
+		unsigned int page = g_ape->roster.page;
+		
+		json_writer_key(&w, "users");
+		get_json_channel_users_writer(chan, 0, (page ? page : chan->nmembers), &w);
+		
+		if (page && chan->nmembers > page) {
+			char count[16];
+			
+			sprintf(count, "%u", chan->nmembers);
+			json_writer_key(&w, "count");
+			json_writer_string(&w, count);
+		}
+	}
+	json_writer_end_object(&w);
+	
+	return forge_raw_end(&w);
+}
+
+/* ROSTER raw : a page of the channel's users. Members are unordered, pages are best effort (PRESENCE gives the changes) */
+RAW *forge_roster_raw(CHANNEL *chan, unsigned int offset, acetables *g_ape)
+{
+	json_writer w;
+	unsigned int nmembers = (chan->interactive ? chan->nmembers : 0);
+	char tmp[16];
+	
+	forge_raw_begin(&w, RAW_ROSTER);
+	json_writer_begin_object(&w);
+	
+	json_writer_key(&w, "pipe");
+	get_json_object_channel_writer(chan, &w);
+	
+	sprintf(tmp, "%u", offset);
+	json_writer_key(&w, "offset");
+	json_writer_string(&w, tmp);
+	
+	sprintf(tmp, "%u", nmembers);
+	json_writer_key(&w, "count");
+	json_writer_string(&w, tmp);
+	
+	json_writer_key(&w, "users");
+	if (chan->interactive) {
+		get_json_channel_users_writer(chan, offset, (g_ape->roster.page ? g_ape->roster.page : nmembers), &w);
+	} else {
+		json_writer_begin_array(&w);
+		json_writer_end_array(&w);
+	}
+	json_writer_end_object(&w);
+	
+	return forge_raw_end(&w);
+}
+
@@ -24,6 +24,8 @@
 
 #include "main.h"
 
+struct _json_writer;
+
 
 #define MAX_TOPIC_LEN 128
 #define DEFAULT_TOPIC "Chat%20powered%20by%20AJAX%20Chat%20Engine\0"
@@ -35,16 +37,33 @@ typedef struct CHANNEL
 
 	struct _transpipe *pipe;
 	
-	struct userslist *head;
+	/* Members : dense array (fanout) and an index by USERS pointer */
+	struct _chan_member *members;
+	unsigned int nmembers;
+	unsigned int members_size;
+	
+	struct userslist **members_index;
+	unsigned int members_index_size;
 	
 	struct BANNED *banned;
 	
 	struct _extend *properties;
 	
 	int interactive;
+	
+	/* JOIN/LEFT/SETLVL waiting for the next PRESENCE raw (see presence_flush()) */
+	struct _presence *presence;
+	struct CHANNEL *presence_next;
+	struct CHANNEL **presence_pprev;
 
 } CHANNEL;
 
+struct _chan_member
+{
+	struct USERS *user;
+	struct userslist *ulist;
+};
+
 typedef struct BANNED
 {
 	char ip[16];
@@ -72,7 +91,6 @@ void ban(CHANNEL *chan, struct USERS *banner, const char *ip, char *reason, unsi
 void rmban(CHANNEL *chan, const char *ip);
 void rmallban(CHANNEL *chan);
 
-struct userslist *getlist(const char *chan, acetables *g_ape);
 struct userslist *getuchan(struct USERS *user, CHANNEL *chan);
 	
 unsigned int setlevel(struct USERS *user_actif, struct USERS *user_passif, CHANNEL *chan, unsigned int lvl, acetables *g_ape);
@@ -80,6 +98,12 @@ unsigned int settopic(struct USERS *user, CHANNEL *chan, const char *topic, acet
 unsigned int isvalidchan(char *name);
 
 struct json *get_json_object_channel(CHANNEL *chan);
+struct _extend_cache *get_json_object_channel_cache(CHANNEL *chan);
+void get_json_object_channel_writer(CHANNEL *chan, struct _json_writer *w);
+void get_json_channel_users_writer(CHANNEL *chan, unsigned int offset, unsigned int limit, struct _json_writer *w);
+struct RAW *forge_channel_raw(CHANNEL *chan, acetables *g_ape);
+struct RAW *forge_roster_raw(CHANNEL *chan, unsigned int offset, acetables *g_ape);
+void presence_flush(acetables *g_ape);
 
 #endif
 
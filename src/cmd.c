@@ -27,21 +27,53 @@
 #include "utils.h"
 #include "proxy.h"
 #include "raw.h"
+#include "websocket.h"
+#include "sse.h"
+
+static const cmd_param connect_params[] = {
+	{"transport",	JSON_T_INTEGER,	0},
+	{NULL}
+};
+
+static const cmd_param send_params[] = {
+	{"msg",		JSON_T_STRING,	1},
+	{"pipe",	JSON_T_STRING,	1},
+	{NULL}
+};
+
+static const cmd_param channel_params[] = {
+	{"channel",	JSON_T_STRING,	1},
+	{NULL}
+};
+
+static const cmd_param roster_params[] = {
+	{"channel",	JSON_T_STRING,	1},
+	{"offset",	JSON_T_INTEGER,	0},
+	{NULL}
+};
+
+/* Request members */
+static json_path path_cmd, path_sessid, path_params;
 
 void do_register(acetables *g_ape) // register_raw("CMD", Nparam (without IP and time, with sessid), callback_func, NEEDSOMETHING?, g_ape);
 {
-	register_cmd("CONNECT",		cmd_connect, 	NEED_NOTHING, g_ape);
+	json_path_compile(&path_cmd, "cmd");
+	json_path_compile(&path_sessid, "sessid");
+	json_path_compile(&path_params, "params");
+	
+	register_cmd_params("CONNECT",	cmd_connect, 	NEED_NOTHING, connect_params, g_ape);
 	register_cmd("PCONNECT",	cmd_pconnect, 	NEED_NOTHING, g_ape);
 	register_cmd("SCRIPT",        	cmd_script,		NEED_NOTHING, g_ape);
 	
 	register_cmd("CHECK", 		cmd_check, 		NEED_SESSID, g_ape);
-	register_cmd("SEND", 		cmd_send, 		NEED_SESSID, g_ape);
+	register_cmd_params("SEND", 	cmd_send, 		NEED_SESSID, send_params, g_ape);
 
 	register_cmd("QUIT", 		cmd_quit, 		NEED_SESSID, g_ape);
 	//register_cmd("SETLEVEL", 	cmd_setlevel, 	NEED_SESSID, g_ape); // Module
 	//register_cmd("SETTOPIC", 	cmd_settopic, 	NEED_SESSID, g_ape); // Module
-	register_cmd("JOIN", 		cmd_join, 		NEED_SESSID, g_ape);
-	register_cmd("LEFT", 		cmd_left, 		NEED_SESSID, g_ape);
+	register_cmd_params("JOIN", 	cmd_join, 		NEED_SESSID, channel_params, g_ape);
+	register_cmd_params("LEFT", 	cmd_left, 		NEED_SESSID, channel_params, g_ape);
+	register_cmd_params("ROSTER", 	cmd_roster, 		NEED_SESSID, roster_params, g_ape);
 	//register_cmd("KICK", 		cmd_kick, 		NEED_SESSID, g_ape); // Module
 	//register_cmd("BAN",		cmd_ban,		NEED_SESSID, g_ape); // Module
 	//register_cmd("SESSION",        	cmd_session,		NEED_SESSID, g_ape);
@@ -53,6 +85,12 @@ void do_register(acetables *g_ape) // register_raw("CMD", Nparam (without IP and
 }
 
 void register_cmd(const char *cmd, unsigned int (*func)(callbackp *), unsigned int need, acetables *g_ape)
+{
+	register_cmd_params(cmd, func, need, NULL, g_ape);
+}
+
+/* Old callbacks are never free'd : a callback pointer identifies a schema (see cmd_param_ref) */
+void register_cmd_params(const char *cmd, unsigned int (*func)(callbackp *), unsigned int need, const cmd_param *params, acetables *g_ape)
 {
 	callback *new_cmd, *old_cmd;
 	
@@ -60,6 +98,13 @@ void register_cmd(const char *cmd, unsigned int (*func)(callbackp *), unsigned i
 
 	new_cmd->func = func;
 	new_cmd->need = need;
+	new_cmd->nparams = 0;
+	
+	for (; params != NULL && params->key != NULL && new_cmd->nparams < CMD_MAX_PARAMS; params++) {
+		new_cmd->params[new_cmd->nparams].decl = *params;
+		new_cmd->params[new_cmd->nparams].len = strlen(params->key);
+		new_cmd->nparams++;
+	}
 	
 	/* Unregister old cmd if exists */
 	if ((old_cmd = (callback *)hashtbl_seek(g_ape->hCallback, cmd)) != NULL) {
@@ -75,19 +120,84 @@ void unregister_cmd(const char *cmd, acetables *g_ape)
 	hashtbl_erase(g_ape->hCallback, cmd);
 }
 
-unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
+/* One pass over "params" for all the declared params. Returns 0 if one is missing or has a bad type */
+static int cmd_params_extract(callbackp *cp)
+{
+	callback *cmd = cp->cmd;
+	json_item *item;
+	int i;
+	
+	for (i = 0; i < cmd->nparams; i++) {
+		cp->values[i] = NULL;
+	}
+	
+	for (item = cp->param; item != NULL; item = item->next) {
+		if (item->key.val == NULL) {
+			continue;
+		}
+		for (i = 0; i < cmd->nparams; i++) {
+			if (cp->values[i] == NULL && item->key.len == cmd->params[i].len &&
+				strncasecmp(item->key.val, cmd->params[i].decl.key, item->key.len) == 0) {
+				
+				cp->values[i] = (item->child != NULL ? item->child : item);
+				break;
+			}
+		}
+	}
+	
+	for (i = 0; i < cmd->nparams; i++) {
+		if (cp->values[i] == NULL) {
+			if (cmd->params[i].decl.required) {
+				return 0;
+			}
+		} else if (cmd->params[i].decl.type != JSON_T_NONE && cp->values[i]->type != cmd->params[i].decl.type) {
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+/* Declared params are read from the extracted values, others are looked up in the tree */
+json_item *cmd_param_lookup(callbackp *callbacki, cmd_param_ref *ref)
+{
+	if (ref->path.depth == 0) {
+		json_path_compile(&ref->path, ref->key);
+	}
+	
+	if (ref->cmd != callbacki->cmd) {
+		int i;
+		
+		ref->cmd = callbacki->cmd;
+		ref->slot = -1;
+		
+		for (i = 0; ref->path.depth == 1 && i < ref->cmd->nparams; i++) {
+			if (ref->path.key[0].len == ref->cmd->params[i].len && 
+				strncasecmp(ref->key, ref->cmd->params[i].decl.key, ref->path.key[0].len) == 0) {
+				
+				ref->slot = i;
+				break;
+			}
+		}
+	}
+	
+	if (ref->slot != -1) {
+		return callbacki->values[ref->slot];
+	}
+	return json_path_lookup(callbacki->param, &ref->path);
+}
+
+static unsigned int checkcmd_json(json_item *ijson, clientget *cget, subuser **iuser, acetables *g_ape)
 {
 
 	callback *cmdback;
-	json_item *ijson, *rjson;
+	json_item *rjson;
 	
 	unsigned int flag;
 	
 	USERS *guser = NULL;
 	subuser *sub = NULL;
 
-	ijson = init_json_parser(cget->get);
-
 	/*nTok = explode('&', cget->get, param, 64);
 	
 	if (nTok < 1) {
@@ -99,18 +209,18 @@ unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
 
 	if (ijson == NULL || ijson->child == NULL) {
 		SENDH(cget->fdclient, ERR_BAD_JSON, g_ape);
-	} else if ((rjson = json_lookup(ijson->child, "cmd")) != NULL &&
-			rjson->jval.vu.str.value != NULL && 
+	} else if ((rjson = json_path_lookup(ijson->child, &path_cmd)) != NULL &&
+			rjson->type == JSON_T_STRING && 
 			(cmdback = (callback *)hashtbl_seek(g_ape->hCallback, rjson->jval.vu.str.value)) != NULL) {
 
-		int tmpfd = 0;
+		int tmpfd = 0, control = 0;
 		callbackp cp;
 		switch(cmdback->need) {
 			case NEED_SESSID:
 				{
 					json_item *jsid;
 				
-					if ((jsid = json_lookup(ijson->child, "sessid")) != NULL && jsid->jval.vu.str.value != NULL) {
+					if ((jsid = json_path_lookup(ijson->child, &path_sessid)) != NULL && jsid->type == JSON_T_STRING) {
 						guser = seek_user_id(jsid->jval.vu.str.value, g_ape);
 					}
 				}
@@ -127,17 +237,21 @@ unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
 				return (CONNECT_SHUTDOWN);
 			} else {
 				sub = getsubuser(guser, cget->host);
-				if (sub != NULL && sub->fd != cget->fdclient && sub->state == ALIVE) {
+				if (guser->transport == TRANSPORT_SSE && !sse_is_stream(cget->fdclient, g_ape)) {
+					/* Sent beside the event stream : RAWs are only sent on the stream */
+					control = 1;
+				} else if (sub != NULL && sub->fd != cget->fdclient && sub->state == ALIVE) {
 					if (guser->transport == TRANSPORT_IFRAME) {
 						/* iframe is already open on "sub" */
-						tmpfd = sub->fd; /* Forward data directly to iframe */
-						CLOSE(cget->fdclient, g_ape);
-						shutdown(cget->fdclient, 2); /* Immediatly close controller */
+						tmpfd = sub->fd; /* Forward data directly to iframe (controller is closed below) */
 					} else {
-						/* Only one connection is allowed per user/host */
-						CLOSE(sub->fd, g_ape);
-						shutdown(sub->fd, 2);
+						/* Only one connection is allowed per user/host (nothing but events on a stream) */
+						if (guser->transport != TRANSPORT_SSE) {
+							CLOSE(sub->fd, g_ape);
+						}
+						http_end(sub->fd, g_ape);
 						sub->state = ADIED;
+						sub->headers_sent = 0;
 						sub->fd = cget->fdclient;					
 					}
 				} else if (sub == NULL) {
@@ -148,18 +262,21 @@ unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
 				} else if (sub != NULL) {
 					sub->fd = cget->fdclient;
 				}
-				guser->idle = (long int)time(NULL); // update user idle
-
-				sub->idle = guser->idle; // Update subuser idle
+				touch_user(guser, g_ape); // update user idle
+				
+				if (sub != NULL) {
+					touch_subuser(sub, g_ape); // Update subuser idle
+				}
 			}
 		}
-		cp.param = json_lookup(ijson->child, "params");
+		cp.param = json_path_lookup(ijson->child, &path_params);
+		cp.cmd = cmdback;
 		cp.fdclient = (tmpfd ? tmpfd : cget->fdclient);
 		cp.call_user = guser;
 		cp.g_ape = g_ape;
 		cp.host = cget->host;
 		
-		flag = cmdback->func(&cp);
+		flag = (cmd_params_extract(&cp) ? cmdback->func(&cp) : RETURN_BAD_PARAMS);
 		
 		if (flag & RETURN_NULL) {
 			guser = NULL;
@@ -169,9 +286,19 @@ unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
 			guser = NULL;
 			SENDH(cget->fdclient, ERR_BAD_PARAM, g_ape);
 		}
+		if (tmpfd && !(flag & RETURN_BAD_PARAMS)) {
+			/* Only once the command is done : an error is the controller's response */
+			CLOSE(cget->fdclient, g_ape);
+			http_end(cget->fdclient, g_ape); /* Immediatly close controller */
+		}
 		
 		if (guser != NULL) {
-
+			
+			if (control) {
+				/* Nothing will be sent on this connection */
+				CLOSE(cget->fdclient, g_ape);
+				return (CONNECT_SHUTDOWN);
+			}
 			if (sub == NULL && (sub = getsubuser(guser, cget->host)) == NULL) {
 				
 				if ((sub = addsubuser(cget->fdclient, cget->host, guser, g_ape)) == NULL) {
@@ -180,7 +307,7 @@ unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
 				subuser_restor(sub, g_ape);
 				
 				if (guser->transport == TRANSPORT_IFRAME) {
-					sendbin(sub->fd, HEADER, strlen(HEADER), g_ape);
+					http_send_header(sub->fd, -1, g_ape);
 				}			
 			}
 
@@ -193,6 +320,15 @@ unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
 			/* If tmpfd is set, we do not have reasons to change this state */
 			if (!tmpfd) {
 				sub->state = ALIVE;
+				
+				if (guser->transport == TRANSPORT_SSE && !sub->headers_sent) {
+					sse_start(sub, g_ape);
+				}
+				
+				/* Send what is already queued as soon as the request is processed */
+				if (sub->nraw) {
+					subuser_ready(sub, g_ape);
+				}
 			}
 			return (CONNECT_KEEPALIVE);
 			
@@ -205,11 +341,25 @@ unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
 	return (CONNECT_SHUTDOWN);
 }
 
+unsigned int checkcmd(clientget *cget, subuser **iuser, acetables *g_ape)
+{
+	json_arena arena = {NULL};
+	unsigned int ret;
+	
+	/* The parse tree (and the params given to the command) only live during the call */
+	ret = checkcmd_json(init_json_parser(cget->get, &arena), cget, iuser, g_ape);
+	
+	json_arena_release(&arena);
+	
+	return ret;
+}
+
 unsigned int cmd_connect(callbackp *callbacki)
 {
 	USERS *nuser;
 	RAW *newraw;
 	struct json *jstr = NULL;
+	char sessid[APE_ID_HEX_LEN + 1];
 	
 	APE_PARAMS_INIT();
 	
@@ -223,7 +373,15 @@ unsigned int cmd_connect(callbackp *callbacki)
 		return (RETURN_NOTHING);
 	}
 	
-	if (JINT(transport) == 2) {
+	if (sse_is_stream(callbacki->fdclient, callbacki->g_ape)) {
+		/* EventSource : other commands are sent beside the stream */
+		nuser->transport = TRANSPORT_SSE;
+		nuser->flags |= FLG_PCONNECT;
+	} else if (websocket_is_open(callbacki->fdclient, callbacki->g_ape)) {
+		/* Each batch is a message : the subuser stays alive as long as the WebSocket (see websocket_ping()) */
+		nuser->transport = TRANSPORT_WEBSOCKET;
+		nuser->flags |= FLG_PCONNECT;
+	} else if (JINT(transport) == 2) {
 		nuser->transport = TRANSPORT_IFRAME;
 		nuser->flags |= FLG_PCONNECT;
 	} else {
@@ -232,7 +390,7 @@ unsigned int cmd_connect(callbackp *callbacki)
 	
 	subuser_restor(getsubuser(callbacki->call_user, callbacki->host), callbacki->g_ape);
 	
-	set_json("sessid", nuser->sessid, &jstr);
+	set_json("sessid", ape_id_encode(&nuser->id, sessid), &jstr);
 	
 	newraw = forge_raw(RAW_LOGIN, jstr);
 	newraw->priority = 1;
@@ -399,6 +557,34 @@ unsigned int cmd_left(callbackp *callbacki)
 	return (RETURN_BAD_PARAMS);
 }
 
+unsigned int cmd_roster(callbackp *callbacki)
+{
+	CHANNEL *chan;
+	char *chan_name;
+	int offset;
+	
+	APE_PARAMS_INIT();
+	
+	if ((chan_name = JSTR(channel)) != NULL) {
+		
+		if ((chan = getchan(chan_name, callbacki->g_ape)) == NULL) {
+			send_error(callbacki->call_user, "UNKNOWN_CHANNEL", "103", callbacki->g_ape);
+		
+		} else if (!isonchannel(callbacki->call_user, chan)) {
+			send_error(callbacki->call_user, "NOT_IN_CHANNEL", "104", callbacki->g_ape);
+	
+		} else {
+			offset = JINT(offset);
+			
+			post_raw(forge_roster_raw(chan, (offset > 0 ? offset : 0), callbacki->g_ape), callbacki->call_user, callbacki->g_ape);
+		}
+		
+		return (RETURN_NOTHING);
+	}
+	
+	return (RETURN_BAD_PARAMS);
+}
+
 #if 0
 unsigned int cmd_settopic(callbackp *callbacki)
 {
@@ -425,9 +611,9 @@ unsigned int cmd_kick(callbackp *callbacki)
 		send_error(callbacki->call_user, "CANT_KICK", "105", callbacki->g_ape);
 		
 	} else {
-		victim = seek_user(callbacki->param[3], chan->pipe->pubid, callbacki->g_ape);
+		victim = seek_user_simple(callbacki->param[3], callbacki->g_ape);
 		
-		if (victim == NULL) {
+		if (victim == NULL || !isonchannel(victim, chan)) {
 
 			send_error(callbacki->call_user, "UNKNOWN_USER", "102", callbacki->g_ape);
 		} else if (victim->flags & FLG_NOKICK) {
@@ -598,7 +784,7 @@ unsigned int cmd_proxy_connect(callbackp *callbacki)
 	if (proxy == NULL) {
 		send_error(callbacki->call_user, "PROXY_INIT_ERROR", "204", callbacki->g_ape);
 	} else {
-		proxy_attach(proxy, callbacki->call_user->pipe->pubid, 1, callbacki->g_ape);
+		proxy_attach(proxy, callbacki->call_user->pipe, 1, callbacki->g_ape);
 		
 		set_json("pipe", NULL, &jlist);
 		json_attach(jlist, get_json_object_proxy(proxy), JSON_OBJECT);
@@ -614,7 +800,7 @@ unsigned int cmd_proxy_write(callbackp *callbacki)
 {
 	ape_proxy *proxy;
 
-	if ((proxy = proxy_are_linked(callbacki->call_user->pipe->pubid, callbacki->param[2], callbacki->g_ape)) == NULL) {
+	if ((proxy = proxy_are_linked(callbacki->call_user->pipe, callbacki->param[2], callbacki->g_ape)) == NULL) {
 		send_error(callbacki->call_user, "UNKNOWN_PIPE", "109", callbacki->g_ape);
 	} else if (proxy->state != PROXY_CONNECTED) {
 		send_error(callbacki->call_user, "PROXY_NOT_CONNETED", "205", callbacki->g_ape);
@@ -60,13 +60,43 @@ void do_register(acetables *g_ape);
 #define RETURN_NOTHING 		0x10
 #define RETURN_BAD_PARAMS 	0x20
 
+/*
+	Parameters schema of a command (terminated by a NULL key) :
+	declared params are extracted from "params" in one pass before the callback
+	is called, a missing required param or a bad type gives BAD_PARAM.
+*/
+#define CMD_MAX_PARAMS 8
+
 typedef struct _callbackp callbackp;
 
+typedef struct _cmd_param
+{
+	const char *key;
+	int type; /* JSON_T_* (JSON_T_NONE : any) */
+	int required;
+} cmd_param;
+
+typedef struct callback
+{
+	unsigned int need; /* Need SESSID ? */
+	unsigned int (*func)(struct _callbackp *); /* Callback func */
+	
+	int nparams;
+	struct {
+		cmd_param decl;
+		size_t len;
+	} params[CMD_MAX_PARAMS];
+} callback;
+
 struct _callbackp
 {
 
 	json_item *param;
 	
+	/* Values of the declared params (NULL if not given) */
+	callback *cmd;
+	json_item *values[CMD_MAX_PARAMS];
+	
 	unsigned int fdclient;
 	struct USERS *call_user;
 	char *host;
@@ -74,12 +104,32 @@ struct _callbackp
 	acetables *g_ape;
 };
 
-
-typedef struct callback
+/* A JSTR()/JINT()/JFLOAT() call site : its path is compiled once and bound to a schema slot */
+typedef struct _cmd_param_ref
 {
-	unsigned int need; /* Need SESSID ? */
-	unsigned int (*func)(struct _callbackp *); /* Callback func */
-} callback;
+	const char *key;
+	json_path path;
+	
+	callback *cmd; /* Schema "slot" was resolved for */
+	int slot;
+} cmd_param_ref;
+
+#define APE_PARAMS_INIT() \
+	json_item *json_params = NULL
+
+#define JPARAM(key) \
+	({ static cmd_param_ref _ref = {#key, {0}, NULL, -1}; cmd_param_lookup(callbacki, &_ref); })
+
+#define JSTR(key) \
+	(char *)((json_params = JPARAM(key)) != NULL && json_params->type == JSON_T_STRING ? json_params->jval.vu.str.value : NULL)
+
+#define JINT(key) \
+	(int)((json_params = JPARAM(key)) != NULL && json_params->type != JSON_T_STRING && json_params->type != JSON_T_FLOAT ? json_params->jval.vu.integer_value : 0)
+	
+#define JFLOAT(key) \
+	((json_params = JPARAM(key)) == NULL ? 0. : \
+		(json_params->type == JSON_T_FLOAT ? json_params->jval.vu.float_value : \
+		(json_params->type == JSON_T_INTEGER ? (long double)json_params->jval.vu.integer_value : 0.)))
 
 
 
@@ -99,6 +149,7 @@ unsigned int cmd_setlevel(struct _callbackp *);
 unsigned int cmd_settopic(struct _callbackp *);
 unsigned int cmd_join(struct _callbackp *);
 unsigned int cmd_left(struct _callbackp *);
+unsigned int cmd_roster(struct _callbackp *);
 unsigned int cmd_kick(struct _callbackp *);
 unsigned int cmd_ban(struct _callbackp *);
 unsigned int cmd_session(struct _callbackp *);
@@ -109,6 +160,8 @@ unsigned int cmd_proxy_connect(struct _callbackp *);
 unsigned int cmd_proxy_write(struct _callbackp *);
 ///////////////////////////////////////////////////////////////////////////////////////////////
 void register_cmd(const char *cmd, unsigned int (*func)(callbackp *), unsigned int need, acetables *g_ape);
+void register_cmd_params(const char *cmd, unsigned int (*func)(callbackp *), unsigned int need, const cmd_param *params, acetables *g_ape);
+json_item *cmd_param_lookup(callbackp *callbacki, cmd_param_ref *ref);
 void unregister_cmd(const char *cmd, acetables *g_ape);
 
 #endif
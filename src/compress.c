@@ -0,0 +1,316 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* compress.c */
+
+#include <time.h>
+
+#include "compress.h"
+#include "sock.h"
+#include "websocket.h"
+#include "utils.h"
+
+static const char *encodings[] = {"gzip", "deflate"};
+
+struct _compress *compress_init(int min)
+{
+	struct _compress *c = xmalloc(sizeof(*c));
+	
+	memset(c, 0, sizeof(*c));
+	
+	c->min = min;
+	c->size = COMPRESS_BUFFER_SIZE;
+	c->buf = xmalloc(sizeof(char) * c->size);
+	
+	return c;
+}
+
+static void deflate_init(z_stream *z, int mode, int wbits, int memlevel)
+{
+	z->zalloc = Z_NULL;
+	z->zfree = Z_NULL;
+	z->opaque = Z_NULL;
+	
+	/* windowBits : +16 for a gzip wrapper, negative for raw deflate */
+	deflateInit2(z, COMPRESS_LEVEL, Z_DEFLATED, (mode == COMPRESS_GZIP ? wbits + 16 : (mode == COMPRESS_RAW ? -wbits : wbits)), 
+		memlevel, Z_DEFAULT_STRATEGY);
+}
+
+static struct _deflate *deflate_new(int mode)
+{
+	struct _deflate *d = xmalloc(sizeof(*d));
+	
+	deflate_init(&d->z, mode, COMPRESS_STREAM_WBITS, COMPRESS_STREAM_MEMLEVEL);
+	d->on = 0;
+	d->skip = 0;
+	
+	return d;
+}
+
+/* Compress "iov" into c->buf, the output length is returned */
+static int deflate_iov(z_stream *z, struct iovec *iov, int iovcnt, int flush, struct _compress *c)
+{
+	struct timespec start, end;
+	int i, mode, ret, len, in = 0;
+	
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	
+	z->next_out = (Bytef *)c->buf;
+	z->avail_out = c->size;
+	
+	for (i = 0; i < iovcnt; i++) {
+		mode = (i == iovcnt - 1 ? flush : Z_NO_FLUSH);
+		
+		z->next_in = (Bytef *)iov[i].iov_base;
+		z->avail_in = iov[i].iov_len;
+		in += iov[i].iov_len;
+		
+		while (1) {
+			if (z->avail_out == 0) {
+				len = c->size;
+				
+				c->size *= 2;
+				c->buf = xrealloc(c->buf, sizeof(char) * c->size);
+				
+				z->next_out = (Bytef *)&c->buf[len];
+				z->avail_out = c->size - len;
+			}
+			ret = deflate(z, mode);
+			
+			/* Z_FINISH is done at Z_STREAM_END, the others once the output isn't full */
+			if (mode == Z_FINISH ? ret == Z_STREAM_END : (z->avail_in == 0 && z->avail_out != 0)) {
+				break;
+			}
+		}
+	}
+	len = c->size - z->avail_out;
+	
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	
+	c->stats.calls++;
+	c->stats.in += in;
+	c->stats.out += len;
+	c->stats.nsec += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+	
+	return len;
+}
+
+static void release_refs(struct _socks_ref *refs, int n)
+{
+	int i;
+	
+	for (i = 0; refs != NULL && i < n; i++) {
+		if (refs[i].release != NULL) {
+			refs[i].release(refs[i].ref);
+		}
+	}
+}
+
+/* Content-Encoding accepted by the client of "co" (NULL : none) */
+const char *compress_stream_encoding(connection *co, acetables *g_ape)
+{
+	if (g_ape->compress->min < 0 || co->websocket != NULL) {
+		return NULL;
+	}
+	if (co->http.encoding & HTTP_ENCODING_GZIP) {
+		return encodings[COMPRESS_GZIP];
+	} else if (co->http.encoding & HTTP_ENCODING_DEFLATE) {
+		return encodings[COMPRESS_DEFLATE];
+	}
+	return NULL;
+}
+
+/*
+	Header of a streamed response (iframe, event stream) : "fields" + Content-Encoding.
+	If the body is encoded, the connection compresses what follows the header (see compress_sendv())
+	with one context : each message benefits from the previous ones.
+*/
+int compress_stream_header(connection *co, char *buf, const char *fields, acetables *g_ape)
+{
+	const char *encoding = compress_stream_encoding(co, g_ape);
+	int len;
+	
+	if (encoding == NULL) {
+		return sprintf(buf, "%s\r\n", fields);
+	}
+	len = sprintf(buf, "%sContent-Encoding: %s\r\n\r\n", fields, encoding);
+	
+	if (co->deflate == NULL) {
+		co->deflate = deflate_new(encoding == encodings[COMPRESS_GZIP] ? COMPRESS_GZIP : COMPRESS_DEFLATE);
+	}
+	co->deflate->on = 1;
+	co->deflate->skip = len;
+	
+	return len;
+}
+
+/* permessage-deflate accepted (see websocket_accept()) */
+void compress_ws_start(connection *co, acetables *g_ape)
+{
+	co->deflate = deflate_new(COMPRESS_RAW);
+}
+
+/*
+	sendbinv() of a compressed stream : written as a single flushed block.
+	The data is copied, refs are released here.
+*/
+int compress_sendv(int fd, struct iovec *iov, struct _socks_ref *refs, int iovcnt, acetables *g_ape)
+{
+	struct _deflate *d = g_ape->co[fd].deflate;
+	int i = 0, len, finish = 1;
+	
+	d->on = 0;
+	
+	/* The header is sent as is */
+	while (d->skip && i < iovcnt) {
+		len = ((int)iov[i].iov_len < d->skip ? (int)iov[i].iov_len : d->skip);
+		finish = sendbin(fd, iov[i].iov_base, len, g_ape);
+		d->skip -= len;
+		
+		if (len == iov[i].iov_len) {
+			i++;
+		} else {
+			iov[i].iov_base = (char *)iov[i].iov_base + len;
+			iov[i].iov_len -= len;
+		}
+	}
+	if (i < iovcnt) {
+		len = deflate_iov(&d->z, &iov[i], iovcnt - i, Z_SYNC_FLUSH, g_ape->compress);
+		finish = sendbin(fd, g_ape->compress->buf, len, g_ape);
+	}
+	d->on = 1;
+	
+	release_refs(refs, iovcnt);
+	
+	return finish;
+}
+
+/*
+	Framed response of send_raws() : "iov" (the body) is compressed at once and sent with its own header.
+	WebSocket messages use the connection context (permessage-deflate), HTTP responses
+	are only compressed above compress->min.
+	-1 : not compressed, nothing sent
+*/
+int compress_response(int fd, struct iovec *iov, struct _socks_ref *refs, int iovcnt, int len, acetables *g_ape)
+{
+	connection *co = &g_ape->co[fd];
+	struct _compress *c = g_ape->compress;
+	char header[HTTP_HEADER_MAX];
+	int hlen, mode, finish;
+	
+	if (c->min < 0 || iovcnt == 0) {
+		return -1;
+	}
+	if (co->websocket != NULL) {
+		if (co->deflate == NULL || !websocket_is_open(fd, g_ape)) {
+			return -1;
+		}
+		/* The final empty block (00 00 ff ff) is implied */
+		len = deflate_iov(&co->deflate->z, iov, iovcnt, Z_SYNC_FLUSH, c) - 4;
+		hlen = websocket_frame_header(header, WS_TEXT | WS_RSV1, len);
+	} else {
+		if (len < c->min || co->http.encoding == 0) {
+			return -1;
+		}
+		mode = (co->http.encoding & HTTP_ENCODING_GZIP ? COMPRESS_GZIP : COMPRESS_DEFLATE);
+		
+		if (!c->oneshot_init[mode]) {
+			deflate_init(&c->oneshot[mode], mode, MAX_WBITS, MAX_MEM_LEVEL);
+			c->oneshot_init[mode] = 1;
+		} else {
+			deflateReset(&c->oneshot[mode]);
+		}
+		len = deflate_iov(&c->oneshot[mode], iov, iovcnt, Z_FINISH, c);
+		hlen = http_header_encoded(fd, header, len, encodings[mode], g_ape);
+	}
+	release_refs(refs, iovcnt);
+	
+	sendbin(fd, header, hlen, g_ape);
+	finish = sendbin(fd, c->buf, len, g_ape);
+	
+	return finish;
+}
+
+/* Compressed WebSocket message, *out is valid until the next call. -1 : corrupted or too large */
+int compress_inflate(char *in, int len, char **out, acetables *g_ape)
+{
+	static unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+	struct _compress *c = g_ape->compress;
+	z_stream *z = &c->inflater;
+	int ret;
+	
+	if (c->inflated == NULL) {
+		z->zalloc = Z_NULL;
+		z->zfree = Z_NULL;
+		z->opaque = Z_NULL;
+		z->next_in = Z_NULL;
+		z->avail_in = 0;
+		
+		inflateInit2(z, -MAX_WBITS);
+		c->inflated = xmalloc(sizeof(char) * (MAX_CONTENT_LENGTH + 1));
+	} else {
+		inflateReset(z);
+	}
+	z->next_out = (Bytef *)c->inflated;
+	z->avail_out = MAX_CONTENT_LENGTH;
+	
+	z->next_in = (Bytef *)in;
+	z->avail_in = len;
+	
+	ret = inflate(z, Z_SYNC_FLUSH);
+	
+	if (ret == Z_OK || ret == Z_BUF_ERROR) {
+		if (z->avail_in != 0) {
+			return -1;
+		}
+		z->next_in = tail;
+		z->avail_in = 4;
+		
+		ret = inflate(z, Z_SYNC_FLUSH);
+	}
+	if ((ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) || (ret != Z_STREAM_END && z->avail_in != 0)) {
+		return -1;
+	}
+	len = MAX_CONTENT_LENGTH - z->avail_out;
+	c->inflated[len] = '\0';
+	
+	*out = c->inflated;
+	
+	return len;
+}
+
+/* Called when the socket is closed */
+void compress_free(connection *co)
+{
+	if (co->deflate != NULL) {
+		deflateEnd(&co->deflate->z);
+		free(co->deflate);
+		co->deflate = NULL;
+	}
+}
+
+void compress_stats(FILE *out, acetables *g_ape)
+{
+	struct _compress *c = g_ape->compress;
+	
+	fprintf(out, "[compress] %lu blocks, %llu => %llu bytes (%llu%%), cpu %llu us (%llu ns/KB)\n", c->stats.calls, 
+		c->stats.in, c->stats.out, (c->stats.in ? c->stats.out * 100 / c->stats.in : 0), 
+		c->stats.nsec / 1000, (c->stats.in ? c->stats.nsec * 1024 / c->stats.in : 0));
+	fflush(out);
+}
@@ -0,0 +1,88 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* compress.h */
+
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stdio.h>
+#include <zlib.h>
+
+#include "main.h"
+#include "http.h"
+
+#define COMPRESS_LEVEL Z_DEFAULT_COMPRESSION
+#define COMPRESS_BUFFER_SIZE 16384 // Initial size of the output buffer (grows)
+
+/* Streams keep a context per connection : smaller window (8KB) and memLevel (~48KB each) */
+#define COMPRESS_STREAM_WBITS 13
+#define COMPRESS_STREAM_MEMLEVEL 5
+
+enum {
+	COMPRESS_GZIP = 0,
+	COMPRESS_DEFLATE,
+	COMPRESS_RAW /* WebSocket permessage-deflate */
+};
+
+/* Deflate context of a connection (connection::deflate), kept from one message to the next */
+struct _deflate
+{
+	z_stream z;
+	
+	/* Streamed response : what is written after the first "skip" bytes (header) is compressed */
+	int on;
+	int skip;
+};
+
+/* g_ape->compress */
+struct _compress
+{
+	int min; /* Smaller framed responses are sent as is, -1 : compression disabled */
+	
+	/* Framed responses are compressed at once, the contexts are reused */
+	z_stream oneshot[2];
+	int oneshot_init[2];
+	
+	/* WebSocket messages from clients (client_no_context_takeover) */
+	z_stream inflater;
+	char *inflated;
+	
+	char *buf;
+	unsigned int size;
+	
+	struct {
+		unsigned long calls;
+		unsigned long long in;
+		unsigned long long out;
+		unsigned long long nsec; /* CPU time */
+	} stats;
+};
+
+struct _compress *compress_init(int min);
+const char *compress_stream_encoding(connection *co, acetables *g_ape);
+int compress_stream_header(connection *co, char *buf, const char *fields, acetables *g_ape);
+void compress_ws_start(connection *co, acetables *g_ape);
+int compress_sendv(int fd, struct iovec *iov, struct _socks_ref *refs, int iovcnt, acetables *g_ape);
+int compress_response(int fd, struct iovec *iov, struct _socks_ref *refs, int iovcnt, int len, acetables *g_ape);
+int compress_inflate(char *in, int len, char **out, acetables *g_ape);
+void compress_free(connection *co);
+void compress_stats(FILE *out, acetables *g_ape);
+
+#endif
@@ -34,6 +34,10 @@
 #include "utils.h"
 #include "ticks.h"
 #include "proxy.h"
+#include "slab.h"
+#include "websocket.h"
+#include "sse.h"
+#include "compress.h"
 
 #include <grp.h>
 #include <pwd.h>
@@ -41,12 +45,30 @@
 #define _VERSION "1.0-PRE1"
 
 
+static volatile sig_atomic_t slab_stats_requested = 0;
+
 static void signal_handler(int sign)
 {
 	printf("\nShutdown...!\n\n");
 	exit(1);
 }
 
+/* SIGUSR1 : allocators, output queues and compression statistics, printed by the next tick */
+static void signal_stats(int sign)
+{
+	slab_stats_requested = 1;
+}
+
+static void check_slab_stats(acetables *g_ape)
+{
+	if (slab_stats_requested) {
+		slab_stats_requested = 0;
+		slab_stats(stdout);
+		bufout_stats(stdout, g_ape);
+		compress_stats(stdout, g_ape);
+	}
+}
+
 static int inc_rlimit(int nofile)
 {
 	struct rlimit rl;
@@ -78,8 +100,8 @@ int main(int argc, char **argv)
 {
 	apeconfig *srv;
 	
-	int random, s_listen;
-	unsigned int getrandom;
+	int s_listen, nworkers, ticks_rate;
+	struct _socks_worker *workers = NULL;
 	int im_r00t = 0;
 	
 	char cfgfile[512] = APE_CONFIG_FILE;
@@ -127,24 +149,28 @@ int main(int argc, char **argv)
 
 	signal(SIGINT, &signal_handler);
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, &signal_stats);
 
 	
-	if (TICKS_RATE < 1) {
-		printf("[ERR] TICKS_RATE cant be less than 1\n");
+	/* Number of process_tick() per second */
+	if ((ticks_rate = atoi(CONFIG_VAL(Server, ticks_rate, srv))) == 0) {
+		ticks_rate = TICKS_RATE_DEFAULT;
+	} else if (ticks_rate < 1 || ticks_rate > TICKS_RATE_MAX) {
+		printf("[ERR] ticks_rate must be between 1 and %i\n", TICKS_RATE_MAX);
 		return 0;
 	}
 	
-	random = open("/dev/urandom", O_RDONLY);
-	if (!random) {
-		printf("Cannot open /dev/urandom... exiting\n");
-		return 0;
+	
+	/* Number of event loops (main loop included) */
+	if ((nworkers = atoi(CONFIG_VAL(Server, workers, srv))) < 1) {
+		nworkers = 1;
 	}
-	read(random, &getrandom, 3);
-	srand(getrandom);
-	close(random);
 	
+	if ((s_listen = newSockListen(atoi(CONFIG_VAL(Server, port, srv)), CONFIG_VAL(Server, ip_listen, srv), (nworkers > 1))) < 0) {
+		return 0;
+	}
 	
-	if ((s_listen = newSockListen(atoi(CONFIG_VAL(Server, port, srv)), CONFIG_VAL(Server, ip_listen, srv))) < 0) {
+	if (nworkers > 1 && (workers = sockworkers_init(nworkers - 1, atoi(CONFIG_VAL(Server, port, srv)), CONFIG_VAL(Server, ip_listen, srv))) == NULL) {
 		return 0;
 	}
 	
@@ -194,10 +220,10 @@ int main(int argc, char **argv)
 	g_ape = xmalloc(sizeof(*g_ape));
 	
 	g_ape->hLogin = hashtbl_init();
-	g_ape->hSessid = hashtbl_init();
+	g_ape->hSessid = idtbl_init();
 
 	g_ape->hLusers = hashtbl_init();
-	g_ape->hPubid = hashtbl_init();
+	g_ape->hPubid = idtbl_init();
 	
 
 	g_ape->srv = srv;
@@ -205,21 +231,51 @@ int main(int argc, char **argv)
 	g_ape->proxy.hosts = NULL;
 	g_ape->epoll_fd = NULL;
 	
+	g_ape->workers.list = workers;
+	g_ape->workers.n = nworkers - 1;
+	g_ape->workers.handoff = NULL;
+	
 	g_ape->hCallback = hashtbl_init();
 	
-	g_ape->bufout = NULL;
+	g_ape->output = NULL;
 
 	
 	g_ape->uHead = NULL;
 	
 	g_ape->nConnected = 0;
+	
+	g_ape->roster.page = atoi(CONFIG_VAL(Server, roster_page, srv));
+	
+	/* milliseconds to ticks, rounded up */
+	g_ape->presence.window = (atoi(CONFIG_VAL(Server, presence_window, srv)) * ticks_rate + 999) / 1000;
+	g_ape->presence.pending = NULL;
+	
+	/* Responses are compressed if the client accepts it, framed ones from compress_min bytes */
+	g_ape->compress = compress_init(strcmp(CONFIG_VAL(Server, compress, srv), "yes") == 0 ? atoi(CONFIG_VAL(Server, compress_min, srv)) : -1);
+	
+	g_ape->ready.head = NULL;
+	g_ape->ready.coalesce = atoi(CONFIG_VAL(Server, raw_coalesce, srv));
 	g_ape->plugins = NULL;
 	
 	g_ape->properties = NULL;
 	
-	g_ape->timers = NULL;
+	g_ape->timers = ticks_init();
+	g_ape->ticks_rate = ticks_rate;
 
-	add_ticked(check_timeout, g_ape);
+	g_ape->idle.uhead = NULL;
+	g_ape->idle.ufoot = NULL;
+	g_ape->idle.shead = NULL;
+	g_ape->idle.sfoot = NULL;
+	
+	add_periodical(1, 0, check_timeout, g_ape, g_ape);
+	add_periodical(WS_PING_SEC, 0, websocket_ping, g_ape, g_ape);
+	add_periodical(SSE_HEARTBEAT_SEC, 0, sse_heartbeat, g_ape, g_ape);
+	add_ticked(tick_users, g_ape);
+	add_ticked(check_slab_stats, g_ape);
+	
+	if (g_ape->roster.page || g_ape->presence.window) {
+		add_ticked(presence_flush, g_ape);
+	}
 	
 	
 	do_register(g_ape);
@@ -233,7 +289,7 @@ int main(int argc, char **argv)
 	/* Shutdown */
 	
 	hashtbl_free(g_ape->hLogin);
-	hashtbl_free(g_ape->hSessid);
+	idtbl_free(g_ape->hSessid);
 	hashtbl_free(g_ape->hLusers);
 	
 	hashtbl_free(g_ape->hCallback);
@@ -32,11 +32,26 @@
 	
 	EXTEND_STR : allocate memory for val and free it when the property is deleted
 	EXTEND_JSON : put the given "json" object on the properties. This object is free'ed using json_free when the property is deleted
+		(it must not be modified afterwards : call add_property() again with a new object)
 	EXTEND_POINTER : add a private pointer as property (must be private. see EXTEND_PUBLIC)
+	EXTEND_CACHE : reserved (see set_property_cache)
 	
 	EXTEND_ISPUBLIC : The property is added to the json tree sent with get_json_object_*
 	EXTEND_ISPRIVATE : The property is not shown in get_json_object_*
 */
+/* The cached descriptor is out of date as soon as the list changes */
+static void drop_property_cache(extend **entry)
+{
+	extend *pEntry = *entry;
+	
+	if (pEntry != NULL && pEntry->type == EXTEND_CACHE) {
+		*entry = pEntry->next;
+		
+		free(pEntry->val);
+		free(pEntry);
+	}
+}
+
 extend *add_property(extend **entry, const char *key, void *val, EXTEND_TYPE etype, EXTEND_PUBLIC visibility)
 {
 	extend *new_property = NULL, *eTmp;
@@ -45,7 +60,7 @@ extend *add_property(extend **entry, const char *key, void *val, EXTEND_TYPE ety
 		return NULL;
 	}
 	
-	/* Delete older property with this key (if any) */
+	/* Delete older property with this key (if any), and the cache */
 	del_property(entry, key);
 
 	eTmp = *entry;
@@ -61,6 +76,7 @@ extend *add_property(extend **entry, const char *key, void *val, EXTEND_TYPE ety
 			strcpy(new_property->val, val);		
 			break;
 		case EXTEND_POINTER:
+		case EXTEND_CACHE:
 		default:
 			/* a pointer must be a private property */
 			visibility = EXTEND_ISPRIVATE;
@@ -107,6 +123,7 @@ void *get_property_val(extend *entry, const char *key)
 
 void del_property(extend **entry, const char *key)
 {
+	drop_property_cache(entry);
 
 	while (*entry != NULL) {
 		if (strcmp((*entry)->key, key) == 0) {
@@ -133,6 +150,39 @@ void del_property(extend **entry, const char *key)
 
 }
 
+extend_cache *get_property_cache(extend *entry)
+{
+	if (entry != NULL && entry->type == EXTEND_CACHE) {
+		return entry->val;
+	}
+	return NULL;
+}
+
+/* Cache "data" for the list's owner until the next add_property()/del_property() */
+extend_cache *set_property_cache(extend **entry, const char *data, size_t len)
+{
+	extend *new_property;
+	extend_cache *cache;
+	
+	drop_property_cache(entry);
+	
+	cache = xmalloc(sizeof(*cache) + len);
+	cache->len = len;
+	memcpy(cache->data, data, len);
+	
+	new_property = xmalloc(sizeof(*new_property));
+	*new_property->key = '\0';
+	
+	new_property->val = cache;
+	new_property->type = EXTEND_CACHE;
+	new_property->visibility = EXTEND_ISPRIVATE;
+	new_property->next = *entry;
+	
+	*entry = new_property;
+	
+	return cache;
+}
+
 void clear_properties(extend **entry)
 {
 	extend *pEntry = *entry, *pTmp;
@@ -146,6 +196,9 @@ void clear_properties(extend **entry)
 			case EXTEND_JSON:
 				json_free(pEntry->val);
 				break;
+			case EXTEND_CACHE:
+				free(pEntry->val);
+				break;
 			default:
 				break;
 		}
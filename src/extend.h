@@ -22,12 +22,15 @@
 #ifndef _EXTEND_H
 #define _EXTEND_H
 
+#include <stddef.h>
+
 #define EXTEND_KEY_LENGTH 32
 
 typedef enum {
 	EXTEND_STR,
 	EXTEND_JSON,
-	EXTEND_POINTER
+	EXTEND_POINTER,
+	EXTEND_CACHE
 } EXTEND_TYPE;
 
 typedef enum {
@@ -48,7 +51,21 @@ struct _extend
 	struct _extend *next;
 };
 
+/*
+	Serialized public descriptor of the properties' owner (user, channel).
+	Stored as a private property at the head of the list : any add/del drops it.
+	A property value must be replaced with add_property(), never edited in place
+	(e.g. an EXTEND_JSON tree reached through get_property()->val) : the cache would go stale.
+*/
+typedef struct _extend_cache
+{
+	size_t len;
+	char data[];
+} extend_cache;
+
 extend *get_property(extend *entry, const char *key);
+extend_cache *get_property_cache(extend *entry);
+extend_cache *set_property_cache(extend **entry, const char *data, size_t len);
 void clear_properties(extend **entry);
 void del_property(extend **entry, const char *key);
 //extend *add_property_str(extend **entry, char *key, char *val);
@@ -25,6 +25,7 @@
 #include "cmd.h"
 #include "utils.h"
 #include "config.h"
+#include "websocket.h"
 
 static unsigned int fixpacket(char *pSock, int type)
 {
@@ -47,71 +48,41 @@ static unsigned int fixpacket(char *pSock, int type)
 	return 0;
 }
 
-/* Reading the host http header */
-static int gethost(char *base, char *output) // Catch the host HTTP header
+/* Host header value recorded by process_http() */
+static void gethost(connection *co, char *output)
 {
-	char *pBase;
-	int i;
+	int len = (co->http.host_len < MAX_HOST_LENGTH ? co->http.host_len : MAX_HOST_LENGTH-1);
 	
-	output[0] = '\0';
-	
-	for (pBase = base; *pBase && strncasecmp(pBase, "Host:", 5) != 0; pBase++);
-	
-	if (!*pBase || !pBase[6]) {
-		return 0;
-	}
-	
-	pBase = &pBase[6];
-	
-	for (i = 0; pBase[i] && pBase[i] != '\n' && i < (MAX_HOST_LENGTH-1); i++) {
-		output[i] = pBase[i];
+	if (co->http.host == -1) {
+		output[0] = '\0';
+		return;
 	}
-	
-	output[i] = '\0';
-	
-	return 1;
+	memcpy(output, &co->buffer.data[co->http.host], len);
+	output[len] = '\0';
 }
 
-/* Reading post data from the HTTP streaming incoming */
-static char *getpost(char *input)
+/* Local requests (from a frontend) start with the client IP : "?ip&..." */
+static int getqueryip(connection *co, char *output)
 {
-	char *pInput;
+	char *query = &co->buffer.data[co->http.query];
+	int i, len;
 	
-	for (pInput = input; *pInput && strncmp(pInput, "\r\n\r\n", 4) != 0; pInput++);
-	
-	if (!*pInput || !pInput[4]) {
-		return NULL;
-	} else {
-		return &pInput[4];
-	}
-}
-
-static int getqueryip(char *base, char *output)
-{
-	int i, size = strlen(base), step, x = 0;
-	
-	if (size < 16) {
+	if (co->http.query == -1) {
+		output[0] = '\0';
 		return 0;
 	}
+	len = co->http.path_end - co->http.query;
 	
-	for (i = 0, step = 0; i < size; i++) {
-		if (base[i] == '\n') {
-			output[0] = '\0';
-			return 0;
-		}
-		if (step == 1 && (base[i] == '&' || base[i] == ' ') && x < 16) {
-			output[x] = '\0';
-			return 1;
-		} else if (step == 1 && x < 16) {
-			output[x] = base[i];
-			x++;
-		} else if (base[i] == '?') {
-			step = 1;
-		}
+	for (i = 0; i < len && i < 16 && query[i] != '&'; i++) {
+		output[i] = query[i];
 	}
-	output[0] = '\0';
-	return 0;
+	if (i == 16) {
+		output[0] = '\0';
+		return 0;
+	}
+	output[i] = '\0';
 	
+	return 1;
 }
 
 static char *getfirstparam(char *input, char sep)
@@ -130,57 +101,72 @@ static char *getfirstparam(char *input, char sep)
 	}	
 }
 
-subuser *checkrecv(char *pSock, int fdclient, acetables *g_ape, char *ip_client)
+subuser *checkrecv(connection *co, int fdclient, acetables *g_ape)
 {
 
 	unsigned int op;
 	subuser *user = NULL;
-	int local = (strcmp(ip_client, CONFIG_VAL(Server, ip_local, g_ape->srv)) == 0);
+	char *data = co->buffer.data, next;
+	int local = (strcmp(co->ip_client, CONFIG_VAL(Server, ip_local, g_ape->srv)) == 0);
 	
 	clientget *cget = xmalloc(sizeof(*cget));
 
-	if (strlen(pSock) < 3 || (local && getqueryip(pSock, cget->ip_get) == 0)) {  // get query IP (from htaccess)
+	if (local && getqueryip(co, cget->ip_get) == 0) {  // get query IP (from htaccess)
 		free(cget);
-		shutdown(fdclient, 2);
+		http_end(fdclient, g_ape);
 		return NULL;		
 	}
 	if (!local) {
-		strncpy(cget->ip_get, ip_client, 16); // get real IP (from socket)
+		strncpy(cget->ip_get, co->ip_client, 16); // get real IP (from socket)
 	}
 	
 	cget->fdclient = fdclient;
 	
-	gethost(pSock, cget->host);
+	gethost(co, cget->host);
 	
-	if (strncasecmp(pSock, "GET", 3) == 0) {
-		if (!fixpacket(pSock, 0) || (cget->get = getfirstparam(pSock, (local ? '&' : '?'))) == NULL) {
-			free(cget);
-			
-			shutdown(fdclient, 2);
-			return NULL;			
-		} else {
-			urldecode(cget->get);
+	if (co->http.upgrade != 0) {
+		/* The next messages are read by websocket_process() */
+		if (!websocket_accept(co, cget, g_ape)) {
+			sockshutdown(fdclient, g_ape);
 		}
-	} else if (strncasecmp(pSock, "POST", 4) == 0) {
-		if ((cget->get = getpost(pSock)) == NULL) {
+		free(cget);
+		return NULL;
+	}
+	
+	if (co->http.type == HTTP_GET) {
+		data[co->http.path_end] = '\0';
+		
+		cget->get = (co->http.query != -1 ? &data[co->http.query] : NULL);
+		
+		if (local && cget->get != NULL) {
+			cget->get = getfirstparam(cget->get, '&');
+		}
+		if (cget->get == NULL || *cget->get == '\0') {
 			free(cget);
 			
-			shutdown(fdclient, 2);
+			http_end(fdclient, g_ape);
 			return NULL;			
 		}
+		urldecode(cget->get);
 	} else {
-		free(cget);
-
-		shutdown(fdclient, 2);
-		return NULL;		
+		/* POST : process_http() made sure there is a body */
+		cget->get = &data[co->http.body];
 	}
+	
+	/* The request ends here, the next one (pipelined) may follow */
+	next = data[co->http.end];
+	data[co->http.end] = '\0';
+	
 	fixpacket(cget->get, 1);
 
 	op = checkcmd(cget, &user, g_ape);
+	
+	data[co->http.end] = next;
 
 	switch (op) {
 		case CONNECT_SHUTDOWN:
-			shutdown(fdclient, 2);			
+			/* The response (if any) is complete */
+			http_end(fdclient, g_ape);
 			break;
 		case CONNECT_KEEPALIVE:
 			break;
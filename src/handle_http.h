@@ -26,9 +26,10 @@
 #include "main.h"
 
 #include "sock.h"
+#include "http.h"
 
 
-subuser *checkrecv(char *pSock, int fdclient, acetables *g_ape, char *ip_client);
+subuser *checkrecv(connection *co, int fdclient, acetables *g_ape);
 
 
 typedef struct clientget
@@ -25,167 +25,252 @@
 #include "hash.h"
 #include "users.h"
 #include "utils.h"
+#include "slab.h"
 
-static unsigned int hach_string(const char *str)
+static slab_cache htbl_item_cache = SLAB_CACHE("HTBL_ITEM", HTBL_ITEM);
+
+/* Marks a removed slot of the old table (probing goes on) */
+static HTBL_ITEM hach_deleted;
+
+static unsigned int hach_string(const char *str, unsigned int *len)
+{
+	unsigned int hash = 2166136261U; // FNV-1a
+	const unsigned char *s;
+	
+	for (s = (const unsigned char *)str; *s != '\0'; s++) {
+		hash ^= (*s >= 'A' && *s <= 'Z' ? *s + ('a' - 'A') : *s); /* case insensitive */
+		hash *= 16777619U;
+	}
+	*len = (s - (const unsigned char *)str);
+	
+	return hash;
+}
+
+static HTBL_SLOT *htbl_alloc(unsigned int size)
+{
+	HTBL_SLOT *table = xmalloc(sizeof(*table) * size);
+	
+	memset(table, 0, sizeof(*table) * size);
+	
+	return table;
+}
+
+static void htbl_item_free(HTBL *htbl, HTBL_ITEM *item)
+{
+	if (item->lprev == NULL) {
+		htbl->first = item->lnext;
+	} else {
+		item->lprev->lnext = item->lnext;
+	}
+	if (item->lnext != NULL) {
+		item->lnext->lprev = item->lprev;
+	}
+	if (item->key != item->ikey) {
+		free(item->key);
+	}
+	slab_free(&htbl_item_cache, item);
+}
+
+static HTBL_SLOT *htbl_find(HTBL_SLOT *table, unsigned int size, const char *key, unsigned int hash, unsigned int len)
 {
-        int hash = 5381; // DJB Hash
-        const char *s;
+	unsigned int i = hash & (size - 1);
 	
+	while (table[i].item != NULL) {
+		if (table[i].hash == hash && table[i].item != &hach_deleted && 
+			table[i].item->len == len && strcasecmp(table[i].item->key, key) == 0) {
+			return &table[i];
+		}
+		i = (i + 1) & (size - 1);
+	}
+	
+	return NULL;
+}
+
+static HTBL_SLOT *htbl_free_slot(HTBL *htbl, unsigned int hash)
+{
+	unsigned int i = hash & (htbl->size - 1);
 	
-        for (s = str; *s != '\0'; s++) {
-                hash = ((hash << 5) + hash) + tolower(*s);
-        }
+	while (htbl->table[i].item != NULL) {
+		i = (i + 1) & (htbl->size - 1);
+	}
 	
-        return (hash & 0x7FFFFFFF)%(HACH_TABLE_MAX-1);
+	return &htbl->table[i];
+}
+
+/* Move up to "n" slots of the old table */
+static void htbl_rehash(HTBL *htbl, unsigned int n)
+{
+	HTBL_SLOT *slot;
+	
+	while (htbl->old != NULL && n--) {
+		slot = &htbl->old[htbl->old_pos];
+		
+		if (slot->item != NULL && slot->item != &hach_deleted) {
+			*htbl_free_slot(htbl, slot->hash) = *slot;
+			slot->item = &hach_deleted;
+		}
+		
+		if (++htbl->old_pos == htbl->old_size) {
+			free(htbl->old);
+			htbl->old = NULL;
+		}
+	}
+}
+
+static void htbl_grow(HTBL *htbl)
+{
+	/* Still rehashing : finish it first */
+	htbl_rehash(htbl, htbl->old_size);
+	
+	htbl->old = htbl->table;
+	htbl->old_size = htbl->size;
+	htbl->old_pos = 0;
+	
+	htbl->size *= 2;
+	htbl->table = htbl_alloc(htbl->size);
 }
 
 HTBL *hashtbl_init()
 {
-	HTBL_ITEM **htbl_item;
 	HTBL *htbl;
 	
 	htbl = xmalloc(sizeof(*htbl));
 	
-	htbl_item = (HTBL_ITEM **) xmalloc( sizeof(*htbl_item) * (HACH_TABLE_MAX + 1) );
-	
-	memset(htbl_item, 0, sizeof(*htbl_item) * (HACH_TABLE_MAX + 1));
-	
 	htbl->first = NULL;
-	htbl->table = htbl_item;
+	htbl->size = HACH_TABLE_MIN;
+	htbl->count = 0;
+	htbl->table = htbl_alloc(htbl->size);
+	
+	htbl->old = NULL;
+	htbl->old_size = 0;
+	htbl->old_pos = 0;
 	
 	return htbl;
 }
 
 void hashtbl_free(HTBL *htbl)
 {
-	size_t i;
-	HTBL_ITEM *hTmp;
-	HTBL_ITEM *hNext;
-	
-	for (i = 0; i < (HACH_TABLE_MAX + 1); i++) {
-		hTmp = htbl->table[i];
-		while (hTmp != 0) {
-			hNext = hTmp->next;
-			free(hTmp->key);
-			hTmp->key = NULL;
-			free(hTmp);
-			hTmp = hNext;
-		}
+	while (htbl->first != NULL) {
+		htbl_item_free(htbl, htbl->first);
 	}
 	
+	free(htbl->old);
 	free(htbl->table);
 	free(htbl);	
 }
 
 void hashtbl_append(HTBL *htbl, const char *key, void *structaddr)
 {
-	unsigned int key_hash;
-	HTBL_ITEM *hTmp, *hDbl;
+	unsigned int key_hash, len;
+	HTBL_SLOT *slot;
+	HTBL_ITEM *hTmp;
 	
 	if (key == NULL) {
 		return;
 	}
 	
-	key_hash = hach_string(key);
+	htbl_rehash(htbl, HACH_REHASH_STEP);
 	
-	hTmp = (HTBL_ITEM *)xmalloc(sizeof(*hTmp));
+	key_hash = hach_string(key, &len);
 	
-	hTmp->next = NULL;
-	hTmp->lnext = htbl->first;
-	hTmp->lprev = NULL;
+	if ((slot = htbl_find(htbl->table, htbl->size, key, key_hash, len)) != NULL ||
+		(htbl->old != NULL && (slot = htbl_find(htbl->old, htbl->old_size, key, key_hash, len)) != NULL)) {
+		
+		slot->item->addrs = (void *)structaddr;
+		return;
+	}
 	
-	if (htbl->first != NULL) {
-		htbl->first->lprev = hTmp;
+	if (++htbl->count > htbl->size / 4 * 3) {
+		htbl_grow(htbl);
 	}
 	
-	hTmp->key = xmalloc(sizeof(char) * (strlen(key)+1));
+	hTmp = slab_alloc(&htbl_item_cache);
 	
-	htbl->first = hTmp;
+	if (len < HACH_INLINE_KEY) {
+		hTmp->key = hTmp->ikey;
+	} else {
+		hTmp->key = xmalloc(sizeof(char) * (len + 1));
+	}
+	memcpy(hTmp->key, key, len + 1);
 	
+	hTmp->len = len;
 	hTmp->addrs = (void *)structaddr;
 	
-	memcpy(hTmp->key, key, strlen(key)+1);
-	
-	if (htbl->table[key_hash] != NULL) {
-		hDbl = htbl->table[key_hash];
-		
-		while (hDbl != NULL) {
-			if (strcasecmp(hDbl->key, key) == 0) {
-				free(hTmp->key);
-				free(hTmp);
-				hDbl->addrs = (void *)structaddr;
-				return;
-			} else {
-				hDbl = hDbl->next;
-			}
-		}
-		hTmp->next = htbl->table[key_hash];
+	hTmp->lprev = NULL;
+	if ((hTmp->lnext = htbl->first) != NULL) {
+		htbl->first->lprev = hTmp;
 	}
+	htbl->first = hTmp;
 	
-	htbl->table[key_hash] = hTmp;
+	slot = htbl_free_slot(htbl, key_hash);
+	slot->hash = key_hash;
+	slot->item = hTmp;
 }
 
 
 void hashtbl_erase(HTBL *htbl, const char *key)
 {
-	unsigned int key_hash;
-	HTBL_ITEM *hTmp, *hPrev;
+	unsigned int key_hash, len, i, j, home, mask = htbl->size - 1;
+	HTBL_SLOT *slot;
 	
 	if (key == NULL) {
 		return;
 	}
 	
-	key_hash = hach_string(key);
-	
-	hTmp = htbl->table[key_hash];
-	hPrev = NULL;
-	
-	while (hTmp != NULL) {
-		if (strcasecmp(hTmp->key, key) == 0) {
-			if (hPrev != NULL) {
-				hPrev->next = hTmp->next;
-			} else {
-				htbl->table[key_hash] = hTmp->next;
-			}
-			
-			if (hTmp->lprev == NULL) {
-				htbl->first = hTmp->lnext;
-			} else {
-				hTmp->lprev->lnext = hTmp->lnext;
-			}
-			if (hTmp->lnext != NULL) {
-				hTmp->lnext->lprev = hTmp->lprev;
-			}
-			
-			free(hTmp->key);
-			free(hTmp);
-			return;
+	htbl_rehash(htbl, HACH_REHASH_STEP);
+	
+	key_hash = hach_string(key, &len);
+	
+	if ((slot = htbl_find(htbl->table, htbl->size, key, key_hash, len)) == NULL) {
+		
+		/* Not moved yet : the old table only gets deletion marks */
+		if (htbl->old != NULL && (slot = htbl_find(htbl->old, htbl->old_size, key, key_hash, len)) != NULL) {
+			htbl_item_free(htbl, slot->item);
+			slot->item = &hach_deleted;
+			htbl->count--;
+		}
+		return;
+	}
+	
+	htbl_item_free(htbl, slot->item);
+	htbl->count--;
+	
+	/* Backward shift deletion : pull back the next slots of the cluster (items don't move) */
+	for (i = j = (slot - htbl->table); ; ) {
+		j = (j + 1) & mask;
+		
+		if (htbl->table[j].item == NULL) {
+			break;
+		}
+		home = htbl->table[j].hash & mask;
+		
+		/* Can the slot at j be moved to i without breaking its probe sequence ? */
+		if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+			htbl->table[i] = htbl->table[j];
+			i = j;
 		}
-		hPrev = hTmp;
-		hTmp = hTmp->next;
 	}
+	htbl->table[i].item = NULL;
 }
 
 void *hashtbl_seek(HTBL *htbl, const char *key)
 {
-	unsigned int key_hash;
-	HTBL_ITEM *hTmp;
+	unsigned int key_hash, len;
+	HTBL_SLOT *slot;
 	
 	if (key == NULL) {
 		return NULL;
 	}
 	
-	key_hash = hach_string(key);
+	htbl_rehash(htbl, HACH_REHASH_STEP);
 	
-	hTmp = htbl->table[key_hash];
+	key_hash = hach_string(key, &len);
 	
-	while (hTmp != NULL) {
-		if (strcasecmp(hTmp->key, key) == 0) {
-			return (void *)(hTmp->addrs);
-		}
-		hTmp = hTmp->next;
+	if ((slot = htbl_find(htbl->table, htbl->size, key, key_hash, len)) != NULL ||
+		(htbl->old != NULL && (slot = htbl_find(htbl->old, htbl->old_size, key, key_hash, len)) != NULL)) {
+		
+		return (void *)(slot->item->addrs);
 	}
 	
 	return NULL;
 }
-
@@ -20,12 +20,35 @@
 #ifndef _LHTBL_H
 #define _LHTBL_H
 
-#define HACH_TABLE_MAX 5381
+/*
+	Open addressing (linear probing) table of {hash, item} slots, its size is a power of 2.
+	When it's 3/4 full, a table twice as big is allocated and the slots
+	are moved a few at a time by each hashtbl_* call (incremental rehash).
+	Items are allocated apart (slab) and never move : the first/lnext list
+	can be walked while the table is used, an item being only freed when erased.
+*/
+#define HACH_TABLE_MIN 16
+#define HACH_REHASH_STEP 8 // Old slots moved by each call during a rehash
+#define HACH_INLINE_KEY 40 // Keys shorter than this are stored in the item
+
+typedef struct _htbl_slot
+{
+	unsigned int hash;
+	struct _htbl_item *item; /* NULL : free slot */
+} HTBL_SLOT;
 
 typedef struct HTBL
 {
 	struct _htbl_item *first;
-	struct _htbl_item **table;
+	
+	HTBL_SLOT *table;
+	unsigned int size;
+	unsigned int count;
+	
+	/* Table being rehashed into "table" (NULL if none) */
+	HTBL_SLOT *old;
+	unsigned int old_size;
+	unsigned int old_pos;
 } HTBL;
 
 
@@ -33,11 +56,13 @@ typedef struct _htbl_item
 {
 	char *key;
 	void *addrs;
-	struct _htbl_item *next;
+	
+	unsigned int len;
 	
 	struct _htbl_item *lnext;
 	struct _htbl_item *lprev;
 	
+	char ikey[HACH_INLINE_KEY];
 } HTBL_ITEM;
 
 HTBL *hashtbl_init();
@@ -26,103 +26,231 @@
 
 /* Just a lightweight http request processor */
 
-void process_http(connection *co)
+void init_http_state(http_state *http)
 {
-	char *data = data = co->buffer.data;
-	int pos, read;
+	http->ready = 0;
+	http->keepalive = 0;
+	http->framed = 0;
+	http->encoding = 0;
 	
-	if (co->buffer.length == 0 || co->http.ready == 1 || co->http.error == 1) {
-		return;
+	reset_http_state(http);
+}
+
+/* Ready to parse the next request of the connection (ready, keepalive, framed and encoding are kept) */
+void reset_http_state(http_state *http)
+{
+	http->step = HTTP_STEP_LINE;
+	http->type = HTTP_NULL;
+	http->pos = 0;
+	http->line = 0;
+	http->contentlength = -1;
+	http->error = 0;
+	
+	http->path = -1;
+	http->path_end = -1;
+	http->query = -1;
+	http->host = -1;
+	http->host_len = 0;
+	http->body = -1;
+	http->end = -1;
+	
+	http->upgrade = 0;
+	http->ws_key = -1;
+	http->ws_key_len = 0;
+	
+	http->eventstream = 0;
+	http->last_event_id = -1;
+	http->ws_deflate = 0;
+}
+
+/* "token" appears in the header value (case insensitive) */
+static int http_value_has(const char *value, int len, const char *token)
+{
+	int i, tlen = strlen(token);
+	
+	for (i = 0; i + tlen <= len; i++) {
+		if (strncasecmp(&value[i], token, tlen) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* "METHOD /path?query HTTP/1.x" starting at "off" */
+static int http_parse_request_line(http_state *http, const char *data, int off, int len)
+{
+	const char *line = &data[off], *end;
+	int i;
+	
+	if (len > 5 && strncasecmp(line, "POST ", 5) == 0) {
+		http->type = HTTP_POST;
+		i = 5;
+	} else if (len > 4 && strncasecmp(line, "GET ", 4) == 0) {
+		http->type = HTTP_GET;
+		i = 4;
+	} else {
+		/* Other methods are not implemented yet */
+		return 0;
 	}
+	http->path = off + i;
+	http->encoding = 0;
 	
-	/* 0 will be erased by the next read()'ing loop */
-	data[co->buffer.length] = '\0';
+	if ((end = memchr(&line[i], ' ', len - i)) == NULL) {
+		end = &line[len];
+	}
+	http->path_end = end - data;
 	
-	data = &data[co->http.pos];
+	for (; i < http->path_end - off; i++) {
+		if (line[i] == '?') {
+			http->query = off + i + 1;
+			break;
+		}
+	}
 	
-	if (*data == '\0') {
+	/* Persistent by default since HTTP/1.1 */
+	http->keepalive = (len - (http->path_end - off) >= 9 && strncasecmp(end, " HTTP/1.1", 9) == 0);
+	
+	return 1;
+}
+
+/* Header line starting at "off" : only Host, Connection, Content-Length (POST), the WebSocket and the event stream ones are used */
+static int http_parse_header(http_state *http, const char *data, int off, int len)
+{
+	const char *line = &data[off];
+	int i;
+	
+	if (len >= 5 && strncasecmp(line, "Host:", 5) == 0) {
+		for (i = 5; i < len && (line[i] == ' ' || line[i] == '\t'); i++);
+		
+		http->host = off + i;
+		http->host_len = len - i;
+		
+	} else if (len >= 11 && strncasecmp(line, "Connection:", 11) == 0) {
+		for (i = 11; i < len && (line[i] == ' ' || line[i] == '\t'); i++);
+		
+		if (len - i >= 5 && strncasecmp(&line[i], "close", 5) == 0) {
+			http->keepalive = 0;
+		} else if (len - i >= 10 && strncasecmp(&line[i], "keep-alive", 10) == 0) {
+			http->keepalive = 1;
+		}
+		
+	} else if (http->type == HTTP_GET && len >= 8 && strncasecmp(line, "Upgrade:", 8) == 0) {
+		for (i = 8; i < len && (line[i] == ' ' || line[i] == '\t'); i++);
+		
+		if (len - i >= 9 && strncasecmp(&line[i], "websocket", 9) == 0 && http->upgrade != -1) {
+			http->upgrade = 1;
+		}
+		
+	} else if (http->type == HTTP_GET && len >= 18 && strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0) {
+		for (i = 18; i < len && (line[i] == ' ' || line[i] == '\t'); i++);
+		
+		http->ws_key = off + i;
+		http->ws_key_len = len - i;
+		
+	} else if (http->type == HTTP_GET && len >= 22 && strncasecmp(line, "Sec-WebSocket-Version:", 22) == 0) {
+		/* RFC 6455 only, -1 : refused */
+		if (atoi(&line[22]) != 13) {
+			http->upgrade = -1;
+		}
+		
+	} else if (http->type == HTTP_GET && len >= 7 && strncasecmp(line, "Accept:", 7) == 0) {
+		for (i = 7; i < len && (line[i] == ' ' || line[i] == '\t'); i++);
+		
+		http->eventstream = (len - i >= 17 && strncasecmp(&line[i], "text/event-stream", 17) == 0);
+		
+	} else if (len >= 16 && strncasecmp(line, "Accept-Encoding:", 16) == 0) {
+		if (http_value_has(&line[16], len - 16, "gzip")) {
+			http->encoding |= HTTP_ENCODING_GZIP;
+		}
+		if (http_value_has(&line[16], len - 16, "deflate")) {
+			http->encoding |= HTTP_ENCODING_DEFLATE;
+		}
+		
+	} else if (http->type == HTTP_GET && len >= 25 && strncasecmp(line, "Sec-WebSocket-Extensions:", 25) == 0) {
+		/* Our window and context takeover can't be constrained */
+		if (http_value_has(&line[25], len - 25, "permessage-deflate") && !http_value_has(&line[25], len - 25, "server_")) {
+			http->ws_deflate = 1;
+		}
+		
+	} else if (http->type == HTTP_GET && len >= 14 && strncasecmp(line, "Last-Event-ID:", 14) == 0) {
+		http->last_event_id = atoi(&line[14]);
+		
+	} else if (http->type == HTTP_POST && len >= 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+		int cl = atoi(&line[15]);
+		
+		/* Content-length can't be negative... */
+		if (cl < 1 || cl > MAX_CONTENT_LENGTH) {
+			return 0;
+		}
+		/* At this time we are ready to read "cl" bytes contents */
+		http->contentlength = cl;
+	}
+	
+	return 1;
+}
+
+/* Resume parsing from the last byte scanned by the previous call */
+void process_http(connection *co)
+{
+	char *data = co->buffer.data, *eol;
+	http_state *http = &co->http;
+	int len;
+	
+	if (co->buffer.length == 0 || http->ready != 0 || http->error == 1) {
 		return;
 	}
 	
-	switch(co->http.step) {
-		case 0:
-			pos = seof(data);
-			if (pos == -1) {
-				return;
-			}
+	while (http->step != HTTP_STEP_BODY) {
+		if ((eol = memchr(&data[http->pos], '\n', co->buffer.length - http->pos)) == NULL) {
+			http->pos = co->buffer.length;
 			
-			if (strncasecmp(data, "POST ", 5) == 0) {
-				co->http.type = HTTP_POST;
-			} else if (strncasecmp(data, "GET ", 4) == 0) {
-				co->http.type = HTTP_GET;
-			} else {
-				/* Other methods are not implemented yet */
-				co->http.error = 1;
+			return;
+		}
+		http->pos = eol - data + 1;
+		
+		len = eol - &data[http->line];
+		if (len != 0 && data[http->line + len - 1] == '\r') {
+			len--;
+		}
+		
+		if (http->step == HTTP_STEP_LINE) {
+			if (!http_parse_request_line(http, data, http->line, len)) {
+				http->error = 1;
 				
 				return;
 			}
-			co->http.pos = pos;
-			co->http.step = 1;
+			http->step = HTTP_STEP_HEADERS;
 			
-			process_http(co);
-			break;
-		case 1:
-			pos = seof(data);
-			if (pos == -1) {
-
-				return;
-			}
-			if (pos == 1 || (pos == 2 && *data == '\r')) {
+		} else if (len == 0) {
+			/* Ok, at this point we have a blank line */
+			http->body = http->pos;
+			
+			if (http->type == HTTP_GET) {
+				http->end = http->body;
+				http->ready = 1;
 				
-
-				if (co->http.type == HTTP_GET) {
-					/* Ok, at this point we have a blank line. Ready for GET */
-					co->http.ready = 1;
-					co->buffer.data[co->http.pos] = '\0';
-
-					return;
-				} else {
-					/* Content-Length is mandatory in case of POST */
-					if (co->http.contentlength == 0) {
-						co->http.error = 1;
-						
-						return;
-					} else {
-						co->http.step = 2;
-					}
-				}
-			} else if (co->http.type == HTTP_POST) {
-				/* looking for content-length instruction */
-				if (pos <= 25 && strncasecmp("content-length: ", data, 16) == 0) {
-					int cl = atoi(&data[16]);
-					
-					/* Content-length can't be negative... */
-					if (cl < 1 || cl > MAX_CONTENT_LENGTH) {
-						co->http.error = 1;
-						return;
-					}
-					/* At this time we are ready to read "cl" bytes contents */
-					co->http.contentlength = cl;
-					
-				}
+				return;
 			}
-			co->http.pos += pos;
-			process_http(co);
-			break;
-		case 2:
-			read = strlen(data);
-			co->http.pos += read;
-			co->http.read += read;
-
-			if (co->http.read >= co->http.contentlength) {
-				co->http.ready = 1;
+			/* Content-Length is mandatory in case of POST */
+			if (http->contentlength < 1) {
+				http->error = 1;
 				
-				/* no more than content-length */
-				co->buffer.data[co->http.pos - (co->http.read - co->http.contentlength)] = '\0';
+				return;
 			}
-			break;
-		default:
-			break;
+			http->step = HTTP_STEP_BODY;
+			
+		} else if (!http_parse_header(http, data, http->line, len)) {
+			http->error = 1;
+			
+			return;
+		}
+		http->line = http->pos;
+	}
+	
+	if (co->buffer.length - http->body >= http->contentlength) {
+		/* no more than content-length */
+		http->end = http->body + http->contentlength;
+		http->ready = 1;
 	}
 }
 
@@ -29,15 +29,52 @@
 
 typedef struct _http_state http_state;
 
+enum {
+	HTTP_STEP_LINE = 0,
+	HTTP_STEP_HEADERS,
+	HTTP_STEP_BODY
+};
+
+/*
+	Parser state, kept across reads : each byte of the request is scanned once.
+	Offsets are relative to the connection buffer (it can be reallocated).
+*/
 struct _http_state
 {
 	int step;
 	int type; /* HTTP_GET or HTTP_POST */
-	int pos;
+	int pos; /* next byte to scan */
+	int line; /* start of the line being read */
 	int contentlength;
-	int read;
 	int error;
-	int ready;
+	int ready; /* -1 : the request is being answered */
+	
+	/* The connection is kept open after the response (HTTP/1.1 or "Connection: keep-alive") */
+	int keepalive;
+	/* The response has a Content-Length (see http_header()) */
+	int framed;
+	
+	/* Request, filled by process_http() (-1 : absent) */
+	int path;
+	int path_end;
+	int query; /* after '?' */
+	int host;
+	int host_len;
+	int body;
+	int end; /* first byte of the next (pipelined) request */
+	
+	/* WebSocket handshake (see websocket_accept()) */
+	int upgrade; /* "Upgrade: websocket" with a supported version */
+	int ws_key;
+	int ws_key_len;
+	
+	/* Event stream (see sse_start()) */
+	int eventstream; /* "Accept: text/event-stream" */
+	int last_event_id; /* -1 : absent */
+	
+	/* Accept-Encoding (HTTP_ENCODING_*), kept until the next request since the response can be delayed */
+	int encoding;
+	int ws_deflate; /* permessage-deflate offered (see websocket_accept()) */
 };
 
 typedef struct _connection connection;
@@ -47,6 +84,13 @@ enum {
 	STREAM_OUT	
 };
 
+/* Connections owned by a worker (see sockworker_routine()) */
+#define CO_SHARED 0x01 /* The main loop has a copy : the fd is closed once it's released */
+#define CO_RELAY 0x02 /* WebSocket : what is read is given to the main loop as is */
+#define CO_CLOSING 0x04 /* Waiting for SOCKS_MSG_RELEASE */
+#define CO_BLOCKED 0x08 /* Main loop copy : the worker's output queue is waiting for EPOLLOUT */
+#define CO_SHUTDOWN 0x10 /* Shut down once the output queue is written */
+
 struct _connection {
 	char ip_client[16];
 	
@@ -55,6 +99,15 @@ struct _connection {
 	int stream_type;
 	long int idle;
 	
+	/* Event loop owning the connection (0 : main loop, -1 : closed) */
+	int worker;
+	/* CO_* */
+	int flags;
+	
+	/* Waiting for a request : linked by fd, oldest first (-1 : none, see check_idle()) */
+	int idle_prev;
+	int idle_next;
+	
 	struct {
 		char *data;	
 		unsigned int size;
@@ -63,6 +116,12 @@ struct _connection {
 	} buffer;
 	
 	void *attach;
+	
+	/* Not NULL once the connection is upgraded to WebSocket */
+	struct _websocket *websocket;
+	
+	/* Compression context of a stream (see compress.c) */
+	struct _deflate *deflate;
 };
 
 enum {
@@ -71,6 +130,16 @@ enum {
 	HTTP_POST,
 	HTTP_OPTIONS
 };
+
+enum {
+	HTTP_ENCODING_GZIP = 0x01,
+	HTTP_ENCODING_DEFLATE = 0x02
+};
+
+#define HTTP_PIPELINE_MAX 65536 // Max bytes read ahead while a request is being answered
+
+void init_http_state(http_state *http);
+void reset_http_state(http_state *http);
 void process_http(struct _connection *co);
 
 #endif
@@ -0,0 +1,301 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* idtbl.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "idtbl.h"
+#include "utils.h"
+
+/* Marks a removed entry of the old table */
+static char idtbl_deleted[1];
+
+#define ID_HOME(id, size) ((unsigned int)(id)->lo & ((size) - 1))
+
+static const char hex_chars[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
+				'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+			};
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+/* Return 0 if "hex" is not made of exactly 32 hex chars */
+int ape_id_decode(const char *hex, ape_id *id)
+{
+	int i, v;
+	
+	id->hi = 0;
+	id->lo = 0;
+	
+	for (i = 0; i < APE_ID_HEX_LEN; i++) {
+		if ((v = hex_value(hex[i])) == -1) {
+			return 0;
+		}
+		if (i < APE_ID_HEX_LEN / 2) {
+			id->hi = (id->hi << 4) | v;
+		} else {
+			id->lo = (id->lo << 4) | v;
+		}
+	}
+	
+	return (hex[i] == '\0');
+}
+
+/* "hex" must be able to contain 33 chars */
+char *ape_id_encode(const ape_id *id, char *hex)
+{
+	int i;
+	
+	for (i = 0; i < APE_ID_HEX_LEN / 2; i++) {
+		hex[i] = hex_chars[(id->hi >> (60 - i * 4)) & 0xF];
+		hex[i + APE_ID_HEX_LEN / 2] = hex_chars[(id->lo >> (60 - i * 4)) & 0xF];
+	}
+	hex[APE_ID_HEX_LEN] = '\0';
+	
+	return hex;
+}
+
+/* Random ids are drawn from a pool refilled by getrandom() (main loop only) */
+static ape_id id_pool[APE_ID_POOL];
+static int id_pool_left = 0;
+
+static void id_pool_fill()
+{
+	char *buf = (char *)id_pool;
+	size_t len = sizeof(id_pool);
+	ssize_t n;
+	int fd;
+	
+	while (len > 0) {
+		if ((n = getrandom(buf, len, 0)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		buf += n;
+		len -= n;
+	}
+	
+	/* getrandom() not available (old kernel) */
+	if (len > 0) {
+		if ((fd = open("/dev/urandom", O_RDONLY)) == -1 || read(fd, buf, len) != len) {
+			printf("[ERR] Cannot read random data... exiting\n");
+			exit(1);
+		}
+		close(fd);
+	}
+	
+	id_pool_left = APE_ID_POOL;
+}
+
+void ape_id_random(ape_id *id)
+{
+	if (id_pool_left == 0) {
+		id_pool_fill();
+	}
+	*id = id_pool[--id_pool_left];
+}
+
+static IDTBL_ITEM *idtbl_alloc(unsigned int size)
+{
+	IDTBL_ITEM *table = xmalloc(sizeof(*table) * size);
+	
+	memset(table, 0, sizeof(*table) * size);
+	
+	return table;
+}
+
+static IDTBL_ITEM *idtbl_find(IDTBL_ITEM *table, unsigned int size, const ape_id *key)
+{
+	unsigned int i = ID_HOME(key, size);
+	
+	while (table[i].addrs != NULL) {
+		if (APE_ID_EQUAL(&table[i].key, key) && table[i].addrs != idtbl_deleted) {
+			return &table[i];
+		}
+		i = (i + 1) & (size - 1);
+	}
+	
+	return NULL;
+}
+
+static IDTBL_ITEM *idtbl_free_slot(IDTBL *idtbl, const ape_id *key)
+{
+	unsigned int i = ID_HOME(key, idtbl->size);
+	
+	while (idtbl->table[i].addrs != NULL) {
+		i = (i + 1) & (idtbl->size - 1);
+	}
+	
+	return &idtbl->table[i];
+}
+
+static void idtbl_rehash(IDTBL *idtbl, unsigned int n)
+{
+	IDTBL_ITEM *item;
+	
+	while (idtbl->old != NULL && n--) {
+		item = &idtbl->old[idtbl->old_pos];
+		
+		if (item->addrs != NULL && item->addrs != idtbl_deleted) {
+			*idtbl_free_slot(idtbl, &item->key) = *item;
+			item->addrs = idtbl_deleted;
+		}
+		
+		if (++idtbl->old_pos == idtbl->old_size) {
+			free(idtbl->old);
+			idtbl->old = NULL;
+		}
+	}
+}
+
+static IDTBL_ITEM *idtbl_lookup(IDTBL *idtbl, const ape_id *key)
+{
+	IDTBL_ITEM *item;
+	
+	idtbl_rehash(idtbl, IDTBL_REHASH_STEP);
+	
+	if ((item = idtbl_find(idtbl->table, idtbl->size, key)) == NULL && idtbl->old != NULL) {
+		item = idtbl_find(idtbl->old, idtbl->old_size, key);
+	}
+	
+	return item;
+}
+
+IDTBL *idtbl_init()
+{
+	IDTBL *idtbl = xmalloc(sizeof(*idtbl));
+	
+	idtbl->size = IDTBL_MIN;
+	idtbl->count = 0;
+	idtbl->table = idtbl_alloc(idtbl->size);
+	
+	idtbl->old = NULL;
+	idtbl->old_size = 0;
+	idtbl->old_pos = 0;
+	
+	return idtbl;
+}
+
+void idtbl_free(IDTBL *idtbl)
+{
+	free(idtbl->old);
+	free(idtbl->table);
+	free(idtbl);
+}
+
+void *idtbl_seek(IDTBL *idtbl, const ape_id *key)
+{
+	IDTBL_ITEM *item = idtbl_lookup(idtbl, key);
+	
+	return (item != NULL ? item->addrs : NULL);
+}
+
+/* Return 0 (and don't touch the table) if "key" is already in use */
+int idtbl_insert(IDTBL *idtbl, const ape_id *key, void *structaddr)
+{
+	IDTBL_ITEM *item;
+	
+	if (structaddr == NULL || idtbl_lookup(idtbl, key) != NULL) {
+		return 0;
+	}
+	
+	if (++idtbl->count > idtbl->size / 4 * 3) {
+		idtbl_rehash(idtbl, idtbl->old_size);
+		
+		idtbl->old = idtbl->table;
+		idtbl->old_size = idtbl->size;
+		idtbl->old_pos = 0;
+		
+		idtbl->size *= 2;
+		idtbl->table = idtbl_alloc(idtbl->size);
+	}
+	
+	item = idtbl_free_slot(idtbl, key);
+	item->key = *key;
+	item->addrs = structaddr;
+	
+	return 1;
+}
+
+void idtbl_append(IDTBL *idtbl, const ape_id *key, void *structaddr)
+{
+	IDTBL_ITEM *item;
+	
+	if (structaddr != NULL && (item = idtbl_lookup(idtbl, key)) != NULL) {
+		item->addrs = structaddr;
+		return;
+	}
+	idtbl_insert(idtbl, key, structaddr);
+}
+
+void idtbl_erase(IDTBL *idtbl, const ape_id *key)
+{
+	IDTBL_ITEM *item;
+	unsigned int i, j, home, mask;
+	
+	idtbl_rehash(idtbl, IDTBL_REHASH_STEP);
+	
+	if ((item = idtbl_find(idtbl->table, idtbl->size, key)) == NULL) {
+		
+		/* Not moved yet : the old table only gets deletion marks */
+		if (idtbl->old != NULL && (item = idtbl_find(idtbl->old, idtbl->old_size, key)) != NULL) {
+			item->addrs = idtbl_deleted;
+			idtbl->count--;
+		}
+		return;
+	}
+	idtbl->count--;
+	
+	/* Backward shift deletion (see hashtbl_erase()) */
+	mask = idtbl->size - 1;
+	
+	for (i = j = (item - idtbl->table); ; ) {
+		j = (j + 1) & mask;
+		
+		if (idtbl->table[j].addrs == NULL) {
+			break;
+		}
+		home = ID_HOME(&idtbl->table[j].key, idtbl->size);
+		
+		if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+			idtbl->table[i] = idtbl->table[j];
+			i = j;
+		}
+	}
+	idtbl->table[i].addrs = NULL;
+}
+
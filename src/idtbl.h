@@ -0,0 +1,77 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* idtbl.h */
+
+#ifndef _IDTBL_H
+#define _IDTBL_H
+
+#include <stdint.h>
+
+/*
+	Binary form of the 32 hex chars identifiers (sessid, pubid).
+	Hex is only decoded/encoded at the protocol edge.
+*/
+typedef struct _ape_id
+{
+	uint64_t hi;
+	uint64_t lo;
+} ape_id;
+
+#define APE_ID_HEX_LEN 32
+#define APE_ID_EQUAL(a, b) ((a)->lo == (b)->lo && (a)->hi == (b)->hi)
+#define APE_ID_POOL 256 // Ids drawn from the kernel CSPRNG at once
+
+/*
+	Hash table keyed by ape_id (ids are random : the low bits are used as hash).
+	Same incremental rehash as HTBL (see hash.h), entries are stored in the slots
+	(there is no iteration list).
+*/
+#define IDTBL_MIN 16
+#define IDTBL_REHASH_STEP 8
+
+typedef struct _idtbl_item
+{
+	ape_id key;
+	void *addrs; /* NULL : free slot */
+} IDTBL_ITEM;
+
+typedef struct IDTBL
+{
+	IDTBL_ITEM *table;
+	unsigned int size;
+	unsigned int count;
+	
+	IDTBL_ITEM *old;
+	unsigned int old_size;
+	unsigned int old_pos;
+} IDTBL;
+
+int ape_id_decode(const char *hex, ape_id *id);
+char *ape_id_encode(const ape_id *id, char *hex);
+void ape_id_random(ape_id *id);
+
+IDTBL *idtbl_init();
+void idtbl_free(IDTBL *idtbl);
+void *idtbl_seek(IDTBL *idtbl, const ape_id *key);
+void idtbl_erase(IDTBL *idtbl, const ape_id *key);
+void idtbl_append(IDTBL *idtbl, const ape_id *key, void *structaddr);
+int idtbl_insert(IDTBL *idtbl, const ape_id *key, void *structaddr);
+
+#endif
@@ -23,16 +23,23 @@
 #include <stdlib.h>
 
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "json.h"
 #include "utils.h"
+#include "slab.h"
+
+static slab_cache json_cache = SLAB_CACHE("json", struct json);
+static slab_cache json_childs_cache = SLAB_CACHE("json_childs", struct json_childs);
 
 void set_json(const char *name, const char *value, struct json **jprev)
 {
 	struct json *new_json, *old_json = *jprev;
 	
 	
-	new_json = xmalloc(sizeof(struct json));
+	new_json = slab_alloc(&json_cache);
 	
 	new_json->name.len = strlen(name);
 	new_json->name.buf = xmalloc(sizeof(char) * (new_json->name.len + 1));
@@ -63,7 +70,7 @@ void set_json(const char *name, const char *value, struct json **jprev)
 
 struct json *json_copy(struct json *jbase)
 {
-	struct json *new_json = xmalloc(sizeof(struct json));
+	struct json *new_json = slab_alloc(&json_cache);
 	struct json_childs *jchilds = jbase->jchilds;
 	
 	new_json->name.len = jbase->name.len;
@@ -94,7 +101,7 @@ struct json *json_copy(struct json *jbase)
 		
 	
 	while (jchilds != NULL) {
-		struct json_childs *new_child = xmalloc(sizeof(struct json_childs));
+		struct json_childs *new_child = slab_alloc(&json_childs_cache);
 		
 		new_child->type = jchilds->type;
 		new_child->child = json_copy(jchilds->child);
@@ -128,13 +135,15 @@ void json_free(struct json *jbase)
 	}
 		
 	while (jchilds != NULL) {
+		struct json_childs *jnext = jchilds->next;
 
 		json_free(jchilds->child);
+		slab_free(&json_childs_cache, jchilds);
 		
-		jchilds = jchilds->next;
+		jchilds = jnext;
 	}
 	
-	free(jbase);
+	slab_free(&json_cache, jbase);
 
 }
 
@@ -144,7 +153,7 @@ void json_attach(struct json *json_father, struct json *json_child, unsigned int
 	
 	json_child->jfather = json_father;
 	
-	nchild = xmalloc(sizeof(struct json_childs));
+	nchild = slab_alloc(&json_childs_cache);
 	
 	nchild->child = json_child;
 	nchild->next = ochild;
@@ -255,7 +264,7 @@ struct jsontring *jsontr(struct json *jlist, struct jsontring *string)
 		} else if (pchild != NULL) {
 			string->jstring[string->len++] = ',';
 		}
-		free(pPchild);
+		slab_free(&json_childs_cache, pPchild);
 	}
 	if (jlist->next == NULL) {
 		string->jstring[string->len++] = '}';
@@ -268,18 +277,233 @@ struct jsontring *jsontr(struct json *jlist, struct jsontring *string)
 	}
 
 	if (jlist->jchilds == NULL) {
-		free(jlist);
+		slab_free(&json_cache, jlist);
 		
 		return string;
 	}
-	free(jlist);
+	slab_free(&json_cache, jlist);
 	return string;
 }
 
-static json_item *init_json_item()
+/* Buffers released by json_writer_release() (only used by the main loop) */
+static struct {
+	char *buf;
+	size_t size;
+} writer_pool[JSON_WRITER_POOL];
+static int writer_pool_len = 0;
+
+void json_writer_init(json_writer *w)
+{
+	if (writer_pool_len) {
+		writer_pool_len--;
+		w->buf = writer_pool[writer_pool_len].buf;
+		w->size = writer_pool[writer_pool_len].size;
+	} else {
+		w->size = JSON_WRITER_SIZE;
+		w->buf = xmalloc(sizeof(char) * w->size);
+	}
+	w->len = 0;
+	w->need_comma = 0;
+}
+
+void json_writer_release(json_writer *w)
+{
+	if (writer_pool_len < JSON_WRITER_POOL) {
+		writer_pool[writer_pool_len].buf = w->buf;
+		writer_pool[writer_pool_len].size = w->size;
+		writer_pool_len++;
+	} else {
+		free(w->buf);
+	}
+	w->buf = NULL;
+}
+
+/* Give the buffer (NUL terminated, "len" long) to the caller instead of the pool. Free it with free() */
+char *json_writer_detach(json_writer *w)
+{
+	char *buf = w->buf;
+	
+	w->buf = NULL;
+	
+	return buf;
+}
+
+static void jw_write(json_writer *w, const char *data, size_t len)
+{
+	if (w->len + len + 1 > w->size) {
+		while (w->len + len + 1 > w->size) {
+			w->size *= 2;
+		}
+		w->buf = xrealloc(w->buf, sizeof(char) * w->size);
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+	w->buf[w->len] = '\0';
+}
+
+#define jw_putc(w, c) jw_write(w, c, 1)
+
+/* Separator before a key or a value */
+static void jw_sep(json_writer *w)
+{
+	if (w->need_comma) {
+		jw_putc(w, ",");
+	}
+	w->need_comma = 0;
+}
+
+void json_writer_begin_object(json_writer *w)
+{
+	jw_sep(w);
+	jw_putc(w, "{");
+}
+
+void json_writer_end_object(json_writer *w)
+{
+	jw_putc(w, "}");
+	w->need_comma = 1;
+}
+
+void json_writer_begin_array(json_writer *w)
+{
+	jw_sep(w);
+	jw_putc(w, "[");
+}
+
+void json_writer_end_array(json_writer *w)
 {
+	jw_putc(w, "]");
+	w->need_comma = 1;
+}
+
+void json_writer_key(json_writer *w, const char *key)
+{
+	jw_sep(w);
+	jw_putc(w, "\"");
+	jw_write(w, key, strlen(key));
+	jw_write(w, "\":", 2);
+}
+
+void json_writer_string(json_writer *w, const char *value)
+{
+	size_t len = (value != NULL ? strlen(value) : 0);
 	
-	json_item *jval = malloc(sizeof(*jval));
+	jw_sep(w);
+	if (len) {
+		jw_putc(w, "\"");
+		jw_write(w, value, len);
+		jw_putc(w, "\"");
+	} else {
+		jw_write(w, "null", 4);
+	}
+	w->need_comma = 1;
+}
+
+/* Write already serialized JSON as a value */
+void json_writer_raw(json_writer *w, const char *data, size_t len)
+{
+	jw_sep(w);
+	jw_write(w, data, len);
+	w->need_comma = 1;
+}
+
+/* Write the members of an already serialized object ("{...}") into the current object */
+void json_writer_raw_members(json_writer *w, const char *data, size_t len)
+{
+	if (len > 2) {
+		jw_sep(w);
+		jw_write(w, data + 1, len - 2);
+		w->need_comma = 1;
+	}
+}
+
+/* Write a json tree as an object (the tree is kept, output is the same as jsontr()) */
+void json_writer_json(json_writer *w, struct json *jlist)
+{
+	if (jlist == NULL) {
+		json_writer_string(w, NULL);
+		return;
+	}
+	json_writer_begin_object(w);
+	json_writer_members(w, jlist);
+	json_writer_end_object(w);
+}
+
+/* Write the members of a json tree into the current object */
+void json_writer_members(json_writer *w, struct json *jlist)
+{
+	struct json_childs *pchild;
+	
+	for (; jlist != NULL; jlist = jlist->next) {
+		json_writer_key(w, jlist->name.buf);
+		
+		if ((pchild = jlist->jchilds) == NULL) {
+			json_writer_string(w, jlist->value.buf);
+			continue;
+		}
+		if (pchild->type == JSON_ARRAY) {
+			json_writer_begin_array(w);
+		}
+		for (; pchild != NULL; pchild = pchild->next) {
+			json_writer_json(w, pchild->child);
+			
+			if (pchild->next == NULL && pchild->type == JSON_ARRAY) {
+				json_writer_end_array(w);
+			}
+		}
+	}
+}
+
+#define JSON_ARENA_HDR ((sizeof(struct _json_arena_chunk) + JSON_ARENA_ALIGN - 1) & ~(JSON_ARENA_ALIGN - 1))
+
+/* One default-sized chunk is kept between requests */
+static struct _json_arena_chunk *arena_spare = NULL;
+
+void *json_arena_alloc(json_arena *arena, size_t size)
+{
+	struct _json_arena_chunk *chunk = arena->head;
+	
+	size = (size + JSON_ARENA_ALIGN - 1) & ~(JSON_ARENA_ALIGN - 1);
+	
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		if (size <= JSON_ARENA_CHUNK && arena_spare != NULL) {
+			chunk = arena_spare;
+			arena_spare = NULL;
+		} else {
+			size_t csize = (size > JSON_ARENA_CHUNK ? size : JSON_ARENA_CHUNK);
+			
+			chunk = xmalloc(JSON_ARENA_HDR + csize);
+			chunk->size = csize;
+		}
+		chunk->used = 0;
+		chunk->next = arena->head;
+		arena->head = chunk;
+	}
+	chunk->used += size;
+	
+	return (char *)chunk + JSON_ARENA_HDR + chunk->used - size;
+}
+
+void json_arena_release(json_arena *arena)
+{
+	struct _json_arena_chunk *chunk, *next;
+	
+	for (chunk = arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		
+		if (arena_spare == NULL && chunk->size == JSON_ARENA_CHUNK) {
+			arena_spare = chunk;
+		} else {
+			free(chunk);
+		}
+	}
+	arena->head = NULL;
+}
+
+static json_item *init_json_item(json_arena *arena)
+{
+	
+	json_item *jval = json_arena_alloc(arena, sizeof(*jval));
 
 	jval->father = NULL;
 	jval->child = NULL;
@@ -297,156 +521,345 @@ static json_item *init_json_item()
 	return jval;
 }
 
-static int json_callback(void *ctx, int type, const JSON_value* value)
+/*
+	Buffer-at-a-time parser. It builds the same json_item tree as the JSON_parser
+	callbacks did, working on the whole request buffer instead of one call per char.
+	An escape sequence never gives more bytes than it takes, so strings are unescaped
+	in place : keys and values are always slices of the request buffer.
+*/
+#define JSON_MAX_DEPTH 15
+
+typedef struct _json_scan {
+	char *pos;
+	char *end; /* Terminating \0 */
+	json_arena *arena;
+} json_scan;
+
+#define JSON_IS_WS(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+#define JSON_IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+/* Stops on quotes, backslashes and control chars (the final \0 included) */
+#define JSON_STR_STOP(c) ((unsigned char)(c) < 0x20 || (c) == '"' || (c) == '\\')
+
+static char *json_skip_ws(char *p)
+{
+	while (JSON_IS_WS(*p)) {
+		p++;
+	}
+	return p;
+}
+
+/* Length of the run of plain string chars at p */
+static size_t json_string_run(const char *p, const char *end)
 {
-	json_context *cx = (json_context *)ctx;
-	json_item *jval = NULL;
+	const char *start = p;
 	
-	switch(type) {
-		case JSON_T_OBJECT_BEGIN:
-		case JSON_T_ARRAY_BEGIN:
-			
-			if (!cx->key_under) {
-				jval = init_json_item();
-				
-				if (cx->current_cx != NULL) {
-					if (cx->start_depth) {
-						cx->current_cx->child = jval;
-						jval->father = cx->current_cx;
-					} else {
-						jval->father = cx->current_cx->father;
-						cx->current_cx->next = jval;
-					}
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\'), ctrl = _mm_set1_epi8(0x1f);
+	
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)p);
+		
+		/* max_epu8(c, 0x1f) == 0x1f <=> c <= 0x1f (unsigned) */
+		int mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, bslash)),
+				_mm_cmpeq_epi8(_mm_max_epu8(chunk, ctrl), ctrl)));
+		
+		if (mask) {
+			return (p - start) + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif
+	while (!JSON_STR_STOP(*p)) {
+		p++;
+	}
+	return p - start;
+}
+
+static int json_hex4(const char *p)
+{
+	int i, c, ret = 0;
+	
+	for (i = 0; i < 4; i++) {
+		c = p[i];
+		ret <<= 4;
+		
+		if (c >= '0' && c <= '9') {
+			ret |= c - '0';
+		} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+			ret |= (c | 0x20) - 'a' + 10;
+		} else {
+			return -1;
+		}
+	}
+	return ret;
+}
+
+/* \uXXXX (or a surrogate pair) at src, written as UTF-8 at dst. Returns the next src char */
+static char *json_unescape_unicode(char *src, char **dst)
+{
+	int uc = json_hex4(src + 2);
+	unsigned char *out = (unsigned char *)*dst;
+	
+	src += 6;
+	
+	if (uc < 0 || (uc & 0xFC00) == 0xDC00) {
+		return NULL;
+	}
+	if ((uc & 0xFC00) == 0xD800) {
+		int low;
+		
+		if (src[0] != '\\' || src[1] != 'u' || ((low = json_hex4(src + 2)) & 0xFC00) != 0xDC00) {
+			return NULL;
+		}
+		uc = (((uc & 0x3FF) << 10) | (low & 0x3FF)) + 0x10000;
+		src += 6;
+	}
+	
+	if (uc < 0x80) {
+		*out++ = uc;
+	} else if (uc < 0x800) {
+		*out++ = 0xC0 | (uc >> 6);
+		*out++ = 0x80 | (uc & 0x3F);
+	} else if (uc < 0x10000) {
+		*out++ = 0xE0 | (uc >> 12);
+		*out++ = 0x80 | ((uc >> 6) & 0x3F);
+		*out++ = 0x80 | (uc & 0x3F);
+	} else {
+		*out++ = 0xF0 | (uc >> 18);
+		*out++ = 0x80 | ((uc >> 12) & 0x3F);
+		*out++ = 0x80 | ((uc >> 6) & 0x3F);
+		*out++ = 0x80 | (uc & 0x3F);
+	}
+	*dst = (char *)out;
+	
+	return src;
+}
+
+/* String at s->pos (opening quote), \0 terminated in place */
+static char *json_scan_string(json_scan *s, size_t *len)
+{
+	char *start = s->pos + 1, *src, *dst;
+	
+	src = dst = start + json_string_run(start, s->end);
+	
+	while (*src != '"') {
+		size_t run;
+		
+		if (*src != '\\') {
+			return NULL;
+		}
+		switch(src[1]) {
+			case '"':
+			case '\\':
+			case '/':
+				*dst++ = src[1];
+				break;
+			case 'b':
+				*dst++ = '\b';
+				break;
+			case 'f':
+				*dst++ = '\f';
+				break;
+			case 'n':
+				*dst++ = '\n';
+				break;
+			case 'r':
+				*dst++ = '\r';
+				break;
+			case 't':
+				*dst++ = '\t';
+				break;
+			case 'u':
+				if ((src = json_unescape_unicode(src, &dst)) == NULL) {
+					return NULL;
 				}
-				cx->current_cx = jval;
-			}
-			cx->start_depth = 1;
-			cx->key_under = 0;
-			break;
-		case JSON_T_OBJECT_END:
-		case JSON_T_ARRAY_END:
-			
-			/* If the father node exists, back to it */
-			if (cx->current_cx->father != NULL) {
-				cx->current_cx = cx->current_cx->father;
-			}
-			cx->start_depth = 0;
-			cx->key_under = 0;
-			break;
+				src -= 2;
+				break;
+			default:
+				return NULL;
+		}
+		src += 2;
+		
+		run = json_string_run(src, s->end);
+		memmove(dst, src, run);
+		src += run;
+		dst += run;
+	}
+	*dst = '\0';
+	*len = dst - start;
+	s->pos = src + 1;
+	
+	return start;
+}
 
-		case JSON_T_KEY:
-			jval = init_json_item();
+static int json_scan_number(json_scan *s, json_item *item)
+{
+	char *p = s->pos;
+	int is_float = 0;
+	
+	if (*p == '-') {
+		p++;
+	}
+	if (*p == '0') {
+		p++;
+	} else if (JSON_IS_DIGIT(*p)) {
+		while (JSON_IS_DIGIT(*p)) {
+			p++;
+		}
+	} else {
+		return 0;
+	}
+	if (*p == '.') {
+		if (!JSON_IS_DIGIT(p[1])) {
+			return 0;
+		}
+		for (p++; JSON_IS_DIGIT(*p); p++);
+		is_float = 1;
+	}
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		if (*p == '+' || *p == '-') {
+			p++;
+		}
+		if (!JSON_IS_DIGIT(*p)) {
+			return 0;
+		}
+		while (JSON_IS_DIGIT(*p)) {
+			p++;
+		}
+		is_float = 1;
+	}
+	
+	if (is_float) {
+		item->jval.vu.float_value = strtold(s->pos, NULL);
+		item->type = JSON_T_FLOAT;
+	} else {
+		item->jval.vu.integer_value = (JSON_int_t)strtoll(s->pos, NULL, 10);
+		item->type = JSON_T_INTEGER;
+	}
+	s->pos = p;
+	
+	return 1;
+}
 
-			if (cx->start_depth) {
-				cx->current_cx->child = jval;
-				jval->father = cx->current_cx;
-				cx->start_depth = 0;
-			} else {
-				jval->father = cx->current_cx->father;
-				cx->current_cx->next = jval;
-			}				
+static int json_scan_value(json_scan *s, json_item *item, int depth);
 
-			
-			cx->current_cx = jval;
-			cx->key_under = 1;
-			cx->current_cx->key.val = xstrdup(value->vu.str.value);
-			cx->current_cx->key.len = value->vu.str.length;
-			
-			break;  
-			
-		case JSON_T_INTEGER:
-		case JSON_T_FLOAT:
-		case JSON_T_NULL:
-		case JSON_T_TRUE:
-		case JSON_T_FALSE:
-		case JSON_T_STRING:
-						
-			if (!cx->key_under) {
-			
-				jval = init_json_item();
-
-				if (cx->start_depth) {
-					cx->current_cx->child = jval;
-					jval->father = cx->current_cx;
-					cx->start_depth = 0;
-				} else {
-					jval->father = cx->current_cx->father;
-					cx->current_cx->next = jval;
-				}	
+/* Members are children of "father" ({} and [] values hold their members) */
+static int json_scan_container(json_scan *s, json_item *father, int depth)
+{
+	json_item *item, *prev = NULL;
+	char close = (*s->pos == '{' ? '}' : ']');
+	
+	if (depth > JSON_MAX_DEPTH) {
+		return 0;
+	}
+	s->pos = json_skip_ws(s->pos + 1);
+	
+	if (*s->pos == close) {
+		s->pos++;
+		return 1;
+	}
+	
+	while (1) {
+		item = init_json_item(s->arena);
+		item->father = father;
+		
+		if (prev == NULL) {
+			father->child = item;
+		} else {
+			prev->next = item;
+		}
+		prev = item;
 		
-				cx->current_cx = jval;				
+		if (close == '}') {
+			if (*s->pos != '"' || (item->key.val = json_scan_string(s, &item->key.len)) == NULL) {
+				return 0;
 			}
-			cx->key_under = 0;
+			s->pos = json_skip_ws(s->pos);
 			
-			switch(type) {
-				case JSON_T_INTEGER:
-					cx->current_cx->jval.vu.integer_value = value->vu.integer_value;
-					break;
-				case JSON_T_FLOAT:
-					cx->current_cx->jval.vu.float_value = value->vu.float_value;
-					break;
-				case JSON_T_NULL:
-				case JSON_T_FALSE:
-					cx->current_cx->jval.vu.integer_value = 0;
-					break;
-				case JSON_T_TRUE:
-					cx->current_cx->jval.vu.integer_value = 1;
-					break;
-				case JSON_T_STRING:
-					cx->current_cx->jval.vu.str.value = xmalloc(sizeof(char) * (value->vu.str.length+1));
-					cx->current_cx->jval.vu.str.value = xstrdup(value->vu.str.value);
-					cx->current_cx->jval.vu.str.length = value->vu.str.length;			
-					break;
+			if (*s->pos != ':') {
+				return 0;
 			}
-			cx->current_cx->type = type;
-			break;
-		default:
+			s->pos = json_skip_ws(s->pos + 1);
+		}
+		
+		if (!json_scan_value(s, item, depth)) {
+			return 0;
+		}
+		s->pos = json_skip_ws(s->pos);
+		
+		if (*s->pos == ',') {
+			s->pos = json_skip_ws(s->pos + 1);
+		} else if (*s->pos == close) {
+			s->pos++;
+			return 1;
+		} else {
+			return 0;
+		}
+	}
+}
 
+static int json_scan_value(json_scan *s, json_item *item, int depth)
+{
+	switch(*s->pos) {
+		case '{':
+		case '[':
+			return json_scan_container(s, item, depth + 1);
+		case '"':
+			if ((item->jval.vu.str.value = json_scan_string(s, &item->jval.vu.str.length)) == NULL) {
+				return 0;
+			}
+			item->type = JSON_T_STRING;
+			break;
+		case 't':
+			if (strncmp(s->pos, "true", 4) != 0) {
+				return 0;
+			}
+			s->pos += 4;
+			item->jval.vu.integer_value = 1;
+			item->type = JSON_T_TRUE;
 			break;
+		case 'f':
+			if (strncmp(s->pos, "false", 5) != 0) {
+				return 0;
+			}
+			s->pos += 5;
+			item->jval.vu.integer_value = 0;
+			item->type = JSON_T_FALSE;
+			break;
+		case 'n':
+			if (strncmp(s->pos, "null", 4) != 0) {
+				return 0;
+			}
+			s->pos += 4;
+			item->jval.vu.integer_value = 0;
+			item->type = JSON_T_NULL;
+			break;
+		default:
+			return json_scan_number(s, item);
 	}
-	
-    	if (cx->head == NULL && cx->current_cx != NULL) {
-    		cx->head = cx->current_cx;
-    	}
-    	
 	return 1;
 }
 
-json_item *init_json_parser(const char *json_string)
+/* Parse a request buffer (modified in place). The tree lives until json_arena_release() */
+json_item *init_json_parser(char *json_string, json_arena *arena)
 {
-	const char *pRaw;
-	JSON_config config;
-
-	struct JSON_parser_struct* jc = NULL;
+	json_scan s;
+	json_item *head;
 	
-	json_context jcx = {0, 0, NULL, NULL};
-
-	init_JSON_config(&config);
-	
-	config.depth		= 15;
-	config.callback		= &json_callback;
-	config.callback_ctx	= &jcx;
+	s.pos = json_skip_ws(json_string);
+	s.end = json_string + strlen(json_string);
+	s.arena = arena;
 	
-	config.allow_comments	= 0;
-	config.handle_floats_manually = 0;
-
-	jc = new_JSON_parser(&config);
-
-	for (pRaw = json_string; *pRaw; pRaw++) {
-		if (!JSON_parser_char(jc, *pRaw)) {
-		    delete_JSON_parser(jc);
-		    return NULL;
-		}
-	}
+	head = init_json_item(arena);
 	
-	if (!JSON_parser_done(jc)) {
-		delete_JSON_parser(jc);
+	if (!json_scan_value(&s, head, 0) || *json_skip_ws(s.pos) != '\0') {
 		return NULL;
 	}
-
-	delete_JSON_parser(jc);
 	
-	return jcx.head;	
+	return head;
 }
 
 static void aff(json_item *cx, int depth)
@@ -491,39 +904,50 @@ static int key_is_array(char *key, int i)
 	return ret;
 }
 
-json_item *json_lookup(json_item *head, char *path)
+/* "a.b.c" : keys are slices of str (which must outlive the path) */
+void json_path_compile(json_path *path, const char *str)
 {
-	char *split[16];
-	char *base;
-	size_t nTok;
-	int i = 0;
+	const char *dot;
 	
-	if (head == NULL || path == NULL) {
-		return NULL;
+	for (path->depth = 0; path->depth < JSON_PATH_DEPTH - 1 && (dot = strchr(str, '.')) != NULL; path->depth++) {
+		path->key[path->depth].val = str;
+		path->key[path->depth].len = dot - str;
+		str = dot + 1;
 	}
-	
-	base = xstrdup(path);
+	path->key[path->depth].val = str;
+	path->key[path->depth].len = strlen(str);
+	path->depth++;
+}
 
-	nTok = explode('.', base, split, 15);
+/* Keys are case insensitive. An item holding members gives its first member */
+json_item *json_path_lookup(json_item *head, const json_path *path)
+{
+	int i = 0;
 	
-	while (head != NULL && i <= nTok) {
-		if (head->key.val != NULL && strcasecmp(split[i], head->key.val) == 0) {
-			/*
-			printf("Array %s : %i\n", split[i], key_is_array(split[i], strlen(split[i])-1));
-			printf("Comparing : %s with %s\n", head->key.val, split[i]);
-			printf("Find !\n");
-			*/
-			if (i == nTok) {
+	while (head != NULL) {
+		if (head->key.val != NULL && head->key.len == path->key[i].len &&
+			strncasecmp(path->key[i].val, head->key.val, head->key.len) == 0) {
+			
+			if (++i == path->depth) {
 				return (head->child != NULL ? head->child : head);
 			}
-			i++;
 			head = head->child;
 			continue;
 		}
-
 		head = head->next;
 	}
-	free(base);
 	return NULL;
 }
 
+json_item *json_lookup(json_item *head, const char *path)
+{
+	json_path jpath;
+	
+	if (head == NULL || path == NULL) {
+		return NULL;
+	}
+	json_path_compile(&jpath, path);
+	
+	return json_path_lookup(head, &jpath);
+}
+
@@ -88,15 +88,49 @@ enum {
 	JSON_ITEM_VAL
 };
 
-typedef struct _json_context {
-	int key_under;
-	int start_depth;
-		
-	json_item *head;
-	json_item *current_cx;
+/* Compiled lookup path ("a.b.c") */
+#define JSON_PATH_DEPTH 16
 
+typedef struct _json_path {
+	int depth;
+	struct {
+		const char *val;
+		size_t len;
+	} key[JSON_PATH_DEPTH];
+} json_path;
+
+/*
+	Streaming writer : JSON is written as it goes into a pooled buffer (no tree).
+	Values are written as is (same as jsontr()), a NULL or empty string gives null.
+*/
+#define JSON_WRITER_SIZE 512 // Initial size of a pooled buffer
+#define JSON_WRITER_POOL 16 // Spare buffers kept
+
+typedef struct _json_writer {
+	char *buf;
+	size_t len;
+	size_t size;
 	
-} json_context;
+	int need_comma;
+} json_writer;
+
+/*
+	Per-request bump arena for parse trees (strings are slices of the
+	request buffer), released in one shot.
+*/
+#define JSON_ARENA_CHUNK 4096
+#define JSON_ARENA_ALIGN 16
+
+struct _json_arena_chunk {
+	struct _json_arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+typedef struct _json_arena {
+	struct _json_arena_chunk *head;
+} json_arena;
+
 
 
 void set_json(const char *name, const char *value, struct json **jprev);
@@ -105,21 +139,27 @@ void json_attach(struct json *json_father, struct json *json_child, unsigned int
 void json_concat(struct json *json_father, struct json *json_child);
 void json_free(struct json *jbase);
 struct jsontring *jsontr(struct json *jlist, struct jsontring *string);
-json_item *init_json_parser(const char *json_string);
-json_item *json_lookup(json_item *head, char *path);
+void json_writer_init(json_writer *w);
+void json_writer_release(json_writer *w);
+char *json_writer_detach(json_writer *w);
+void json_writer_begin_object(json_writer *w);
+void json_writer_end_object(json_writer *w);
+void json_writer_begin_array(json_writer *w);
+void json_writer_end_array(json_writer *w);
+void json_writer_key(json_writer *w, const char *key);
+void json_writer_string(json_writer *w, const char *value);
+void json_writer_raw(json_writer *w, const char *data, size_t len);
+void json_writer_raw_members(json_writer *w, const char *data, size_t len);
+void json_writer_json(json_writer *w, struct json *jlist);
+void json_writer_members(json_writer *w, struct json *jlist);
+
+json_item *init_json_parser(char *json_string, json_arena *arena);
+void *json_arena_alloc(json_arena *arena, size_t size);
+void json_arena_release(json_arena *arena);
+void json_path_compile(json_path *path, const char *str);
+json_item *json_path_lookup(json_item *head, const json_path *path);
+json_item *json_lookup(json_item *head, const char *path);
 
-#define APE_PARAMS_INIT() \
-	json_item *json_params = NULL
-
-#define JSTR(key) \
-	(char *)(callbacki->param != NULL && (json_params = json_lookup(callbacki->param, #key)) != NULL ? json_params->jval.vu.str.value : NULL)
-
-#define JINT(key) \
-	(int)(callbacki->param != NULL && (json_params = json_lookup(callbacki->param, #key)) != NULL ? json_params->jval.vu.integer_value : 0)
-	
-#define JFLOAT(key) \
-	(callbacki->param != NULL && (json_params = json_lookup(callbacki->param, #key)) != NULL ? json_params->jval.vu.float_value : 0.)
-	
 #define JGET_STR(head, key) \
 	json_lookup(head, #key)->jval.vu.str.value
 
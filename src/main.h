@@ -33,6 +33,7 @@
 #include <ctype.h>
 
 #include "hash.h"
+#include "idtbl.h"
 
 
 #define MAX_IO 4096
@@ -51,25 +52,80 @@
 typedef struct _acetables
 {
 	HTBL *hLogin;
-	HTBL *hSessid;
+	IDTBL *hSessid;
 	HTBL *hLusers;
 	HTBL *hCallback;
 
-	HTBL *hPubid;
+	IDTBL *hPubid;
 
 	struct apeconfig *srv;
 	struct USERS *uHead;
 	
-	struct _ticks_callback *timers;
+	struct _ticks_wheel *timers;
+	unsigned int ticks_rate;
 	
-	struct _socks_bufout *bufout;
+	/* Main loop output queues (see sock.c) */
+	struct _socks_output *output;
+	
+	/* Content-Encoding (see compress.c) */
+	struct _compress *compress;
+	
+	/* Main loop connections, and copies of the workers' ones it answers, indexed by fd (see sockroutine()) */
+	struct _connection *co;
+	
+	/* Keep-alive connections to parse again once their response is complete (see http_end()) */
+	struct {
+		int *fd;
+		int n;
+		int size;
+	} http_resume;
+	
+	/* Main loop connections waiting for a request (fds), oldest first (see check_idle()) */
+	struct _socks_idle {
+		int head;
+		int foot;
+	} http_idle;
 	
 	unsigned int nConnected;
+	
+	/* Users and subusers ordered by idle time, oldest first (see check_timeout()) */
+	struct {
+		struct USERS *uhead;
+		struct USERS *ufoot;
+		struct _subuser *shead;
+		struct _subuser *sfoot;
+	} idle;
+	
+	/* Channels with more than "page" members send their users by pages (ROSTER) */
+	struct {
+		unsigned int page; /* 0 : disabled */
+	} roster;
+	
+	/*
+		Channels aggregating JOIN/LEFT/SETLVL into PRESENCE raws (see presence_flush()) :
+		all of them if window is set, channels larger than roster.page otherwise (one tick)
+	*/
+	struct {
+		unsigned int window; /* ticks */
+		struct CHANNEL *pending;
+	} presence;
+	
+	/* Subusers with RAWs waiting to be flushed (see subuser_ready()) */
+	struct {
+		struct _subuser *head;
+		unsigned int coalesce; /* usec, 0 : flush at the end of each event loop iteration */
+	} ready;
 
 	struct _ace_plugins *plugins;
 	
 	int *epoll_fd;
 	
+	struct {
+		struct _socks_worker *list;
+		int n;
+		struct _socks_handoff *handoff;
+	} workers;
+	
 	struct {
 		struct _ape_proxy *list;
 		struct _ape_proxy_cache *hosts;
@@ -77,7 +133,8 @@ typedef struct _acetables
 	struct _extend *properties;
 } acetables;
 
-#define HEADER "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: text/html\r\n\r\n"
+#define HEADER_FIELDS "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: text/html\r\n"
+#define HEADER HEADER_FIELDS "\r\n"
 #define HEADER_LEN 144
 
 
@@ -23,22 +23,15 @@
 #include "utils.h"
 
 
-const char basic_chars[16] = { 	'a', 'b', 'c', 'd', 'e', 'f', '0', '1',
-				'2', '3', '4', '5', '6', '7', '8', '9'
-			};
-
-
-/* Generate a string (32 chars) used for sessid and pubid */
-void gen_sessid_new(char *input, acetables *g_ape)
+/*
+	Generate a random 128 bits id (sessid, pubid) and register "addrs" with it in "index".
+	Its hex form is only built when sent (see ape_id_encode())
+*/
+void gen_sessid_new(ape_id *id, IDTBL *index, void *addrs)
 {
-	unsigned int i;
-	
 	do {
-		for (i = 0; i < 32; i++) {
-			input[i] = basic_chars[rand()%16];
-		}
-		input[32] = '\0';
-	} while(seek_user_id(input, g_ape) != NULL || seek_user_simple(input, g_ape) != NULL); // Colision verification
+		ape_id_random(id);
+	} while (!idtbl_insert(index, id, addrs)); // Colision verification
 }
 
 /* Init a pipe (user, channel, proxy) */
@@ -51,15 +44,14 @@ transpipe *init_pipe(void *pipe, int type, acetables *g_ape)
 	npipe->type = type;
 	npipe->link = NULL;
 	
-	gen_sessid_new(npipe->pubid, g_ape);
-	hashtbl_append(g_ape->hPubid, npipe->pubid, (void *)npipe);
+	gen_sessid_new(&npipe->id, g_ape->hPubid, (void *)npipe);
 	return npipe;
 }
 
 void destroy_pipe(transpipe *pipe, acetables *g_ape)
 {
 	unlink_all_pipe(pipe, g_ape);
-	hashtbl_erase(g_ape->hPubid, pipe->pubid);
+	idtbl_erase(g_ape->hPubid, &pipe->id);
 	free(pipe);
 }
 
@@ -106,10 +98,12 @@ void unlink_all_pipe(transpipe *origin, acetables *g_ape)
 
 transpipe *get_pipe(const char *pubid, acetables *g_ape)
 {
-	if (strlen(pubid) != 32) {
+	ape_id id;
+	
+	if (!ape_id_decode(pubid, &id)) {
 		return NULL;
 	}
-	return hashtbl_seek(g_ape->hPubid, pubid);
+	return idtbl_seek(g_ape->hPubid, &id);
 }
 
 /* pubid : recver; user = sender */
@@ -48,7 +48,7 @@ struct _transpipe
 	
 	int type;
 	
-	char pubid[33];
+	ape_id id; /* pubid (hPubid key), sent as hex */
 };
 
 transpipe *init_pipe(void *pipe, int type, acetables *g_ape);
@@ -57,7 +57,7 @@ void destroy_pipe(transpipe *pipe, acetables *g_ape);
 void link_pipe(transpipe *pipe_origin, transpipe *pipe_to, void (*on_unlink)(struct _transpipe *, struct _transpipe *, acetables *));
 transpipe *get_pipe(const char *pubid, acetables *g_ape);
 transpipe *get_pipe_strict(const char *pubid, struct USERS *user, acetables *g_ape);
-void gen_sessid_new(char *input, acetables *g_ape);
+void gen_sessid_new(ape_id *id, IDTBL *index, void *addrs);
 void unlink_all_pipe(transpipe *origin, acetables *g_ape);
 
 #endif
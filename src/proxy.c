@@ -178,16 +178,15 @@ void proxy_cache_addip(char *name, char *ip, acetables *g_ape)
 	g_ape->proxy.hosts = cache;
 }
 
-void proxy_attach(ape_proxy *proxy, char *pipe, int allow_write, acetables *g_ape)
+void proxy_attach(ape_proxy *proxy, transpipe *gpipe, int allow_write, acetables *g_ape)
 {
 	ape_proxy_pipe *to;
-	transpipe *gpipe;
 	
-	if (proxy == NULL || ((gpipe = get_pipe(pipe, g_ape)) == NULL)) {
+	if (proxy == NULL || gpipe == NULL) {
 		return;
 	}
 	to = xmalloc(sizeof(*to));
-	memcpy(to->pipe, gpipe->pubid, strlen(gpipe->pubid)+1);
+	to->pipe = gpipe->id;
 
 	to->allow_write = allow_write;
 	
@@ -209,7 +208,7 @@ void proxy_detach(transpipe *unlinker, transpipe *tproxy, acetables *g_ape)
 
 	while (*to != NULL) {
 
-		if (strcmp((*to)->pipe, unlinker->pubid) == 0) {
+		if (APE_ID_EQUAL(&(*to)->pipe, &unlinker->id)) {
 
 			ape_proxy_pipe *pTo = *to;
 			*to = (*to)->next;
@@ -250,7 +249,7 @@ void proxy_shutdown(ape_proxy *proxy, acetables *g_ape)
 }
 
 
-ape_proxy *proxy_are_linked(char *pubid, char *pubid_proxy, acetables *g_ape)
+ape_proxy *proxy_are_linked(transpipe *from, char *pubid_proxy, acetables *g_ape)
 {
 	transpipe *pipe = get_pipe(pubid_proxy, g_ape);
 	struct _ape_proxy_pipe *ppipe;
@@ -260,7 +259,7 @@ ape_proxy *proxy_are_linked(char *pubid, char *pubid_proxy, acetables *g_ape)
 	}
 	
 	while (ppipe != NULL) {
-		if (strcmp(pubid, ppipe->pipe) == 0) {
+		if (APE_ID_EQUAL(&from->id, &ppipe->pipe)) {
 			return ((ape_proxy *)(pipe->pipe));
 		}
 		ppipe = ppipe->next;
@@ -379,8 +378,9 @@ struct json *get_json_object_proxy(ape_proxy *proxy)
 	json *jstr = NULL;
 	json *jprop = NULL;
 	char port[8];
+	char pubid[APE_ID_HEX_LEN + 1];
 
-	set_json("pubid", proxy->pipe->pubid, &jstr);
+	set_json("pubid", ape_id_encode(&proxy->pipe->id, pubid), &jstr);
 	set_json("casttype", "proxy", &jstr);
 	
 	set_json("properties", NULL, &jstr);
@@ -404,3 +404,38 @@ struct json *get_json_object_proxy(ape_proxy *proxy)
 	return jstr;
 }
 
+/* Same as get_json_object_proxy() but written by a json_writer */
+void get_json_object_proxy_writer(ape_proxy *proxy, json_writer *w)
+{
+	extend *eTmp;
+	char port[8];
+	char pubid[APE_ID_HEX_LEN + 1];
+	
+	sprintf(port, "%i", proxy->sock.port);
+	
+	json_writer_begin_object(w);
+	
+	json_writer_key(w, "properties");
+	json_writer_begin_object(w);
+	
+	json_writer_key(w, "port");
+	json_writer_string(w, port);
+	json_writer_key(w, "ip");
+	json_writer_string(w, proxy->sock.host->ip);
+	json_writer_key(w, "host");
+	json_writer_string(w, proxy->sock.host->host);
+	
+	for (eTmp = proxy->properties; eTmp != NULL; eTmp = eTmp->next) {
+		json_writer_key(w, eTmp->key);
+		json_writer_string(w, eTmp->val);
+	}
+	json_writer_end_object(w);
+	
+	json_writer_key(w, "casttype");
+	json_writer_string(w, "proxy");
+	json_writer_key(w, "pubid");
+	json_writer_string(w, ape_id_encode(&proxy->pipe->id, pubid));
+	
+	json_writer_end_object(w);
+}
+
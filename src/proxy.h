@@ -24,11 +24,13 @@
 
 #include "http.h"
 
+struct _json_writer;
+
 typedef struct _ape_proxy_pipe ape_proxy_pipe;
 struct _ape_proxy_pipe
 {
 	int allow_write;
-	char pipe[33];
+	ape_id pipe; /* pubid of the linked pipe */
 	
 	struct _ape_proxy_pipe *next;
 };
@@ -84,7 +86,7 @@ enum {
 ape_proxy *proxy_init(char *ident, char *host, int port, acetables *g_ape);
 ape_proxy_cache *proxy_cache_gethostbyname(char *name, acetables *g_ape);
 void proxy_cache_addip(char *name, char *ip, acetables *g_ape);
-void proxy_attach(ape_proxy *proxy, char *pipe, int allow_write, acetables *g_ape);
+void proxy_attach(ape_proxy *proxy, struct _transpipe *pipe, int allow_write, acetables *g_ape);
 int proxy_connect(ape_proxy *proxy, acetables *g_ape);
 void proxy_connect_all(acetables *g_ape);
 void proxy_onevent(ape_proxy *proxy, char *event, acetables *g_ape);
@@ -92,7 +94,8 @@ void proxy_process_eol(connection *co, acetables *g_ape);
 void proxy_init_from_conf(acetables *g_ape);
 ape_proxy *proxy_init_by_host_port(char *host, char *port, acetables *g_ape);
 struct json *get_json_object_proxy(ape_proxy *proxy);
-ape_proxy *proxy_are_linked(char *pubid, char *pubid_proxy, acetables *g_ape);
+void get_json_object_proxy_writer(ape_proxy *proxy, struct _json_writer *w);
+ape_proxy *proxy_are_linked(struct _transpipe *from, char *pubid_proxy, acetables *g_ape);
 void proxy_write(ape_proxy *proxy, char *data, acetables *g_ape);
 void proxy_detach(struct _transpipe *unlinker, struct _transpipe *tproxy, acetables *g_ape);
 void proxy_shutdown(ape_proxy *proxy, acetables *g_ape);
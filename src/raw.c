@@ -26,6 +26,14 @@
 #include "utils.h"
 #include "plugins.h"
 #include "pipe.h"
+#include "sock.h"
+#include "slab.h"
+#include "websocket.h"
+#include "sse.h"
+#include "compress.h"
+
+static slab_cache raw_cache = SLAB_CACHE("RAW", RAW);
+static slab_cache payload_cache = SLAB_CACHE("raw_payload", struct _raw_payload);
 
 RAW *forge_raw(const char *raw, struct json *jlist)
 {
@@ -46,40 +54,104 @@ RAW *forge_raw(const char *raw, struct json *jlist)
 
 	string = jsontr(jstruct, NULL);
 
-	new_raw = xmalloc(sizeof(*new_raw));
+	new_raw = slab_alloc(&raw_cache);
+	
+	/* The serialized string is adopted by the payload (not copied) */
+	new_raw->payload = slab_alloc(&payload_cache);
+	new_raw->payload->data = string->jstring;
+	new_raw->payload->refs = 1;
 	
         new_raw->len = string->len;
-
-        new_raw->data = xmalloc(sizeof(char) * (new_raw->len + 1));
-        memcpy(new_raw->data, string->jstring, new_raw->len + 1);
+        new_raw->data = new_raw->payload->data;
 
 	new_raw->next = NULL;
 	new_raw->priority = 0;
 	
-	free(string->jstring);
 	free(string);
 	
 	return new_raw;
 }
 
+/*
+	Streaming version of forge_raw() :
+	
+	forge_raw_begin(&w, "RAW_NAME");
+	(write the "datas" value, e.g. an object, using json_writer_*)
+	newraw = forge_raw_end(&w);
+*/
+void forge_raw_begin(json_writer *w, const char *raw)
+{
+	char unixtime[16];
+	
+	sprintf(unixtime, "%li", time(NULL));
+	
+	json_writer_init(w);
+	json_writer_begin_object(w);
+	
+	json_writer_key(w, "raw");
+	json_writer_string(w, raw);
+	json_writer_key(w, "time");
+	json_writer_string(w, unixtime);
+	
+	json_writer_key(w, "datas");
+}
 
-RAW *copy_raw(RAW *input)
+RAW *forge_raw_end(json_writer *w)
 {
 	RAW *new_raw;
 	
-	new_raw = xmalloc(sizeof(*new_raw));
+	json_writer_end_object(w);
+	
+	new_raw = slab_alloc(&raw_cache);
+	
+	new_raw->payload = slab_alloc(&payload_cache);
+	new_raw->len = w->len;
+	new_raw->payload->data = json_writer_detach(w); /* The RAW owns the buffer */
+	new_raw->payload->refs = 1;
+	
+	new_raw->data = new_raw->payload->data;
 	
-        new_raw->data = xmalloc(sizeof(char) * (input->len + 1));
-        memcpy(new_raw->data, input->data, input->len + 1);
+	new_raw->next = NULL;
+	new_raw->priority = 0;
+	
+	return new_raw;
+}
 
+/* New RAW node sharing the payload of "input" */
+RAW *copy_raw(RAW *input)
+{
+	RAW *new_raw;
+	
+	new_raw = slab_alloc(&raw_cache);
+	
+	new_raw->payload = input->payload;
+	new_raw->payload->refs++;
+	
+	new_raw->data = input->data;
 	new_raw->len = input->len;
 	
-	new_raw->next = input->next;
+	new_raw->next = NULL;
 	new_raw->priority = input->priority;
 	
 	return new_raw;	
 }
 
+void raw_payload_unref(void *payload)
+{
+	struct _raw_payload *shared = payload;
+	
+	if (--shared->refs == 0) {
+		free(shared->data);
+		slab_free(&payload_cache, shared);
+	}
+}
+
+void free_raw(RAW *raw)
+{
+	raw_payload_unref(raw->payload);
+	slab_free(&raw_cache, raw);
+}
+
 
 /************* Users related functions ****************/
 
@@ -107,10 +179,11 @@ void post_raw_sub(RAW *raw, subuser *sub, acetables *g_ape)
 	}
 	(sub->nraw)++;
 	
+	subuser_ready(sub, g_ape);
 }
 
-/* Post raw to a user and propagate it to all of it's subuser */
-void post_raw(RAW *raw, USERS *user, acetables *g_ape)
+/* Queue a node sharing "raw" to each subuser of "user" ("raw" is kept by the caller) */
+static void post_raw_shared(RAW *raw, USERS *user, acetables *g_ape)
 {
 	subuser *sub = user->subuser;
 	
@@ -118,8 +191,14 @@ void post_raw(RAW *raw, USERS *user, acetables *g_ape)
 		post_raw_sub(copy_raw(raw), sub, g_ape);
 		sub = sub->next;
 	}
-	free(raw->data);
-	free(raw);
+}
+
+/* Post raw to a user and propagate it to all of it's subuser */
+void post_raw(RAW *raw, USERS *user, acetables *g_ape)
+{
+	post_raw_shared(raw, user, g_ape);
+	
+	free_raw(raw);
 }
 
 /* Post raw to a user and propagate it to all of it's subuser with *sub exception */
@@ -136,8 +215,7 @@ void post_raw_restricted(RAW *raw, USERS *user, subuser *sub, acetables *g_ape)
 		}
 		tSub = tSub->next;
 	}
-	free(raw->data);
-	free(raw);	
+	free_raw(raw);
 }
 
 /************* Channels related functions ****************/
@@ -145,39 +223,32 @@ void post_raw_restricted(RAW *raw, USERS *user, subuser *sub, acetables *g_ape)
 /* Post raw to a channel and propagate it to all of it's users */
 void post_raw_channel(RAW *raw, struct CHANNEL *chan, acetables *g_ape)
 {
-	userslist *list;
+	unsigned int i;
 	
-	if (chan == NULL || raw == NULL || chan->head == NULL) {
+	if (chan == NULL || raw == NULL || chan->nmembers == 0) {
 		return;
 	}
-	list = chan->head;
-	while (list) {
-		post_raw(copy_raw(raw), list->userinfo, g_ape);
-		list = list->next;
+	for (i = 0; i < chan->nmembers; i++) {
+		post_raw_shared(raw, chan->members[i].user, g_ape);
 	}
-	free(raw->data);
-	free(raw);
+	free_raw(raw);
 }
 
 /* Post raw to a channel and propagate it to all of it's users with a *ruser exception */
 void post_raw_channel_restricted(RAW *raw, struct CHANNEL *chan, USERS *ruser, acetables *g_ape)
 {
-	userslist *list;
+	unsigned int i;
 	
-	if (chan == NULL || raw == NULL || chan->head == NULL) {
+	if (chan == NULL || raw == NULL || chan->nmembers == 0) {
 		return;
 	}
-	list = chan->head;
-	
-	while (list) {
-		if (list->userinfo != ruser) {
-			post_raw(copy_raw(raw), list->userinfo, g_ape);
+	for (i = 0; i < chan->nmembers; i++) {
+		if (chan->members[i].user != ruser) {
+			post_raw_shared(raw, chan->members[i].user, g_ape);
 		}
-		list = list->next;
 	}
 	
-	free(raw->data);
-	free(raw);
+	free_raw(raw);
 }
 
 
@@ -190,16 +261,15 @@ void proxy_post_raw(RAW *raw, ape_proxy *proxy, acetables *g_ape)
 	transpipe *pipe;
 	
 	while (to != NULL) {
-		pipe = get_pipe(to->pipe, g_ape);
+		pipe = idtbl_seek(g_ape->hPubid, &to->pipe);
 		if (pipe != NULL && pipe->type == USER_PIPE) {
-			post_raw(copy_raw(raw), pipe->pipe, g_ape);
+			post_raw_shared(raw, pipe->pipe, g_ape);
 		} else {
 			;//
 		}
 		to = to->next;
 	}
-	free(raw->data);
-	free(raw);
+	free_raw(raw);
 }
 
 
@@ -218,34 +288,47 @@ void post_raw_pipe(RAW *raw, const char *pipe, acetables *g_ape)
 }
 
 
-int post_to_pipe(json *jlist, const char *rawname, const char *pipe, subuser *from, void *restrict, acetables *g_ape)
+/* {"pipe":{user or channel},"sender":{user},(jlist members)} RAW */
+static RAW *forge_pipe_raw(json *jlist, const char *rawname, USERS *pipe_user, transpipe *recver, USERS *sender)
 {
-	USERS *sender = from->user;
-	transpipe *recver = get_pipe_strict(pipe, sender, g_ape);
-	json *jlist_copy = NULL;
-	RAW *newraw;
+	json_writer w;
 	
+	forge_raw_begin(&w, rawname);
+	json_writer_begin_object(&w);
 	
+	json_writer_key(&w, "pipe");
+	if (recver->type == USER_PIPE) {
+		get_json_object_user_writer(pipe_user, &w);
+	} else {
+		get_json_object_channel_writer(recver->pipe, &w);
+	}
 	if (sender != NULL) {
-		if (recver == NULL) {
-			send_error(sender, "UNKNOWN_PIPE", "109", g_ape);
-			return 0;
-		}
-	
-		set_json("sender", NULL, &jlist);
-		json_attach(jlist, get_json_object_user(sender), JSON_OBJECT);
+		json_writer_key(&w, "sender");
+		get_json_object_user_writer(sender, &w);
 	}
-
-	set_json("pipe", NULL, &jlist);
-
+	if (jlist != NULL) {
+		json_writer_members(&w, jlist);
+	}
+	json_writer_end_object(&w);
 	
-	jlist_copy = json_copy(jlist);
+	return forge_raw_end(&w);
+}
 
+int post_to_pipe(json *jlist, const char *rawname, const char *pipe, subuser *from, void *restrict, acetables *g_ape)
+{
+	USERS *sender = from->user;
+	transpipe *recver = get_pipe_strict(pipe, sender, g_ape);
+	RAW *newraw;
+	
 	
-	json_attach(jlist, (recver->type == USER_PIPE ? get_json_object_user(sender) : get_json_object_channel(recver->pipe)), JSON_OBJECT);
-	json_attach(jlist_copy, (recver->type == USER_PIPE ? get_json_object_user(recver->pipe) : get_json_object_channel(recver->pipe)), JSON_OBJECT);
+	if (sender != NULL && recver == NULL) {
+		send_error(sender, "UNKNOWN_PIPE", "109", g_ape);
+		json_free(jlist);
+		return 0;
+	}
 	
-	newraw = forge_raw(rawname, jlist);
+	/* Recipients see the sender as the pipe of an unicast message */
+	newraw = forge_pipe_raw(jlist, rawname, (recver->type == USER_PIPE ? sender : NULL), recver, sender);
 	
 	if (recver->type == USER_PIPE) {
 		post_raw(newraw, recver->pipe, g_ape);
@@ -253,48 +336,106 @@ int post_to_pipe(json *jlist, const char *rawname, const char *pipe, subuser *fr
 		post_raw_channel_restricted(newraw, recver->pipe, sender, g_ape);
 	}
 
-	newraw = forge_raw(rawname, jlist_copy);
+	/* Copy for the other subusers of the sender */
+	newraw = forge_pipe_raw(jlist, rawname, (recver->type == USER_PIPE ? recver->pipe : NULL), recver, sender);
 	
 	post_raw_restricted(newraw, sender, from, g_ape);
 	
+	json_free(jlist);
+	
 	return 1;
 }
 
 
 /*
 	Send queue to socket
+	Header, framing and every RAW are given to the kernel in one writev() (see sendbinv())
 */
 int send_raws(subuser *user, acetables *g_ape)
 {
 	RAW *raw, *older;
-	int finish = 1;
+	struct iovec *iov;
+	struct _socks_ref *refs;
+	int finish, n = 1, nraw = 0, len = 3, streamed, sse, first;
+	char header[HTTP_HEADER_MAX];
+	/* "[\n" raw (",\n" raw)* "\n]\n" or, as an event, "id: <n>\ndata: [" raw ("," raw)* "]\n\n" */
+	const char *sep = ",\n", *end = "\n]\n";
 	
 	if (user->nraw == 0 || user->rawhead == NULL) {
 		return 1;
 	}
+	for (raw = user->rawhead; raw != NULL; raw = raw->next) {
+		nraw++;
+		len += raw->len + 2;
+	}
 	raw = user->rawhead;
 	
-	if (!(user->user->flags & FLG_PCONNECT) || !user->headers_sent) {
-		user->headers_sent = 1;
-		sendbin(user->fd, HEADER, HEADER_LEN, g_ape);
-	}
-	if (raw != NULL) {
-		finish &= sendbin(user->fd, "[\n", 2, g_ape);
+	/* header + "[" + (raw + separator) * nraw */
+	iov = xmalloc(sizeof(*iov) * (nraw * 2 + 2));
+	refs = xmalloc(sizeof(*refs) * (nraw * 2 + 2));
+	
+	streamed = (user->user->flags & FLG_PCONNECT) && !websocket_is_open(user->fd, g_ape);
+	sse = (user->user->transport == TRANSPORT_SSE && user->sse != NULL);
+	
+	/* iov[0] : header or event prefix (if any), set once the body is known */
+	refs[0].release = NULL;
+	iov[0].iov_base = header;
+	iov[0].iov_len = 0;
+	
+	if (sse) {
+		/* The event stream header is sent by sse_start() */
+		iov[0].iov_len = sse_event_begin(user, header);
+		
+		sep = ",";
+		end = "]\n\n";
+	} else {
+		refs[n].release = NULL;
+		iov[n].iov_base = "[\n";
+		iov[n++].iov_len = 2;
 	}
-	while(raw != NULL) {
-
-		finish &= sendbin(user->fd, raw->data, raw->len, g_ape);
+	
+	for (; raw != NULL; raw = raw->next) {
+		/* The node reference to the payload is given to the output queue */
+		refs[n].release = raw_payload_unref;
+		refs[n].ref = raw->payload;
+		iov[n].iov_base = raw->data;
+		iov[n++].iov_len = raw->len;
 		
-		if (raw->next != NULL) {
-			finish &= sendbin(user->fd, ",\n", 2, g_ape);
-		} else {
-			finish &= sendbin(user->fd, "\n]\n\n", 3, g_ape);	
+		refs[n].release = NULL;
+		iov[n].iov_base = (char *)(raw->next != NULL ? sep : end);
+		iov[n].iov_len = strlen(iov[n].iov_base);
+		n++;
+	}
+	
+	if (sse) {
+		/* Nodes kept for Last-Event-ID (their reference is taken before the write can release the others) */
+		sse_event_end(user, user->rawhead);
+	}
+	
+	/* Framed bodies may be compressed (sent with their own header) */
+	if (!sse && !streamed && (finish = compress_response(user->fd, &iov[1], &refs[1], n - 1, len, g_ape)) != -1) {
+		user->headers_sent = 1;
+	} else {
+		/* Persistent connections get a single header, except WebSocket ones (a frame header per batch) */
+		if (!sse && (!streamed || !user->headers_sent)) {
+			user->headers_sent = 1;
+			iov[0].iov_len = http_header(user->fd, header, (streamed ? -1 : len), g_ape);
 		}
+		first = (iov[0].iov_len ? 0 : 1);
+		
+		finish = sendbinv(user->fd, &iov[first], &refs[first], n - first, g_ape);
+	}
+	
+	free(iov);
+	free(refs);
+	
+	raw = user->rawhead;
+	
+	while(!sse && raw != NULL) {
 		older = raw;
 		raw = raw->next;
 		
-		free(older->data);
-		free(older);
+		slab_free(&raw_cache, older);
 	}
 	
 	user->rawhead = NULL;
@@ -303,4 +444,3 @@ int send_raws(subuser *user, acetables *g_ape)
 	
 	return finish;
 }
-
@@ -26,16 +26,29 @@
 #include "proxy.h"
 
 
-typedef struct RAW
+/* Immutable RAW string shared by all the RAW nodes (queued to subusers) pointing to it */
+struct _raw_payload
 {
 	char *data;
+	unsigned int refs;
+};
+
+typedef struct RAW
+{
+	char *data; /* payload->data (read only) */
 	int len;
 	struct RAW *next;
 	int priority;
+	
+	struct _raw_payload *payload;
 } RAW;
 
 RAW *forge_raw(const char *raw, struct json *jlist);
+void forge_raw_begin(json_writer *w, const char *raw);
+RAW *forge_raw_end(json_writer *w);
 RAW *copy_raw(RAW *input);
+void free_raw(RAW *raw);
+void raw_payload_unref(void *payload);
 
 void post_raw(RAW *raw, USERS *user, acetables *g_ape);
 void post_raw_sub(RAW *raw, subuser *sub, acetables *g_ape);
@@ -0,0 +1,97 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* sha1.c */
+/* FIPS 180-1, only used for the WebSocket handshake (see websocket.c) */
+
+#include <stdint.h>
+#include <string.h>
+#include "sha1.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(uint32_t *h, const unsigned char *block)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+	
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16) | ((uint32_t)block[i*4+2] << 8) | block[i*4+3];
+	}
+	for (; i < 80; i++) {
+		w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+	}
+	
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+	
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+void sha1(const unsigned char *data, size_t len, unsigned char *digest)
+{
+	uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+	unsigned char last[128];
+	uint64_t bits = (uint64_t)len * 8;
+	size_t i, rest;
+	
+	for (i = 0; i + 64 <= len; i += 64) {
+		sha1_block(h, &data[i]);
+	}
+	
+	/* Padding : 0x80, zeros, then the length in bits (big endian) */
+	rest = len - i;
+	memset(last, 0, sizeof(last));
+	memcpy(last, &data[i], rest);
+	last[rest] = 0x80;
+	
+	rest = (rest < 56 ? 64 : 128);
+	for (i = 0; i < 8; i++) {
+		last[rest - 1 - i] = (bits >> (i * 8)) & 0xff;
+	}
+	sha1_block(h, last);
+	if (rest == 128) {
+		sha1_block(h, &last[64]);
+	}
+	
+	for (i = 0; i < 20; i++) {
+		digest[i] = (h[i / 4] >> (24 - (i % 4) * 8)) & 0xff;
+	}
+}
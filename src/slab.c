@@ -0,0 +1,178 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* slab.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "slab.h"
+#include "utils.h"
+
+struct _slab
+{
+	slab_cache *cache;
+	
+	/* cache->partial list */
+	struct _slab *next;
+	struct _slab **pprev;
+	
+	void *free; /* free objects of the block, linked through their first word */
+	unsigned int inuse;
+};
+
+/* Objects start after the block header, aligned for any type */
+#define SLAB_HDR ((sizeof(struct _slab) + 15) & ~(size_t)15)
+
+static slab_cache *caches = NULL;
+
+static size_t slab_objsize(slab_cache *cache)
+{
+	size_t size = (cache->size < sizeof(void *) ? sizeof(void *) : cache->size);
+	
+	return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+static unsigned int slab_capacity(slab_cache *cache)
+{
+	return (SLAB_SIZE - SLAB_HDR) / slab_objsize(cache);
+}
+
+static void slab_link(slab_cache *cache, struct _slab *slab)
+{
+	if ((slab->next = cache->partial) != NULL) {
+		slab->next->pprev = &slab->next;
+	}
+	slab->pprev = &cache->partial;
+	cache->partial = slab;
+}
+
+static void slab_unlink(struct _slab *slab)
+{
+	if ((*slab->pprev = slab->next) != NULL) {
+		slab->next->pprev = slab->pprev;
+	}
+	slab->next = NULL;
+	slab->pprev = NULL;
+}
+
+static struct _slab *slab_grow(slab_cache *cache)
+{
+	struct _slab *slab;
+	size_t objsize = slab_objsize(cache);
+	unsigned int i, n = slab_capacity(cache);
+	char *obj;
+	void *block;
+	
+	if (posix_memalign(&block, SLAB_SIZE, SLAB_SIZE) != 0) {
+		printf("[ERR] Not enougth memory\n");
+		exit(0);
+	}
+	slab = block;
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->free = NULL;
+	
+	/* Carved backward so that objects are handed out in address order */
+	for (i = n, obj = (char *)block + SLAB_HDR + (n - 1) * objsize; i > 0; i--, obj -= objsize) {
+		*(void **)obj = slab->free;
+		slab->free = obj;
+	}
+	
+	if (!cache->registered) {
+		cache->next = caches;
+		caches = cache;
+		cache->registered = 1;
+	}
+	cache->nslabs++;
+	
+	return slab;
+}
+
+void *slab_alloc(slab_cache *cache)
+{
+	struct _slab *slab;
+	void *obj;
+	
+	if ((slab = cache->partial) == NULL) {
+		if ((slab = cache->empty) != NULL) {
+			cache->empty = NULL;
+		} else {
+			slab = slab_grow(cache);
+		}
+		slab_link(cache, slab);
+	}
+	obj = slab->free;
+	slab->free = *(void **)obj;
+	slab->inuse++;
+	
+	if (slab->free == NULL) {
+		slab_unlink(slab);
+	}
+	cache->inuse++;
+	cache->nalloc++;
+	
+	return obj;
+}
+
+void slab_free(slab_cache *cache, void *obj)
+{
+	struct _slab *slab;
+	
+	if (obj == NULL) {
+		return;
+	}
+	slab = (struct _slab *)((uintptr_t)obj & ~(uintptr_t)(SLAB_SIZE - 1));
+	
+	if (slab->free == NULL) {
+		slab_link(cache, slab);
+	}
+	*(void **)obj = slab->free;
+	slab->free = obj;
+	
+	cache->inuse--;
+	
+	if (--slab->inuse == 0) {
+		slab_unlink(slab);
+		
+		if (cache->empty == NULL) {
+			cache->empty = slab;
+		} else {
+			free(slab);
+			cache->nslabs--;
+		}
+	}
+}
+
+/* One line per cache : objects in use, blocks and their occupancy */
+void slab_stats(FILE *out)
+{
+	slab_cache *cache;
+	
+	fprintf(out, "[slab] %-12s %6s %10s %8s %10s %14s\n", "cache", "size", "objects", "slabs", "occupancy", "allocs");
+	
+	for (cache = caches; cache != NULL; cache = cache->next) {
+		unsigned long capacity = cache->nslabs * slab_capacity(cache);
+		
+		fprintf(out, "[slab] %-12s %6lu %10lu %8lu %9lu%% %14lu\n", cache->name, (unsigned long)slab_objsize(cache), 
+			cache->inuse, cache->nslabs, (capacity ? cache->inuse * 100 / capacity : 0), cache->nalloc);
+	}
+	fflush(out);
+}
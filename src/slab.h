@@ -0,0 +1,65 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+	Typed object caches : objects of a type are carved from SLAB_SIZE blocks
+	aligned on SLAB_SIZE, so the block of any object is found by masking its
+	address. Partially used blocks are kept on a list, at most one empty block
+	is kept per cache and the others are given back to the system.
+	
+	static slab_cache users_cache = SLAB_CACHE("USERS", USERS);
+	
+	user = slab_alloc(&users_cache);
+	slab_free(&users_cache, user);
+*/
+#define SLAB_SIZE 16384
+
+typedef struct _slab_cache
+{
+	const char *name;
+	size_t size;
+	
+	/* Blocks with free objects */
+	struct _slab *partial;
+	/* Spare empty block (not in "partial") */
+	struct _slab *empty;
+	
+	/* Statistics */
+	unsigned long inuse;
+	unsigned long nslabs;
+	unsigned long nalloc;
+	
+	/* Caches list (see slab_stats()), set when the first block is allocated */
+	struct _slab_cache *next;
+	int registered;
+} slab_cache;
+
+#define SLAB_CACHE(name, type) {name, sizeof(type), NULL, NULL, 0, 0, 0, NULL, 0}
+
+void *slab_alloc(slab_cache *cache);
+void slab_free(slab_cache *cache, void *obj);
+void slab_stats(FILE *out);
+
+#endif
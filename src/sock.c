@@ -27,6 +27,8 @@
 #include "users.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <time.h>
@@ -38,10 +40,20 @@
 #include "pipe.h"
 #include "config.h"
 #include "raw.h"
+#include "websocket.h"
+#include "compress.h"
 
-static int sendqueue(int sock, acetables *g_ape);
+static int sendqueue(int sock, struct _socks_output *out);
+static void output_init(struct _socks_output *out, int size, int deferred);
+static void bufout_init(struct _socks_bufout *bufout, int fd);
+static void bufout_free(int sock, struct _socks_output *out);
+static void bufout_splice(struct _socks_output *out, struct _socks_bufout *bufout, struct _socks_bufout *from);
+static void bufout_release(struct _socks_output *out, struct _socks_bufout_seg *seg);
+static void bufout_copy(struct _socks_output *out, struct _socks_bufout *bufout, char *data, int len);
+static void bufout_ref(struct _socks_output *out, struct _socks_bufout *bufout, char *data, int len, struct _socks_ref *ref);
+static void http_dispatch(connection *co, int fd, acetables *g_ape);
 
-int newSockListen(unsigned int port, char *listen_ip)
+int newSockListen(unsigned int port, char *listen_ip, int reuseport)
 {
 	int sock;
 	struct sockaddr_in addr;
@@ -63,6 +75,12 @@ int newSockListen(unsigned int port, char *listen_ip)
 	memset(&(addr.sin_zero), '\0', 8);
 	
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+	
+	/* Several event loops are bound on the same port (see sockworkers_init()) */
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse_addr, sizeof(reuse_addr)) == -1) {
+		printf("ERREUR: SO_REUSEPORT not supported.. (%s line: %i)\n",__FILE__, __LINE__);
+		return -2;
+	}
 
 	if (bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr)) == -1)
 	{
@@ -88,7 +106,7 @@ static void growup(int *basemem, connection **conn_list, struct epoll_event **ep
 	
 	*conn_list = xrealloc(*conn_list, 
 			sizeof(connection) * (*basemem));
-						
+	
 	*bufout = xrealloc(*bufout, 
 			sizeof(struct _socks_bufout) * (*basemem));
 }
@@ -112,47 +130,767 @@ static void clear_buffer(connection *co, int *tfd)
 	co->buffer.length = 0;
 	co->ip_client[0] = '\0';
 	
-	co->http.step = 0;
-	co->http.type = HTTP_NULL;
-	co->http.contentlength = -1;
-	co->http.pos = 0;
-	co->http.error = 0;
-	co->http.ready = 0;
-	co->http.read = 0;
+	init_http_state(&co->http);
 	co->attach = NULL;
+	websocket_free(co);
+	compress_free(co);
+	
+	/* Nothing is sent to it anymore (the fd may be reused by another loop) */
+	co->worker = -1;
+	co->flags = 0;
 	
 	(*tfd)--;
 }
 
-#if 0
-static void check_idle(struct _socks_list *sl)
+/* "fd" is closed : the subuser waiting on it (if any) is detached */
+static void sock_detach(connection *co, int fd)
+{
+	subuser *sub = co->attach;
+	
+	if (sub == NULL) {
+		return;
+	}
+	if (fd == sub->fd) {
+		sub->headers_sent = 0;
+		sub->state = ADIED;
+	}
+	if (sub->wait_for_free == 1) {
+		free_subuser(sub);
+		co->attach = NULL;
+	}
+}
+
+/*
+	Connections waiting for a request (just accepted, or keep-alive between two requests)
+	are linked by fd and ordered by idle time, so only the head of the list is checked.
+*/
+static void idle_link(connection *co, struct _socks_idle *list, int fd)
+{
+	co[fd].idle = time(NULL);
+	co[fd].idle_next = -1;
+	
+	if ((co[fd].idle_prev = list->foot) != -1) {
+		co[list->foot].idle_next = fd;
+	} else {
+		list->head = fd;
+	}
+	list->foot = fd;
+}
+
+static void idle_unlink(connection *co, struct _socks_idle *list, int fd)
+{
+	if (co[fd].idle_prev == -1 && list->head != fd) {
+		return; /* not linked */
+	}
+	if (co[fd].idle_prev != -1) {
+		co[co[fd].idle_prev].idle_next = co[fd].idle_next;
+	} else {
+		list->head = co[fd].idle_next;
+	}
+	if (co[fd].idle_next != -1) {
+		co[co[fd].idle_next].idle_prev = co[fd].idle_prev;
+	} else {
+		list->foot = co[fd].idle_prev;
+	}
+	co[fd].idle_prev = -1;
+	co[fd].idle_next = -1;
+}
+
+/* Shutdown the connections waiting for a request for more than TCP_TIMEOUT seconds */
+static void idle_expire(connection *co, struct _socks_idle *list)
+{
+	long int limit = time(NULL) - TCP_TIMEOUT;
+	int fd;
+	
+	while ((fd = list->head) != -1 && co[fd].idle <= limit) {
+		idle_unlink(co, list, fd);
+		shutdown(fd, 2);
+	}
+}
+
+/* Bind the listen socket of each additional event loop (must be called before dropping privileges) */
+struct _socks_worker *sockworkers_init(int nworkers, unsigned int port, char *listen_ip)
+{
+	int i;
+	struct _socks_worker *workers = xmalloc(sizeof(*workers) * nworkers);
+	
+	for (i = 0; i < nworkers; i++) {
+		workers[i].id = i + 1;
+		workers[i].epoll_fd = -1;
+		workers[i].basemem = 512;
+		workers[i].tfd = 0;
+		workers[i].co = NULL;
+		workers[i].handoff = NULL;
+		workers[i].inbox = NULL;
+		workers[i].idle.head = -1;
+		workers[i].idle.foot = -1;
+		workers[i].pending.head = NULL;
+		workers[i].pending.foot = NULL;
+		workers[i].outbox.head = NULL;
+		workers[i].outbox.foot = NULL;
+		
+		if ((workers[i].s_listen = newSockListen(port, listen_ip, 1)) < 0) {
+			free(workers);
+			return NULL;
+		}
+	}
+	
+	return workers;
+}
+
+static struct _socks_handoff *handoff_init()
+{
+	struct _socks_handoff *handoff = xmalloc(sizeof(*handoff));
+	
+	pthread_mutex_init(&handoff->lock, NULL);
+	handoff->msgs.head = NULL;
+	handoff->msgs.foot = NULL;
+	
+	if ((handoff->efd = eventfd(0, EFD_NONBLOCK)) == -1) {
+		printf("[ERR] Cannot create workers eventfd\n");
+		exit(0);
+	}
+	return handoff;
+}
+
+static struct _socks_msg *socks_msg_new(int type, int fd)
+{
+	struct _socks_msg *msg = xmalloc(sizeof(*msg));
+	
+	msg->type = type;
+	msg->fd = fd;
+	msg->co = NULL;
+	msg->data = NULL;
+	msg->len = 0;
+	msg->next = NULL;
+	
+	bufout_init(&msg->out, fd);
+	
+	return msg;
+}
+
+static void socks_msgs_push(struct _socks_msgs *msgs, struct _socks_msg *msg)
+{
+	if (msgs->foot != NULL) {
+		msgs->foot->next = msg;
+	} else {
+		msgs->head = msg;
+	}
+	msgs->foot = msg;
+}
+
+/* Give the messages queued by a loop during its iteration to another loop (a single wake up) */
+static void handoff_send(struct _socks_handoff *handoff, struct _socks_msgs *msgs)
+{
+	uint64_t wakeup = 1;
+	
+	if (msgs->head == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&handoff->lock);
+	if (handoff->msgs.foot != NULL) {
+		handoff->msgs.foot->next = msgs->head;
+	} else {
+		handoff->msgs.head = msgs->head;
+	}
+	handoff->msgs.foot = msgs->foot;
+	pthread_mutex_unlock(&handoff->lock);
+	
+	msgs->head = NULL;
+	msgs->foot = NULL;
+	
+	write(handoff->efd, &wakeup, sizeof(wakeup));
+}
+
+/* Messages given to us (eventfd is readable), in the order they were sent */
+static struct _socks_msg *handoff_recv(struct _socks_handoff *handoff)
+{
+	struct _socks_msg *msg;
+	uint64_t wakeup;
+	
+	read(handoff->efd, &wakeup, sizeof(wakeup));
+	
+	pthread_mutex_lock(&handoff->lock);
+	msg = handoff->msgs.head;
+	handoff->msgs.head = NULL;
+	handoff->msgs.foot = NULL;
+	pthread_mutex_unlock(&handoff->lock);
+	
+	return msg;
+}
+
+static void sockworker_send(struct _socks_worker *worker, int type, int fd)
+{
+	socks_msgs_push(&worker->pending, socks_msg_new(type, fd));
+}
+
+/* Hand the request parsed on "fd" to the main loop, what follows (pipelined) waits for SOCKS_MSG_RESUME */
+static void sockworker_request(struct _socks_worker *worker, int fd)
+{
+	connection *co = &worker->co[fd];
+	struct _socks_msg *msg = socks_msg_new(SOCKS_MSG_REQUEST, fd);
+	int end = co->http.end;
+	
+	msg->co = xmalloc(sizeof(*msg->co));
+	*msg->co = *co;
+	
+	msg->co->buffer.data = xmalloc(sizeof(char) * (end + 1));
+	msg->co->buffer.size = end;
+	msg->co->buffer.length = end;
+	memcpy(msg->co->buffer.data, co->buffer.data, end);
+	msg->co->buffer.data[end] = '\0';
+	
+	socks_msgs_push(&worker->pending, msg);
+	
+	idle_unlink(worker->co, &worker->idle, fd);
+	
+	co->flags |= CO_SHARED;
+	co->http.ready = -1;
+	
+	co->buffer.length -= end;
+	memmove(co->buffer.data, co->buffer.data + end, co->buffer.length);
+	
+	reset_http_state(&co->http);
+}
+
+/* Parse what has been read on "fd" (or give it as is to the main loop once upgraded) */
+static void sockworker_process(struct _socks_worker *worker, int fd)
+{
+	connection *co = &worker->co[fd];
+	
+	if (co->flags & CO_RELAY) {
+		struct _socks_msg *msg;
+		
+		if (co->buffer.length == 0) {
+			return;
+		}
+		msg = socks_msg_new(SOCKS_MSG_INPUT, fd);
+		msg->len = co->buffer.length;
+		msg->data = xmalloc(sizeof(char) * msg->len);
+		memcpy(msg->data, co->buffer.data, msg->len);
+		
+		socks_msgs_push(&worker->pending, msg);
+		co->buffer.length = 0;
+		
+		return;
+	}
+	if (co->http.ready == -1) {
+		/* Still answered by the main loop : what follows is kept for later */
+		if (co->buffer.length > HTTP_PIPELINE_MAX) {
+			shutdown(fd, 2);
+		}
+		return;
+	}
+	process_http(co);
+	
+	if (co->http.ready == 1) {
+		sockworker_request(worker, fd);
+	} else if (co->http.error == 1) {
+		shutdown(fd, 2);
+	}
+}
+
+static void sockworker_release(struct _socks_worker *worker, int fd)
+{
+	clear_buffer(&worker->co[fd], &worker->tfd);
+	close(fd);
+}
+
+/* The peer is gone (or the connection has been shut down) */
+static void sockworker_close(struct _socks_worker *worker, int fd)
+{
+	connection *co = &worker->co[fd];
+	
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	idle_unlink(worker->co, &worker->idle, fd);
+	bufout_free(fd, &worker->output);
+	
+	if (co->flags & CO_SHARED) {
+		/* The main loop may still write to it : the fd can't be reused before it forgets it */
+		co->flags |= CO_CLOSING;
+		sockworker_send(worker, SOCKS_MSG_CLOSED, fd);
+	} else {
+		sockworker_release(worker, fd);
+	}
+}
+
+/* What the main loop has sent to "fd" */
+static void sockworker_write(struct _socks_worker *worker, int fd, struct _socks_bufout *from)
 {
-	int i = 0, x = 0;
-	long int current_time = time(NULL);
+	struct _socks_bufout *bufout = &worker->output.bufout[fd];
+	int waiting = (bufout->head != NULL);
+	
+	bufout_splice(&worker->output, bufout, from);
 	
-	for (i = 0; x < *sl->tfd; i++) {
-		if (sl->co[i].buffer.size) {
-			x++;
-			if (sl->co[i].attach == NULL && sl->co[i].idle <= current_time-TCP_TIMEOUT) {
-				shutdown(i, 2);
+	if (!waiting && !sendqueue(fd, &worker->output)) {
+		sockworker_send(worker, SOCKS_MSG_BLOCKED, fd);
+	}
+}
+
+static void sockworker_inbox(struct _socks_worker *worker)
+{
+	struct _socks_msg *msg, *next;
+	struct _socks_bufout_seg *seg, *snext;
+	
+	for (msg = handoff_recv(worker->inbox); msg != NULL; msg = next) {
+		int fd = msg->fd;
+		connection *co = &worker->co[fd];
+		
+		next = msg->next;
+		
+		if (co->flags & CO_CLOSING) {
+			/* Only its release matters now */
+			for (seg = msg->out.head; seg != NULL; seg = snext) {
+				snext = seg->next;
+				bufout_release(&worker->output, seg);
+			}
+			if (msg->type == SOCKS_MSG_RELEASE) {
+				sockworker_release(worker, fd);
+			}
+			free(msg);
+			continue;
+		}
+		switch(msg->type) {
+			case SOCKS_MSG_OUTPUT:
+				sockworker_write(worker, fd, &msg->out);
+				break;
+			case SOCKS_MSG_RESUME:
+				co->http.ready = 0;
+				idle_link(worker->co, &worker->idle, fd);
+				
+				/* The next request may be already read */
+				sockworker_process(worker, fd);
+				break;
+			case SOCKS_MSG_UPGRADE:
+				co->flags |= CO_RELAY;
+				sockworker_process(worker, fd);
+				break;
+			case SOCKS_MSG_SHUTDOWN:
+				/* What has been sent before is written first */
+				if (worker->output.bufout[fd].head != NULL) {
+					co->flags |= CO_SHUTDOWN;
+				} else {
+					shutdown(fd, 2);
+				}
+				break;
+		}
+		free(msg);
+	}
+}
+
+static void *sockworker_routine(void *arg)
+{
+	struct _socks_worker *worker = arg;
+	struct epoll_event ev, *events;
+	struct sockaddr_in their_addr;
+	int new_fd, nfds, i, sin_size = sizeof(struct sockaddr_in);
+	long int checked = time(NULL);
+	
+	worker->co = xmalloc(sizeof(connection) * worker->basemem);
+	memset(worker->co, 0, sizeof(connection) * worker->basemem);
+	
+	output_init(&worker->output, worker->basemem, 1);
+	
+	events = xmalloc(sizeof(*events) * worker->basemem);
+	
+	setnonblocking(worker->s_listen);
+	
+	ev.events = EPOLLIN | EPOLLET | EPOLLPRI;
+	ev.data.fd = worker->s_listen;
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->s_listen, &ev);
+	
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = worker->inbox->efd;
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->inbox->efd, &ev);
+	
+	while (1) {
+		/* Wake up at least each second to close idle connections */
+		nfds = epoll_wait(worker->epoll_fd, events, worker->basemem, 1000);
+		
+		for (i = 0; i < nfds; i++) {
+			connection *co;
+			int fd = events[i].data.fd, readb;
+			
+			if (fd == worker->s_listen) {
+				while (1) {
+					struct epoll_event cev;
+					
+					new_fd = accept(worker->s_listen, 
+						(struct sockaddr *)&their_addr, 
+						(unsigned int *)&sin_size);
+					
+					if (new_fd == -1) {
+						break;
+					}
+					/* fds are shared by all the loops, they can be far above our basemem */
+					while (new_fd + 4 >= worker->basemem) {
+						growup(&worker->basemem, &worker->co, &events, &worker->output.bufout);
+					}
+					co = &worker->co[new_fd];
+					
+					strncpy(co->ip_client, inet_ntoa(their_addr.sin_addr), 16);
+					
+					co->buffer.data = xmalloc(sizeof(char) * (DEFAULT_BUFFER_SIZE + 1));
+					co->buffer.size = DEFAULT_BUFFER_SIZE;
+					co->buffer.length = 0;
+					
+					init_http_state(&co->http);
+					co->attach = NULL;
+					co->websocket = NULL;
+					co->deflate = NULL;
+					co->stream_type = STREAM_IN;
+					co->worker = worker->id;
+					co->flags = 0;
+					
+					idle_link(worker->co, &worker->idle, new_fd);
+					bufout_init(&worker->output.bufout[new_fd], new_fd);
+					
+					setnonblocking(new_fd);
+					
+					cev.events = EPOLLIN | EPOLLET | EPOLLPRI | EPOLLOUT;
+					cev.data.fd = new_fd;
+					
+					epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, new_fd, &cev);
+					worker->tfd++;
+				}
+				continue;
+			} else if (fd == worker->inbox->efd) {
+				sockworker_inbox(worker);
+				continue;
+			}
+			
+			co = &worker->co[fd];
+			
+			/* Closed meanwhile */
+			if (co->buffer.size == 0 || (co->flags & CO_CLOSING)) {
+				continue;
+			}
+			
+			if ((events[i].events & EPOLLOUT) && worker->output.bufout[fd].head != NULL) {
+				if (sendqueue(fd, &worker->output)) {
+					sockworker_send(worker, SOCKS_MSG_DRAINED, fd);
+					
+					if (co->flags & CO_SHUTDOWN) {
+						shutdown(fd, 2);
+					}
+				}
+			}
+			if (!(events[i].events & (EPOLLIN | EPOLLPRI | EPOLLHUP | EPOLLERR))) {
+				continue;
+			}
+			while (1) {
+				readb = read(fd, co->buffer.data + co->buffer.length, co->buffer.size - co->buffer.length);
+				
+				if (readb == -1 && errno == EAGAIN) {
+					co->buffer.data[co->buffer.length] = '\0';
+					break;
+				} else if (readb < 1) {
+					sockworker_close(worker, fd);
+					break;
+				}
+				co->buffer.length += readb;
+				
+				if (co->buffer.length == co->buffer.size) {
+					co->buffer.size *= 2;
+					co->buffer.data = xrealloc(co->buffer.data, sizeof(char) * (co->buffer.size + 1));
+				}
+				sockworker_process(worker, fd);
 			}
 		}
 		
+		if (checked != time(NULL)) {
+			checked = time(NULL);
+			idle_expire(worker->co, &worker->idle);
+		}
+		
+		/* Segments written during this iteration go back to the main loop (it releases the payloads) */
+		if (worker->output.written != NULL) {
+			struct _socks_msg *msg = socks_msg_new(SOCKS_MSG_WRITTEN, 0);
+			
+			msg->out.head = worker->output.written;
+			worker->output.written = NULL;
+			
+			socks_msgs_push(&worker->pending, msg);
+		}
+		handoff_send(worker->handoff, &worker->pending);
 	}
+	
+	return NULL;
+}
+
+static void sockworkers_start(acetables *g_ape, int epoll_fd)
+{
+	int i;
+	struct epoll_event ev;
+	struct _socks_handoff *handoff = handoff_init();
+	
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = handoff->efd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handoff->efd, &ev);
+	
+	g_ape->workers.handoff = handoff;
+	
+	for (i = 0; i < g_ape->workers.n; i++) {
+		struct _socks_worker *worker = &g_ape->workers.list[i];
+		
+		worker->handoff = handoff;
+		worker->inbox = handoff_init();
+		
+		if ((worker->epoll_fd = epoll_create(1)) < 0 || 
+			pthread_create(&worker->thread, NULL, sockworker_routine, worker) != 0) {
+			printf("[ERR] Cannot start worker %i\n", worker->id);
+			exit(0);
+		}
+	}
+	printf("Started %i additional event loop(s)\n", g_ape->workers.n);
+}
+
+/* Main loop : "type" is sent to the worker owning "fd" after what has been written to it */
+static void sockworker_notify(struct _socks_worker *worker, int type, int fd)
+{
+	socks_msgs_push(&worker->outbox, socks_msg_new(type, fd));
+}
+
+/* Main loop : output queue of a message to the worker owning "fd" (consecutive writes share it) */
+static struct _socks_bufout *sockworker_outbox(int fd, acetables *g_ape)
+{
+	struct _socks_worker *worker = &g_ape->workers.list[g_ape->co[fd].worker - 1];
+	struct _socks_msg *msg = worker->outbox.foot;
+	
+	if (msg == NULL || msg->type != SOCKS_MSG_OUTPUT || msg->fd != fd) {
+		msg = socks_msg_new(SOCKS_MSG_OUTPUT, fd);
+		socks_msgs_push(&worker->outbox, msg);
+	}
+	return &msg->out;
+}
+
+/* Main loop : a request read by a worker, "co" is its copy of the connection */
+static void sockworker_request_recv(connection *co, int fd, struct _socks_msg *msg, int *tfd, acetables *g_ape)
+{
+	if (!(msg->co->flags & CO_SHARED)) {
+		/* First request : the connection is known until the worker closes it */
+		*co = *msg->co;
+		co->attach = NULL;
+		co->websocket = NULL;
+		co->deflate = NULL;
+		co->idle_prev = -1;
+		co->idle_next = -1;
+		co->flags = 0;
+		
+		bufout_init(&g_ape->output->bufout[fd], fd);
+		(*tfd)++;
+	} else {
+		free(co->buffer.data);
+		co->buffer = msg->co->buffer;
+		co->http = msg->co->http;
+	}
+	free(msg->co);
+	
+	http_dispatch(co, fd, g_ape);
+	
+	/* Upgraded : the worker gives us the frames as they are read */
+	if (co->websocket != NULL) {
+		sockworker_notify(&g_ape->workers.list[co->worker - 1], SOCKS_MSG_UPGRADE, fd);
+	}
+}
+
+/* Main loop : frames read on a WebSocket owned by a worker */
+static void sockworker_input_recv(connection *co, int fd, struct _socks_msg *msg, acetables *g_ape)
+{
+	if (co->websocket == NULL) {
+		return;
+	}
+	if (co->buffer.length + msg->len > co->buffer.size) {
+		co->buffer.size = co->buffer.length + msg->len;
+		co->buffer.data = xrealloc(co->buffer.data, sizeof(char) * (co->buffer.size + 1));
+	}
+	memcpy(co->buffer.data + co->buffer.length, msg->data, msg->len);
+	co->buffer.length += msg->len;
+	
+	websocket_process(co, fd, g_ape);
+}
+
+/* Main loop : messages of the workers */
+static void sockworkers_recv(int *basemem, connection **co, struct epoll_event **events, int *tfd, acetables *g_ape)
+{
+	struct _socks_msg *msg, *next;
+	struct _socks_bufout_seg *seg, *snext;
+	int worker;
+	
+	for (msg = handoff_recv(g_ape->workers.handoff); msg != NULL; msg = next) {
+		int fd = msg->fd;
+		
+		next = msg->next;
+		
+		switch(msg->type) {
+			case SOCKS_MSG_REQUEST:
+				while (fd + 4 >= *basemem) {
+					growup(basemem, co, events, &g_ape->output->bufout);
+					g_ape->co = *co;
+				}
+				sockworker_request_recv(&(*co)[fd], fd, msg, tfd, g_ape);
+				break;
+			case SOCKS_MSG_INPUT:
+				sockworker_input_recv(&(*co)[fd], fd, msg, g_ape);
+				free(msg->data);
+				break;
+			case SOCKS_MSG_BLOCKED:
+				(*co)[fd].flags |= CO_BLOCKED;
+				break;
+			case SOCKS_MSG_DRAINED:
+				(*co)[fd].flags &= ~CO_BLOCKED;
+				break;
+			case SOCKS_MSG_CLOSED:
+				worker = (*co)[fd].worker;
+				
+				sock_detach(&(*co)[fd], fd);
+				clear_buffer(&(*co)[fd], tfd);
+				
+				sockworker_notify(&g_ape->workers.list[worker - 1], SOCKS_MSG_RELEASE, fd);
+				break;
+			case SOCKS_MSG_WRITTEN:
+				for (seg = msg->out.head; seg != NULL; seg = snext) {
+					snext = seg->next;
+					bufout_release(g_ape->output, seg);
+				}
+				break;
+		}
+		free(msg);
+	}
+}
+
+/* Main loop : end of the iteration, what has been sent to the workers' connections is handed off */
+static void sockworkers_flush(acetables *g_ape)
+{
+	int i;
+	
+	for (i = 0; i < g_ape->workers.n; i++) {
+		handoff_send(g_ape->workers.list[i].inbox, &g_ape->workers.list[i].outbox);
+	}
+}
+
+/* Called each second : idle keep-alive connections and incomplete requests are closed */
+static void check_idle(acetables *g_ape)
+{
+	idle_expire(g_ape->co, &g_ape->http_idle);
+}
+
+/* Open the pending proxy connections (called on each tick) */
+static void proxy_connect_pending(int *basemem, connection **co, struct epoll_event **events, int *tfd, acetables *g_ape)
+{
+	ape_proxy *proxy = g_ape->proxy.list;
+	int psock;
+	
+	while (proxy != NULL) {
+
+		if (proxy->state == PROXY_NOT_CONNECTED && ((psock = proxy_connect(proxy, g_ape)) != 0)) {
+			while (psock + 4 >= *basemem) {
+				growup(basemem, co, events, &g_ape->output->bufout);
+				g_ape->co = *co;
+			}
+			bufout_init(&g_ape->output->bufout[psock], psock);
+			
+			(*co)[psock].ip_client[0] = '\0';
+			(*co)[psock].buffer.data = xmalloc(sizeof(char) * (DEFAULT_BUFFER_SIZE + 1));
+			(*co)[psock].buffer.size = DEFAULT_BUFFER_SIZE;
+			(*co)[psock].buffer.length = 0;
+			
+			(*co)[psock].idle = time(NULL);
+			(*co)[psock].idle_prev = -1;
+			(*co)[psock].idle_next = -1;
+			init_http_state(&(*co)[psock].http);
+			(*co)[psock].attach = proxy;
+			(*co)[psock].websocket = NULL;
+			(*co)[psock].deflate = NULL;
+			(*co)[psock].stream_type = STREAM_OUT;
+			(*co)[psock].worker = 0;
+			(*co)[psock].flags = 0;
+			(*tfd)++;
+		}
+
+		proxy = proxy->next;
+	}
+}
+
+/* A complete request is in the buffer : answer it and keep what follows (pipelined requests) */
+static void http_dispatch(connection *co, int fd, acetables *g_ape)
+{
+	int end = co->http.end;
+	
+	subuser *user;
+	
+	co->http.ready = -1;
+	co->http.framed = 0;
+	
+	idle_unlink(g_ape->co, &g_ape->http_idle, fd);
+	
+	user = checkrecv(co, fd, g_ape);
+	
+	/* The response may already be complete (see http_end()) */
+	co->attach = (co->http.ready == -1 ? user : NULL);
+	
+	/* No reallocation : the next request is moved to the beginning of the buffer */
+	co->buffer.length -= end;
+	memmove(co->buffer.data, co->buffer.data + end, co->buffer.length);
+	
+	reset_http_state(&co->http);
+	
+	/* Upgraded : frames may follow the handshake */
+	if (co->websocket != NULL && co->buffer.length) {
+		websocket_process(co, fd, g_ape);
+	}
+}
+
+/* Parse what has been read on "fd" and answer the request once complete */
+static void http_process(connection *co, int fd, acetables *g_ape)
+{
+	if (co->websocket != NULL) {
+		websocket_process(co, fd, g_ape);
+		return;
+	}
+	if (co->http.ready == -1) {
+		/* Still answering : what follows is kept for later */
+		if (co->buffer.length > HTTP_PIPELINE_MAX) {
+			shutdown(fd, 2);
+		}
+		return;
+	}
+	process_http(co);
+	
+	if (co->http.ready == 1) {
+		http_dispatch(co, fd, g_ape);
+	} else if (co->http.error == 1) {
+		shutdown(fd, 2);
+	}
+}
+
+/* Keep-alive connections whose response is complete : the next request may already be read */
+static void http_resume(acetables *g_ape)
+{
+	int i, fd;
+	
+	/* http_end() can add connections while we are processing */
+	for (i = 0; i < g_ape->http_resume.n; i++) {
+		fd = g_ape->http_resume.fd[i];
+		
+		if (g_ape->co[fd].buffer.size != 0 && g_ape->co[fd].stream_type == STREAM_IN) {
+			http_process(&g_ape->co[fd], fd, g_ape);
+		}
+	}
+	g_ape->http_resume.n = 0;
 }
-#endif
 
 unsigned int sockroutine(int s_listen, acetables *g_ape)
 {
 	int basemem = 512, epoll_fd;
 
 	struct epoll_event ev, *events;
-	struct _socks_list sl;
 
 	int new_fd, nfds, sin_size = sizeof(struct sockaddr_in), i, tfd = 0;
 	
-	struct timeval t_start, t_end;	
-	unsigned int ticks = 0;
+	int tick_fd, ready_fd = -1, ready_armed = 0;
+	uint64_t ticks;
+	struct itimerspec tick_spec, ready_spec;
 	struct sockaddr_in their_addr;
 	
 	
@@ -160,8 +898,12 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 	
 	memset(co, 0, sizeof(*co) * basemem);
 	
-	sl.co = co;
-	sl.tfd = &tfd;
+	g_ape->co = co;
+	g_ape->http_resume.fd = NULL;
+	g_ape->http_resume.n = 0;
+	g_ape->http_resume.size = 0;
+	g_ape->http_idle.head = -1;
+	g_ape->http_idle.foot = -1;
 	
 	epoll_fd = epoll_create(1); /* the param is not used */
 	
@@ -174,7 +916,8 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 	
 	events = xmalloc(sizeof(*events) * basemem);
 	
-	g_ape->bufout = xmalloc(sizeof(struct _socks_bufout) * basemem);
+	g_ape->output = xmalloc(sizeof(*g_ape->output));
+	output_init(g_ape->output, basemem, 0);
 
 	setnonblocking(s_listen);
 	
@@ -182,16 +925,49 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 	ev.data.fd = s_listen;
 	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s_listen, &ev);
 	
-	#if 0
-	add_periodical(5, 0, check_idle, &sl, g_ape);
-	#endif
+	if (g_ape->workers.n) {
+		sockworkers_start(g_ape, epoll_fd);
+	}
 	
-	while (1) {
+	/* Ticks are driven by a monotonic timer watched by epoll */
+	if ((tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+		printf("[ERR] Cannot create the ticks timer\n");
+		exit(0);
+	}
+	tick_spec.it_interval.tv_sec = 0;
+	tick_spec.it_interval.tv_nsec = 1000000000 / TICKS_RATE;
+	if (TICKS_RATE == 1) {
+		tick_spec.it_interval.tv_sec = 1;
+		tick_spec.it_interval.tv_nsec = 0;
+	}
+	tick_spec.it_value = tick_spec.it_interval;
+	timerfd_settime(tick_fd, 0, &tick_spec, NULL);
+	
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = tick_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tick_fd, &ev);
+	
+	/* One-shot timer used to batch RAWs during g_ape->ready.coalesce usec */
+	if (g_ape->ready.coalesce) {
+		if ((ready_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+			printf("[ERR] Cannot create the RAWs coalescing timer\n");
+			exit(0);
+		}
+		memset(&ready_spec, 0, sizeof(ready_spec));
+		ready_spec.it_value.tv_sec = g_ape->ready.coalesce / 1000000;
+		ready_spec.it_value.tv_nsec = (g_ape->ready.coalesce % 1000000) * 1000;
 		
-		/* Linux 2.6.25 provide a fd-driven timer system. It could be usefull to implement */
-		gettimeofday(&t_start, NULL);
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.fd = ready_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ready_fd, &ev);
+	}
+	
+	add_periodical(1, 0, check_idle, g_ape, g_ape);
+	
+	while (1) {
 		
-		nfds = epoll_wait(epoll_fd, events, basemem, (1000/TICKS_RATE)-ticks);
+		/* Pipelined requests waiting : don't block */
+		nfds = epoll_wait(epoll_fd, events, basemem, (g_ape->http_resume.n ? 0 : -1));
 		
 		if (nfds < 0) {
 			continue;
@@ -200,11 +976,30 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 			
 			for (i = 0; i < nfds; i++) {
 
-				if (events[i].data.fd == s_listen) {
+				if (events[i].data.fd == tick_fd) {
+					/* Expirations are counted by the kernel : late ticks are not lost */
+					if (read(tick_fd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+						continue;
+					}
+					/* Tic tac, tic tac :-) */
+					proxy_connect_pending(&basemem, &co, &events, &tfd, g_ape);
+					
+					while (ticks--) {
+						process_tick(g_ape);
+					}
+				} else if (events[i].data.fd == ready_fd) {
+					read(ready_fd, &ticks, sizeof(ticks));
+					
+					ready_armed = 0;
+					flush_ready(g_ape);
+				} else if (g_ape->workers.handoff != NULL && events[i].data.fd == g_ape->workers.handoff->efd) {
+					/* Requests, frames and events of the workers' connections */
+					sockworkers_recv(&basemem, &co, &events, &tfd, g_ape);
+					continue;
+				} else if (events[i].data.fd == s_listen) {
 				
 					while (1) {
 						struct epoll_event cev;
-						http_state http = {0, HTTP_NULL, 0, -1, 0, 0, 0};
 					
 						new_fd = accept(s_listen, 
 							(struct sockaddr *)&their_addr, 
@@ -214,9 +1009,10 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 							break;
 						}
 						
-						if (new_fd + 4 == basemem) {
+						while (new_fd + 4 >= basemem) {
 							/* Increase connection & events size */
-							growup(&basemem, &co, &events, &g_ape->bufout);
+							growup(&basemem, &co, &events, &g_ape->output->bufout);
+							g_ape->co = co;
 						}
 
 						strncpy(co[new_fd].ip_client, inet_ntoa(their_addr.sin_addr), 16);
@@ -225,16 +1021,17 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 						co[new_fd].buffer.size = DEFAULT_BUFFER_SIZE;
 						co[new_fd].buffer.length = 0;
 						
-						co[new_fd].http = http;
+						init_http_state(&co[new_fd].http);
 						co[new_fd].attach = NULL;
-						co[new_fd].idle = time(NULL);
-						
+						co[new_fd].websocket = NULL;
+						co[new_fd].deflate = NULL;
 						co[new_fd].stream_type = STREAM_IN;
+						co[new_fd].worker = 0;
+						co[new_fd].flags = 0;
+						
+						idle_link(co, &g_ape->http_idle, new_fd);
 					
-						g_ape->bufout[new_fd].fd = new_fd;
-						g_ape->bufout[new_fd].buf = NULL;
-						g_ape->bufout[new_fd].buflen = 0;
-						g_ape->bufout[new_fd].allocsize = 0;
+						bufout_init(&g_ape->output->bufout[new_fd], new_fd);
 						
 						setnonblocking(new_fd);
 
@@ -268,13 +1065,14 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 								close(events[i].data.fd);
 							}
 
-						} else if (co[events[i].data.fd].stream_type == STREAM_IN && g_ape->bufout[events[i].data.fd].buf != NULL) {
+						} else if (co[events[i].data.fd].stream_type == STREAM_IN && g_ape->output->bufout[events[i].data.fd].head != NULL) {
 
-							if (sendqueue(events[i].data.fd, g_ape) == 1) {
-								if (co[events[i].data.fd].attach != NULL && ((subuser *)(co[events[i].data.fd].attach))->burn_after_writing) {
-									do_died((subuser *)(co[events[i].data.fd].attach));
-									((subuser *)(co[events[i].data.fd].attach))->burn_after_writing = 0;
-								}
+							subuser *sub = co[events[i].data.fd].attach;
+							
+							if (sendqueue(events[i].data.fd, g_ape->output) == 1 && sub != NULL && sub->burn_after_writing) {
+								/* The connection is detached from "sub" by http_end() */
+								sub->burn_after_writing = 0;
+								do_died(sub, g_ape);
 							}
 						}
 					}
@@ -313,16 +1111,8 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 										*/
 									}
 									#endif
-									if (co[events[i].data.fd].stream_type == STREAM_IN && co[events[i].data.fd].attach != NULL) {
-									
-										if (events[i].data.fd == ((subuser *)(co[events[i].data.fd].attach))->fd) {
-											((subuser *)(co[events[i].data.fd].attach))->headers_sent = 0;
-											((subuser *)(co[events[i].data.fd].attach))->state = ADIED;
-										}
-										if (((subuser *)(co[events[i].data.fd].attach))->wait_for_free == 1) {
-											free(co[events[i].data.fd].attach);
-											co[events[i].data.fd].attach = NULL;						
-										}
+									if (co[events[i].data.fd].stream_type == STREAM_IN) {
+										sock_detach(&co[events[i].data.fd], events[i].data.fd);
 									} else if (co[events[i].data.fd].stream_type == STREAM_OUT) {
 									
 										if (((ape_proxy *)(co[events[i].data.fd].attach))->state == PROXY_TOFREE) {
@@ -335,19 +1125,15 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 										}
 									}
 								
+									idle_unlink(co, &g_ape->http_idle, events[i].data.fd);
 									clear_buffer(&co[events[i].data.fd], &tfd);
 								
-									if (g_ape->bufout[events[i].data.fd].buf != NULL) {
-										free(g_ape->bufout[events[i].data.fd].buf);
-										g_ape->bufout[events[i].data.fd].buflen = 0;
-										g_ape->bufout[events[i].data.fd].buf = NULL;
-										g_ape->bufout[events[i].data.fd].allocsize = 0;
-									}
+									bufout_free(events[i].data.fd, g_ape->output);
 									
 									close(events[i].data.fd);
 							
 									break;
-								} else if (co[events[i].data.fd].http.ready != -1) {
+								} else {
 									co[events[i].data.fd].buffer.length += readb;
 
 									if (co[events[i].data.fd].buffer.length == co[events[i].data.fd].buffer.size) {
@@ -357,18 +1143,7 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 									
 									}
 									if (co[events[i].data.fd].stream_type == STREAM_IN) {
-										process_http(&co[events[i].data.fd]);
-								
-										if (co[events[i].data.fd].http.ready == 1) {
-											co[events[i].data.fd].attach = checkrecv(co[events[i].data.fd].buffer.data, 
-																events[i].data.fd, g_ape, co[events[i].data.fd].ip_client);
-									
-											co[events[i].data.fd].buffer.length = 0;
-											co[events[i].data.fd].http.ready = -1;
-			
-										} else if (co[events[i].data.fd].http.error == 1) {
-											shutdown(events[i].data.fd, 2);
-										}
+										http_process(&co[events[i].data.fd], events[i].data.fd, g_ape);
 									}
 								}
 						
@@ -380,45 +1155,28 @@ unsigned int sockroutine(int s_listen, acetables *g_ape)
 			}
 		}
 		
-		gettimeofday(&t_end, NULL);
-
-		ticks += (1000*(t_end.tv_sec - t_start.tv_sec))+((t_end.tv_usec - t_start.tv_usec)/1000);
+		if (g_ape->http_resume.n) {
+			http_resume(g_ape);
+		}
 		
-		/* Tic tac, tic tac :-) */
-		if (ticks >= 1000/TICKS_RATE) {
-			ape_proxy *proxy = g_ape->proxy.list;
-			int psock;
-			
-			ticks = 0;
-			
-			while (proxy != NULL) {
-
-				if (proxy->state == PROXY_NOT_CONNECTED && ((psock = proxy_connect(proxy, g_ape)) != 0)) {
-					http_state http_s = {0, HTTP_NULL, 0, -1, 0, 0, 0};
-					if (psock + 4 == basemem) {
-						growup(&basemem, &co, &events, &g_ape->bufout);
-					}
-					co[psock].ip_client[0] = '\0';
-					co[psock].buffer.data = xmalloc(sizeof(char) * (DEFAULT_BUFFER_SIZE + 1));
-					co[psock].buffer.size = DEFAULT_BUFFER_SIZE;
-					co[psock].buffer.length = 0;
-					
-					co[psock].idle = time(NULL);
-					co[psock].http = http_s;
-					co[psock].attach = proxy;
-					co[psock].stream_type = STREAM_OUT;
-					tfd++;
-				}
-
-
-				proxy = proxy->next;
+		/* Send the RAWs posted during this iteration to the waiting clients */
+		if (g_ape->ready.head != NULL) {
+			if (ready_fd == -1) {
+				flush_ready(g_ape);
+			} else if (!ready_armed) {
+				timerfd_settime(ready_fd, 0, &ready_spec, NULL);
+				ready_armed = 1;
 			}
-			
-			process_tick(g_ape);
-		}                
+		}
+		
+		/* What has been sent to the workers' connections during this iteration */
+		if (g_ape->workers.n) {
+			sockworkers_flush(g_ape);
+		}
 
 	}
 
+	close(tick_fd);
 	close(epoll_fd);
 	return 0;
 }
@@ -442,36 +1200,241 @@ int sendf(int sock, acetables *g_ape, char *buf, ...)
 	return finish;
 }
 
-static int sendqueue(int sock, acetables *g_ape)
+/*
+	Output queue : chain of segments consumed by advancing an offset.
+	Each loop has its own queues and pool of free segments (no lock needed).
+	Segments are taken from the main loop's pool : a worker gives them back once written
+	(deferred), the main loop releases their payload and pools them.
+*/
+static void output_init(struct _socks_output *out, int size, int deferred)
 {
-	int t_bytes = 0, r_bytes, n = 0;
-	struct _socks_bufout *bufout = &g_ape->bufout[sock];
+	out->bufout = xmalloc(sizeof(struct _socks_bufout) * size);
+	out->pool = NULL;
+	out->pool_len = 0;
+	out->deferred = deferred;
+	out->written = NULL;
+	out->queued = 0;
+	out->highwater = 0;
+}
+
+static struct _socks_bufout_seg *bufout_seg_new(struct _socks_output *out)
+{
+	struct _socks_bufout_seg *seg;
 	
-	if (bufout->buf == NULL) {
-		return 1;
+	if (out->pool != NULL) {
+		seg = out->pool;
+		out->pool = seg->next;
+		out->pool_len--;
+	} else {
+		seg = xmalloc(sizeof(*seg));
+		seg->block = NULL;
 	}
+	seg->data = NULL;
+	seg->len = 0;
+	seg->offset = 0;
+	seg->release = NULL;
+	seg->ref = NULL;
+	seg->next = NULL;
 	
-	r_bytes = bufout->buflen;
+	return seg;
+}
+
+static void bufout_release(struct _socks_output *out, struct _socks_bufout_seg *seg)
+{
+	if (out->deferred) {
+		seg->next = out->written;
+		out->written = seg;
+		return;
+	}
+	if (seg->release != NULL) {
+		seg->release(seg->ref);
+	}
+	if (out->pool_len < BUFOUT_POOL_MAX) {
+		seg->next = out->pool;
+		out->pool = seg;
+		out->pool_len++;
+	} else {
+		free(seg->block);
+		free(seg);
+	}
+}
+
+static void bufout_init(struct _socks_bufout *bufout, int fd)
+{
+	bufout->fd = fd;
+	bufout->head = NULL;
+	bufout->foot = NULL;
+	bufout->buflen = 0;
+}
+
+static void bufout_link(struct _socks_bufout *bufout, struct _socks_bufout_seg *seg)
+{
+	if (bufout->foot != NULL) {
+		bufout->foot->next = seg;
+	} else {
+		bufout->head = seg;
+	}
+	bufout->foot = seg;
+}
+
+static void bufout_queued(struct _socks_output *out, int len)
+{
+	out->queued += len;
 	
-	while(t_bytes < bufout->buflen) {
-		n = write(sock, bufout->buf + t_bytes, r_bytes);
-		if (n == -1) {
-			if (errno == EAGAIN && r_bytes > 0) {
-				memmove(bufout->buf, bufout->buf + t_bytes, r_bytes);
-				bufout->buflen = r_bytes;
-				/* Decrease memory size ? */
-				return 0;
+	if (out->queued > out->highwater) {
+		out->highwater = out->queued;
+	}
+}
+
+/* Move the segments of "from" at the end of "bufout" */
+static void bufout_splice(struct _socks_output *out, struct _socks_bufout *bufout, struct _socks_bufout *from)
+{
+	if (from->head == NULL) {
+		return;
+	}
+	if (bufout->foot != NULL) {
+		bufout->foot->next = from->head;
+	} else {
+		bufout->head = from->head;
+	}
+	bufout->foot = from->foot;
+	bufout->buflen += from->buflen;
+	
+	bufout_queued(out, from->buflen);
+	
+	bufout_init(from, from->fd);
+}
+
+/* Copy data at the end of "bufout" (segments are taken from the pool of "out") */
+static void bufout_copy(struct _socks_output *out, struct _socks_bufout *bufout, char *data, int len)
+{
+	struct _socks_bufout_seg *seg = bufout->foot;
+	
+	bufout->buflen += len;
+	
+	while (len > 0) {
+		int size;
+		
+		/* Fill the last copy segment before taking a new one */
+		if (seg == NULL || seg->data != seg->block || seg->len == BUFOUT_SEG_SIZE) {
+			seg = bufout_seg_new(out);
+			if (seg->block == NULL) {
+				seg->block = xmalloc(sizeof(char) * BUFOUT_SEG_SIZE);
 			}
-			break;
+			seg->data = seg->block;
+			bufout_link(bufout, seg);
 		}
-		t_bytes += n;
-		r_bytes -= n;		
+		size = (BUFOUT_SEG_SIZE - seg->len < len ? BUFOUT_SEG_SIZE - seg->len : len);
+		
+		memcpy(seg->data + seg->len, data, size);
+		seg->len += size;
+		
+		data += size;
+		len -= size;
 	}
+}
+
+/* Shared payload at the end of "bufout" without copying it, release() is called once it's written */
+static void bufout_ref(struct _socks_output *out, struct _socks_bufout *bufout, char *data, int len, struct _socks_ref *ref)
+{
+	struct _socks_bufout_seg *seg = bufout_seg_new(out);
 	
-	bufout->buflen = 0;
-	free(bufout->buf);
+	seg->data = data;
+	seg->len = len;
+	seg->release = ref->release;
+	seg->ref = ref->ref;
+	
+	bufout->buflen += len;
+	bufout_link(bufout, seg);
+}
+
+/* Queue data that can't be written now (flushed by sendqueue() on EPOLLOUT) */
+static void bufout_append(int sock, char *data, int len, acetables *g_ape)
+{
+	bufout_copy(g_ape->output, &g_ape->output->bufout[sock], data, len);
+	bufout_queued(g_ape->output, len);
+}
+
+static void bufout_append_ref(int sock, char *data, int len, struct _socks_ref *ref, acetables *g_ape)
+{
+	bufout_ref(g_ape->output, &g_ape->output->bufout[sock], data, len, ref);
+	bufout_queued(g_ape->output, len);
+}
+
+static void bufout_free(int sock, struct _socks_output *out)
+{
+	struct _socks_bufout *bufout = &out->bufout[sock];
+	struct _socks_bufout_seg *seg, *next;
+	
+	for (seg = bufout->head; seg != NULL; seg = next) {
+		next = seg->next;
+		bufout_release(out, seg);
+	}
+	out->queued -= bufout->buflen;
+	
+	bufout_init(bufout, sock);
+}
+
+void bufout_stats(FILE *out, acetables *g_ape)
+{
+	int i;
+	
+	if (g_ape->output == NULL) {
+		return;
+	}
+	fprintf(out, "[bufout] %lu bytes queued, highwater %lu bytes, %i/%i pooled segments\n", 
+		g_ape->output->queued, g_ape->output->highwater, g_ape->output->pool_len, BUFOUT_POOL_MAX);
+	
+	/* Read while the workers are writing : only an estimate */
+	for (i = 0; i < g_ape->workers.n; i++) {
+		fprintf(out, "[bufout] worker %i : %lu bytes queued, highwater %lu bytes\n", 
+			g_ape->workers.list[i].id, g_ape->workers.list[i].output.queued, g_ape->workers.list[i].output.highwater);
+	}
+	fflush(out);
+}
 
-	bufout->buf = NULL;
+/* Write the queue (writev() on the segments), return 1 if the queue is empty */
+static int sendqueue(int sock, struct _socks_output *out)
+{
+	struct _socks_bufout *bufout = &out->bufout[sock];
+	struct iovec iov[64];
+	struct _socks_bufout_seg *seg;
+	int n, i;
+	
+	while (bufout->head != NULL) {
+		for (i = 0, seg = bufout->head; seg != NULL && i < 64; seg = seg->next, i++) {
+			iov[i].iov_base = seg->data + seg->offset;
+			iov[i].iov_len = seg->len - seg->offset;
+		}
+		
+		if ((n = writev(sock, iov, i)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN) {
+				return 0;
+			}
+			/* Connection is broken, drop the queue */
+			bufout_free(sock, out);
+			break;
+		}
+		
+		bufout->buflen -= n;
+		out->queued -= n;
+		
+		/* Advance the offset and release the written segments */
+		while ((seg = bufout->head) != NULL && n >= seg->len - seg->offset) {
+			n -= seg->len - seg->offset;
+			
+			bufout->head = seg->next;
+			if (bufout->head == NULL) {
+				bufout->foot = NULL;
+			}
+			bufout_release(out, seg);
+		}
+		if (seg != NULL) {
+			seg->offset += n;
+		}
+	}
 	
 	return 1;
 }
@@ -482,24 +1445,34 @@ int sendbin(int sock, char *bin, int len, acetables *g_ape)
 
 	r_bytes = len;
 	
+	if (sock != 0 && g_ape->co[sock].deflate != NULL && g_ape->co[sock].deflate->on) {
+		struct iovec iov;
+		
+		/* Compressed stream (see compress_stream_header()) */
+		iov.iov_base = bin;
+		iov.iov_len = len;
+		
+		return compress_sendv(sock, &iov, NULL, 1, g_ape);
+	}
+	if (sock != 0 && g_ape->co[sock].worker != 0) {
+		/* Written by the worker owning it once this iteration is done (dropped if closed) */
+		if (g_ape->co[sock].worker > 0) {
+			bufout_copy(g_ape->output, sockworker_outbox(sock, g_ape), bin, len);
+		}
+		return 1;
+	}
 	if (sock != 0) {
+		/* Something is already waiting for EPOLLOUT, keep the order */
+		if (g_ape->output->bufout[sock].head != NULL) {
+			bufout_append(sock, bin, len, g_ape);
+			
+			return 0;
+		}
 		while(t_bytes < len) {
 			n = write(sock, bin + t_bytes, r_bytes);
 			if (n == -1) {
 				if (errno == EAGAIN && r_bytes > 0) {
-					if (g_ape->bufout[sock].buf == NULL) {
-						g_ape->bufout[sock].allocsize = r_bytes + 128; /* add padding to prevent extra data to be reallocated */
-						g_ape->bufout[sock].buf = xmalloc(sizeof(char) * g_ape->bufout[sock].allocsize);
-						g_ape->bufout[sock].buflen = r_bytes;
-					} else {
-						g_ape->bufout[sock].buflen += r_bytes;
-						if (g_ape->bufout[sock].buflen > g_ape->bufout[sock].allocsize) {
-							g_ape->bufout[sock].allocsize = g_ape->bufout[sock].buflen + 128;
-							g_ape->bufout[sock].buf = xrealloc(g_ape->bufout[sock].buf, sizeof(char) * g_ape->bufout[sock].allocsize);
-						}
-					}
-					
-					memcpy(g_ape->bufout[sock].buf + (g_ape->bufout[sock].buflen - r_bytes), bin + t_bytes, r_bytes);
+					bufout_append(sock, bin + t_bytes, r_bytes, g_ape);
 					
 					return 0;
 				}
@@ -513,3 +1486,208 @@ int sendbin(int sock, char *bin, int len, acetables *g_ape)
 	return 1;
 }
 
+/*
+	HTTP response header of the request being answered on "fd".
+	len : Content-Length, -1 if the body is streamed until the connection is closed
+*/
+int http_header(int fd, char *buf, int len, acetables *g_ape)
+{
+	return http_header_encoded(fd, buf, len, NULL, g_ape);
+}
+
+/*
+	encoding : Content-Encoding of a framed body (NULL : none).
+	Streamed bodies are compressed by the connection itself if the client accepts it (see compress_stream_header())
+*/
+int http_header_encoded(int fd, char *buf, int len, const char *encoding, acetables *g_ape)
+{
+	connection *co = &g_ape->co[fd];
+	http_state *http = &co->http;
+	
+	if (co->websocket != NULL) {
+		/* One message per response (nothing can be streamed) */
+		return (len < 0 ? 0 : websocket_frame_header(buf, WS_TEXT, len));
+	}
+	if (len < 0) {
+		http->keepalive = 0;
+		
+		return compress_stream_header(co, buf, HEADER_FIELDS, g_ape);
+	}
+	http->framed = 1;
+	
+	if (encoding != NULL) {
+		return sprintf(buf, HEADER_FIELDS "Content-Encoding: %s\r\nContent-Length: %i\r\nConnection: %s\r\n\r\n", 
+			encoding, len, (http->keepalive ? "keep-alive" : "close"));
+	}
+	return sprintf(buf, HEADER_FIELDS "Content-Length: %i\r\nConnection: %s\r\n\r\n", len, (http->keepalive ? "keep-alive" : "close"));
+}
+
+void http_send_header(int fd, int len, acetables *g_ape)
+{
+	char buf[HTTP_HEADER_MAX];
+	
+	sendbin(fd, buf, http_header(fd, buf, len, g_ape), g_ape);
+}
+
+/*
+	The response to the request of "fd" is complete.
+	Keep-alive connections wait for their next request (it may be already read), the others are closed.
+	WebSocket connections are closed (see websocket_close())
+	In any case, the connection doesn't belong to its subuser anymore.
+*/
+void http_end(int fd, acetables *g_ape)
+{
+	connection *co = &g_ape->co[fd];
+	
+	if (co->stream_type == STREAM_IN && co->attach != NULL) {
+		subuser *sub = co->attach;
+		
+		co->attach = NULL;
+		
+		if (sub->fd == fd) {
+			sub->state = ADIED;
+			sub->headers_sent = 0;
+		}
+		/* Removed while it was waiting for this response (see delsubuser()) */
+		if (sub->wait_for_free) {
+			free_subuser(sub);
+		}
+	}
+	if (co->websocket != NULL) {
+		/* Messages are framed : the connection is only closed when it can't be used anymore */
+		websocket_close(fd, g_ape);
+		return;
+	}
+	if (co->stream_type != STREAM_IN || !co->http.keepalive || !co->http.framed) {
+		sockshutdown(fd, g_ape);
+		return;
+	}
+	if (co->http.ready != -1) {
+		return;
+	}
+	co->http.ready = 0;
+	co->http.framed = 0;
+	
+	if (co->worker > 0) {
+		/* The worker reads the next request once the response is written */
+		sockworker_notify(&g_ape->workers.list[co->worker - 1], SOCKS_MSG_RESUME, fd);
+		return;
+	}
+	idle_link(g_ape->co, &g_ape->http_idle, fd);
+	
+	if (g_ape->http_resume.n == g_ape->http_resume.size) {
+		g_ape->http_resume.size = (g_ape->http_resume.size ? g_ape->http_resume.size * 2 : 32);
+		g_ape->http_resume.fd = xrealloc(g_ape->http_resume.fd, sizeof(int) * g_ape->http_resume.size);
+	}
+	g_ape->http_resume.fd[g_ape->http_resume.n++] = fd;
+}
+
+/* Shutdown "fd" whatever the loop owning it (the output already sent is written first by a worker) */
+void sockshutdown(int fd, acetables *g_ape)
+{
+	int worker = g_ape->co[fd].worker;
+	
+	if (worker > 0) {
+		sockworker_notify(&g_ape->workers.list[worker - 1], SOCKS_MSG_SHUTDOWN, fd);
+	} else if (worker == 0) {
+		shutdown(fd, 2);
+	}
+}
+
+/* Is something sent to "fd" still waiting for EPOLLOUT ? */
+int sendpending(int fd, acetables *g_ape)
+{
+	if (g_ape->co[fd].worker != 0) {
+		return (g_ape->co[fd].flags & CO_BLOCKED);
+	}
+	return (g_ape->output->bufout[fd].head != NULL);
+}
+
+/*
+	Gather version of sendbin() : write all the buffers using as few writev() as possible.
+	Only the unsent tail is queued.
+	If refs is not NULL, refs[i].release (if any) takes the ownership of iov[i] :
+	it's queued by reference instead of being copied, and released once written.
+	/!\ iov is modified
+*/
+int sendbinv(int sock, struct iovec *iov, struct _socks_ref *refs, int iovcnt, acetables *g_ape)
+{
+	int i = 0, n;
+	
+	if (sock == 0) {
+		goto release;
+	}
+	if (g_ape->co[sock].deflate != NULL && g_ape->co[sock].deflate->on) {
+		return compress_sendv(sock, iov, refs, iovcnt, g_ape);
+	}
+	if (g_ape->co[sock].worker != 0) {
+		struct _socks_bufout *bufout;
+		
+		if (g_ape->co[sock].worker == -1) {
+			goto release;
+		}
+		/* Owned by a worker : shared payloads are handed to it by reference */
+		bufout = sockworker_outbox(sock, g_ape);
+		
+		for (; i < iovcnt; i++) {
+			if (refs != NULL && refs[i].release != NULL) {
+				bufout_ref(g_ape->output, bufout, iov[i].iov_base, iov[i].iov_len, &refs[i]);
+			} else if (iov[i].iov_len) {
+				bufout_copy(g_ape->output, bufout, iov[i].iov_base, iov[i].iov_len);
+			}
+		}
+		return 1;
+	}
+	
+	/* Something is already waiting for EPOLLOUT, keep the order */
+	if (g_ape->output->bufout[sock].head != NULL) {
+		goto queue;
+	}
+	
+	while (i < iovcnt) {
+		n = writev(sock, &iov[i], (iovcnt - i > IOV_MAX ? IOV_MAX : iovcnt - i));
+		
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN) {
+				goto queue;
+			}
+			goto release;
+		}
+		
+		/* Skip what has been written */
+		while (i < iovcnt && n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			
+			if (refs != NULL && refs[i].release != NULL) {
+				refs[i].release(refs[i].ref);
+			}
+			i++;
+		}
+		if (n > 0) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	
+	return 1;
+	
+	queue:
+	for (; i < iovcnt; i++) {
+		if (refs != NULL && refs[i].release != NULL) {
+			bufout_append_ref(sock, iov[i].iov_base, iov[i].iov_len, &refs[i], g_ape);
+		} else if (iov[i].iov_len) {
+			bufout_append(sock, iov[i].iov_base, iov[i].iov_len, g_ape);
+		}
+	}
+	return 0;
+	
+	release:
+	for (; i < iovcnt; i++) {
+		if (refs != NULL && refs[i].release != NULL) {
+			refs[i].release(refs[i].ref);
+		}
+	}
+	return 1;
+}
@@ -28,34 +28,88 @@
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include "main.h"
 
 #define TCP_TIMEOUT 20 // ~Timeout if the socket is not identified to APE
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define SENDH(x, y, g_ape) \
-	sendbin(x, HEADER, HEADER_LEN, g_ape);\
+	http_send_header(x, strlen(y), g_ape);\
 	sendbin(x, y, strlen(y), g_ape)
 	
 #define CLOSE(x, g_ape) \
-	sendbin(x, HEADER, HEADER_LEN, g_ape);\
+	http_send_header(x, 5, g_ape);\
 	sendbin(x, "CLOSE", 5, g_ape)
 
 #define QUIT(x, g_ape) \
-	sendbin(x, HEADER, HEADER_LEN, g_ape);\
+	http_send_header(x, 4, g_ape);\
 	sendbin(x, "QUIT", 4, g_ape)
 
-int newSockListen(unsigned int port, char *listen_ip);
-void setnonblocking(int fd);
-int sendf(int sock, acetables *g_ape, char *buf, ...);
-int sendbin(int sock, char *bin, int len, acetables *g_ape);
-unsigned int sockroutine(int s_listen, acetables *g_ape);
+/* HEADER_FIELDS + Content-Length + Connection + Content-Encoding */
+#define HTTP_HEADER_MAX (HEADER_LEN + 96)
+
+
+#define BUFOUT_SEG_SIZE 4096 // Size of a pooled output segment
+#define BUFOUT_POOL_MAX 1024 // Max number of free segments kept in the pool
+
+/*
+	Output queue segment.
+	Either a pooled BUFOUT_SEG_SIZE block holding copied data
+	or a reference to a shared payload (released once written).
+*/
+struct _socks_bufout_seg
+{
+	char *data;
+	int len;
+	int offset; /* already written */
+	
+	char *block;
+	
+	void (*release)(void *);
+	void *ref;
+	
+	struct _socks_bufout_seg *next;
+};
+
+/* Used by sendbinv() callers to give a payload instead of a copy */
+struct _socks_ref
+{
+	void (*release)(void *);
+	void *ref;
+};
 
 struct _socks_bufout
 {
 	int fd;
-	char *buf;
-	int buflen;
-	int allocsize;
+	
+	struct _socks_bufout_seg *head;
+	struct _socks_bufout_seg *foot;
+	
+	int buflen; /* pending bytes */
+};
+
+/* Output queues of an event loop, indexed by fd : a loop only writes the connections it owns */
+struct _socks_output
+{
+	struct _socks_bufout *bufout;
+	
+	/* Free segments */
+	struct _socks_bufout_seg *pool;
+	int pool_len;
+	
+	/* Worker : written segments are given back to the main loop (see SOCKS_MSG_WRITTEN) */
+	int deferred;
+	struct _socks_bufout_seg *written;
+	
+	/* Bytes waiting in the queues (highwater : max ever reached) */
+	unsigned long queued;
+	unsigned long highwater;
 };
 
 struct _socks_list
@@ -64,5 +118,103 @@ struct _socks_list
 	int *tfd;
 };
 
+/*
+	Messages between the main loop and a worker, about one of the worker's connections.
+	Messages of a loop are sent at the end of its iteration (see handoff_send())
+*/
+enum {
+	/* worker => main loop */
+	SOCKS_MSG_REQUEST, /* A complete HTTP request (co : copy of the connection, its buffer only holds the request) */
+	SOCKS_MSG_INPUT, /* Read on a WebSocket (data, len) */
+	SOCKS_MSG_BLOCKED, /* The output queue is waiting for EPOLLOUT */
+	SOCKS_MSG_DRAINED, /* The output queue is empty again */
+	SOCKS_MSG_CLOSED, /* The peer is gone, the fd is kept open until SOCKS_MSG_RELEASE */
+	SOCKS_MSG_WRITTEN, /* Written segments (out), their payloads are released by the main loop */
+	
+	/* main loop => worker */
+	SOCKS_MSG_OUTPUT, /* Data to write (out) */
+	SOCKS_MSG_RESUME, /* The response is complete : read the next request */
+	SOCKS_MSG_UPGRADE, /* WebSocket : what is read is given as is (SOCKS_MSG_INPUT) */
+	SOCKS_MSG_SHUTDOWN,
+	SOCKS_MSG_RELEASE /* Forgotten by the main loop : the fd can be closed */
+};
+
+struct _socks_msg
+{
+	int type;
+	int fd;
+	
+	struct _connection *co;
+	
+	char *data;
+	int len;
+	
+	struct _socks_bufout out;
+	
+	struct _socks_msg *next;
+};
+
+struct _socks_msgs
+{
+	struct _socks_msg *head;
+	struct _socks_msg *foot;
+};
+
+/* Queue of messages between two loops (the receiver is woken up using an eventfd) */
+struct _socks_handoff
+{
+	pthread_mutex_t lock;
+	int efd;
+	
+	struct _socks_msgs msgs;
+};
+
+/*
+	Additional event loops (Server::workers - 1).
+	Each worker owns its listen socket (SO_REUSEPORT), its epoll, its connection table
+	and its output queues : it accepts, reads, parses and writes its connections.
+	Users and channels belong to the main loop : complete requests (sessid lookup, commands)
+	are handed off to it, and what it sends to a worker connection (responses, channels fanout)
+	is handed back to the worker. Shared RAW payloads are sent by reference and released
+	by the main loop once written.
+*/
+struct _socks_worker
+{
+	int id;
+	int s_listen;
+	int epoll_fd;
+	
+	int basemem;
+	int tfd;
+	
+	struct _connection *co;
+	struct _socks_output output;
+	
+	/* Connections waiting for a request, closed after TCP_TIMEOUT seconds */
+	struct _socks_idle idle;
+	
+	pthread_t thread;
+	struct _socks_handoff *handoff; /* => main loop (shared by the workers) */
+	struct _socks_handoff *inbox; /* main loop => this worker */
+	
+	struct _socks_msgs pending; /* worker side : to the main loop */
+	struct _socks_msgs outbox; /* main loop side : to this worker */
+};
+
+int newSockListen(unsigned int port, char *listen_ip, int reuseport);
+struct _socks_worker *sockworkers_init(int nworkers, unsigned int port, char *listen_ip);
+void setnonblocking(int fd);
+int sendf(int sock, acetables *g_ape, char *buf, ...);
+int sendbin(int sock, char *bin, int len, acetables *g_ape);
+int http_header(int fd, char *buf, int len, acetables *g_ape);
+int http_header_encoded(int fd, char *buf, int len, const char *encoding, acetables *g_ape);
+void http_send_header(int fd, int len, acetables *g_ape);
+void http_end(int fd, acetables *g_ape);
+void sockshutdown(int fd, acetables *g_ape);
+int sendpending(int fd, acetables *g_ape);
+int sendbinv(int sock, struct iovec *iov, struct _socks_ref *refs, int iovcnt, acetables *g_ape);
+unsigned int sockroutine(int s_listen, acetables *g_ape);
+void bufout_stats(FILE *out, acetables *g_ape);
+
 #endif
 
@@ -0,0 +1,156 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* sse.c */
+
+#include "sse.h"
+#include "sock.h"
+#include "http.h"
+#include "utils.h"
+#include "compress.h"
+
+/* The request being answered on "fd" comes from an EventSource */
+int sse_is_stream(int fd, acetables *g_ape)
+{
+	return g_ape->co[fd].http.eventstream;
+}
+
+/*
+	The event stream of "sub" is (re)opened : the header is sent once,
+	events not received before (Last-Event-ID) are queued again.
+*/
+void sse_start(subuser *sub, acetables *g_ape)
+{
+	struct _sse *sse;
+	RAW *raw, *head = NULL, *tail = NULL;
+	int last = g_ape->co[sub->fd].http.last_event_id, i, n = 0;
+	char header[HTTP_HEADER_MAX];
+	
+	g_ape->co[sub->fd].http.keepalive = 0;
+	sub->headers_sent = 1;
+	
+	/* Events may be compressed by the connection */
+	sendbin(sub->fd, header, compress_stream_header(&g_ape->co[sub->fd], header, SSE_HEADER_FIELDS, g_ape), g_ape);
+	
+	if ((sse = sub->sse) == NULL) {
+		sse = sub->sse = xmalloc(sizeof(*sse));
+		memset(sse, 0, sizeof(*sse));
+		
+		return;
+	}
+	
+	for (i = sse->id - SSE_REPLAY + 1; i <= sse->id; i++) {
+		if (i < 1 || (raw = sse->replay[i % SSE_REPLAY]) == NULL) {
+			continue;
+		}
+		sse->replay[i % SSE_REPLAY] = NULL;
+		
+		/* A new EventSource (no Last-Event-ID) doesn't want them */
+		if (last < 0 || i <= last) {
+			while (raw != NULL) {
+				RAW *older = raw;
+				
+				raw = raw->next;
+				free_raw(older);
+			}
+			continue;
+		}
+		if (head == NULL) {
+			head = raw;
+		} else {
+			tail->next = raw;
+		}
+		for (tail = raw, n++; tail->next != NULL; tail = tail->next) {
+			n++;
+		}
+	}
+	
+	/* Replayed (in a new event) before what is already queued */
+	if (head != NULL) {
+		if ((tail->next = sub->rawhead) == NULL) {
+			sub->rawfoot = tail;
+		}
+		sub->rawhead = head;
+		sub->nraw += n;
+	}
+}
+
+/* "id: <n>\ndata: [" : the RAWs are sent as a single JSON line */
+int sse_event_begin(subuser *sub, char *buf)
+{
+	return sprintf(buf, "id: %i\ndata: [", ++sub->sse->id);
+}
+
+/* The RAWs of the event are kept (with their own reference) until SSE_REPLAY events later */
+void sse_event_end(subuser *sub, RAW *raws)
+{
+	RAW *raw, **slot = &sub->sse->replay[sub->sse->id % SSE_REPLAY];
+	
+	while ((raw = *slot) != NULL) {
+		*slot = raw->next;
+		free_raw(raw);
+	}
+	for (raw = raws; raw != NULL; raw = raw->next) {
+		raw->payload->refs++;
+	}
+	*slot = raws;
+}
+
+void sse_free(subuser *sub)
+{
+	RAW *raw;
+	int i;
+	
+	if (sub->sse == NULL) {
+		return;
+	}
+	for (i = 0; i < SSE_REPLAY; i++) {
+		while ((raw = sub->sse->replay[i]) != NULL) {
+			sub->sse->replay[i] = raw->next;
+			free_raw(raw);
+		}
+	}
+	free(sub->sse);
+	sub->sse = NULL;
+}
+
+/*
+	Called every SSE_HEARTBEAT_SEC.
+	Idle event streams get a comment (keeps proxies from closing them).
+	The subuser is touched if the previous writes were drained, a stream which
+	doesn't read anymore times out.
+*/
+void sse_heartbeat(acetables *g_ape)
+{
+	subuser *sub, *next;
+	long int ctime = time(NULL);
+	
+	for (sub = g_ape->idle.shead; sub != NULL && (ctime - sub->idle) >= SSE_HEARTBEAT_SEC; sub = next) {
+		next = sub->idle_next;
+		
+		if (sub->state != ALIVE || sub->user->transport != TRANSPORT_SSE || !sub->headers_sent) {
+			continue;
+		}
+		if (!sendpending(sub->fd, g_ape)) {
+			touch_subuser(sub, g_ape);
+			touch_user(sub->user, g_ape);
+		}
+		sendbin(sub->fd, ":\n\n", 3, g_ape);
+	}
+}
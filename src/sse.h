@@ -0,0 +1,51 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* sse.h */
+
+#ifndef _SSE_H
+#define _SSE_H
+
+#include "main.h"
+#include "users.h"
+#include "raw.h"
+
+#define SSE_HEADER_FIELDS "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n"
+
+#define SSE_EVENT_MAX 32 // "id: <n>\ndata: ["
+#define SSE_REPLAY 16 // Events kept for Last-Event-ID
+#define SSE_HEARTBEAT_SEC 15 // Idle event streams get a comment
+
+/* Event stream state of a subuser (see sse_start()) */
+struct _sse
+{
+	int id; /* last event sent */
+	
+	/* RAWs of the last SSE_REPLAY events, event "n" is in replay[n % SSE_REPLAY] */
+	RAW *replay[SSE_REPLAY];
+};
+
+int sse_is_stream(int fd, acetables *g_ape);
+void sse_start(subuser *sub, acetables *g_ape);
+int sse_event_begin(subuser *sub, char *buf);
+void sse_event_end(subuser *sub, RAW *raws);
+void sse_free(subuser *sub);
+void sse_heartbeat(acetables *g_ape);
+
+#endif
@@ -27,29 +27,109 @@
 #include <sys/time.h>
 #include <time.h>
 
+struct _ticks_wheel *ticks_init()
+{
+	struct _ticks_wheel *wheel = xmalloc(sizeof(*wheel));
+	
+	memset(wheel, 0, sizeof(*wheel));
+	
+	return wheel;
+}
+
+static void timer_link(struct _ticks_callback **head, struct _ticks_callback *timer)
+{
+	if ((timer->next = *head) != NULL) {
+		timer->next->pprev = &timer->next;
+	}
+	*head = timer;
+	timer->pprev = head;
+}
+
+static void timer_unlink(struct _ticks_callback *timer)
+{
+	if ((*timer->pprev = timer->next) != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/* Put the timer in the bucket matching its expiration (relative to wheel->now) */
+static void timer_insert(struct _ticks_wheel *wheel, struct _ticks_callback *timer)
+{
+	unsigned long expire = timer->expire, delta;
+	int level;
+	
+	if ((long)(expire - wheel->now) < 0) {
+		expire = wheel->now;
+	} else if (expire - wheel->now > TICKS_WHEEL_MAX) {
+		expire = wheel->now + TICKS_WHEEL_MAX;
+	}
+	delta = expire - wheel->now;
+	
+	for (level = 0; level < TICKS_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1UL << (TICKS_WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	
+	timer->state = TIMER_PENDING;
+	timer_link(&wheel->buckets[level][(expire >> (TICKS_WHEEL_BITS * level)) & TICKS_WHEEL_MASK], timer);
+}
+
+/* Move the timers of a higher level bucket to the lower levels */
+static int timer_cascade(struct _ticks_wheel *wheel, int level)
+{
+	int index = (wheel->now >> (TICKS_WHEEL_BITS * level)) & TICKS_WHEEL_MASK;
+	struct _ticks_callback *timer, *list = wheel->buckets[level][index];
+	
+	wheel->buckets[level][index] = NULL;
+	
+	while ((timer = list) != NULL) {
+		list = timer->next;
+		timer_insert(wheel, timer);
+	}
+	
+	return index;
+}
+
 /* This routine is called by epoll() loop (sock.c) */
 /* TICKS_RATE define how many times this routine is called each seconde */
 
 void process_tick(acetables *g_ape)
 {
-	struct _ticks_callback **timers = &(g_ape->timers);
+	struct _ticks_wheel *wheel = g_ape->timers;
+	struct _ticks_callback *timer;
+	int index = wheel->now & TICKS_WHEEL_MASK, level;
+	
+	/* Level 0 wrapped : refill it from the next levels */
+	if (index == 0) {
+		for (level = 1; level < TICKS_WHEEL_LEVELS && timer_cascade(wheel, level) == 0; level++);
+	}
+	
+	/* Detach the due bucket. Callbacks can add or cancel any timer (itself included) */
+	if ((wheel->pending = wheel->buckets[0][index]) != NULL) {
+		wheel->pending->pprev = &wheel->pending;
+	}
+	wheel->buckets[0][index] = NULL;
+	
+	wheel->now++;
 	
-	while (*timers != NULL) {
-		(*timers)->ticks_left--;
+	while ((timer = wheel->pending) != NULL) {
+		void (*func_timer)(void *param) = timer->func;
 		
-		if ((*timers)->ticks_left <= 0) {
-			
-			void (*func_timer)(void *param) = (*timers)->func;
-			func_timer((*timers)->params);
-			
-			if ((*timers)->times > 0 && --(*timers)->times == 0) {
-				del_timer(timers);
-				continue;
-			}
-			
-			(*timers)->ticks_left = (*timers)->ticks_need;
+		timer_unlink(timer);
+		timer->state = TIMER_RUNNING;
+		
+		func_timer(timer->params);
+		
+		if (timer->state == TIMER_CANCELLED || (timer->times > 0 && --timer->times == 0)) {
+			free(timer);
+			continue;
 		}
-		timers = &(*timers)->next;
+		
+		timer->expire = wheel->now + (timer->ticks_need ? timer->ticks_need : 1) - 1;
+		timer_insert(wheel, timer);
 	}
 }
 
@@ -60,16 +140,14 @@ struct _ticks_callback *add_timeout(unsigned int sec, void *callback, void *para
 	new_timer = xmalloc(sizeof(*new_timer));
 	
 	new_timer->ticks_need = TICKS_RATE*sec;
-	new_timer->ticks_left = new_timer->ticks_need;
+	new_timer->expire = g_ape->timers->now + (new_timer->ticks_need ? new_timer->ticks_need : 1) - 1;
 	
 	new_timer->times = 1;
 	
 	new_timer->func = callback;
 	new_timer->params = params;
 	
-	new_timer->next = g_ape->timers;
-	
-	g_ape->timers = new_timer;
+	timer_insert(g_ape->timers, new_timer);
 	
 	return new_timer;
 }
@@ -86,13 +164,26 @@ struct _ticks_callback *add_periodical(unsigned int sec, int times, void *callba
 	return new_timer;
 }
 
+/* Cancel a timer. Can be called from any timer callback (itself included) */
+void cancel_timer(struct _ticks_callback *timer)
+{
+	if (timer->state == TIMER_RUNNING) {
+		/* freed by process_tick() once the callback returns */
+		timer->state = TIMER_CANCELLED;
+		return;
+	} else if (timer->state == TIMER_CANCELLED) {
+		return;
+	}
+	timer_unlink(timer);
+	
+	free(timer);
+}
 
 void del_timer(struct _ticks_callback **timer)
 {
-	struct _ticks_callback *del = *timer;
-
-	*timer = (*timer)->next;
-
-	free(del);
+	if (*timer != NULL) {
+		cancel_timer(*timer);
+		*timer = NULL;
+	}
 }
 
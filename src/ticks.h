@@ -24,26 +24,62 @@
 
 #include "main.h"
 
-/* Ticks/secondes */
-#define TICKS_RATE 20 // ~100ms
+/* Ticks/secondes (Server::ticks_rate) */
+#define TICKS_RATE_DEFAULT 20 // ~50ms
+#define TICKS_RATE_MAX 1000
+
+#define TICKS_RATE (g_ape->ticks_rate)
+
+/*
+	Hierarchical timing wheel : TICKS_WHEEL_LEVELS levels of TICKS_WHEEL_SIZE buckets.
+	Level n bucket covers TICKS_WHEEL_SIZE^n ticks and is cascaded into the
+	lower level when its turn comes. Insert and cancel are O(1).
+*/
+#define TICKS_WHEEL_BITS 6
+#define TICKS_WHEEL_SIZE (1 << TICKS_WHEEL_BITS)
+#define TICKS_WHEEL_MASK (TICKS_WHEEL_SIZE - 1)
+#define TICKS_WHEEL_LEVELS 4
+
+/* Beyond this delay (~9 days @ 20 ticks/s) timers are re-cascaded from the last level */
+#define TICKS_WHEEL_MAX ((1UL << (TICKS_WHEEL_BITS * TICKS_WHEEL_LEVELS)) - 1)
+
+typedef enum {
+	TIMER_PENDING,
+	TIMER_RUNNING,
+	TIMER_CANCELLED
+} timer_state;
 
 struct _ticks_callback
 {
-	int ticks_need;
-	int ticks_left;
+	unsigned int ticks_need;
+	unsigned long expire; /* absolute tick */
 	
 	int times;
-
+	timer_state state;
 	
 	void *func;
 	void *params;
 	
+	/* Bucket list (pprev points to the previous "next" or to the bucket) */
 	struct _ticks_callback *next;
+	struct _ticks_callback **pprev;
+};
+
+struct _ticks_wheel
+{
+	unsigned long now; /* next tick to process */
+	
+	struct _ticks_callback *buckets[TICKS_WHEEL_LEVELS][TICKS_WHEEL_SIZE];
+	
+	/* Timers due on the tick being processed */
+	struct _ticks_callback *pending;
 };
 
+struct _ticks_wheel *ticks_init();
 void process_tick(acetables *g_ape);
 struct _ticks_callback *add_timeout(unsigned int sec, void *callback, void *params, acetables *g_ape);
 struct _ticks_callback *add_periodical(unsigned int sec, int times, void *callback, void *params, acetables *g_ape);
+void cancel_timer(struct _ticks_callback *timer);
 void del_timer(struct _ticks_callback **timer);
 
 #define add_ticked(x, y) add_periodical(0, 0, x, y, g_ape)
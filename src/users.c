@@ -36,27 +36,17 @@
 #include <sys/time.h>
 #include <time.h>
 #include "utils.h"
+#include "slab.h"
+#include "sse.h"
+
+static slab_cache users_cache = SLAB_CACHE("USERS", USERS);
+static slab_cache subuser_cache = SLAB_CACHE("subuser", subuser);
 
 
 /* Checking whether the user is in a channel */
 unsigned int isonchannel(USERS *user, CHANNEL *chan)
 {
-	CHANLIST *clist;
-	
-	if (user == NULL || chan == NULL) {
-		return 0;
-	}
-	
-	clist = user->chan_foot;
-	
-	while (clist != NULL) {
-		if (clist->chaninfo == chan) {
-			return 1;
-		}
-		clist = clist->next;
-	}
-	
-	return 0;
+	return (getuchan(user, chan) != NULL);
 }
 
 void grant_aceop(USERS *user)
@@ -69,15 +59,16 @@ USERS *seek_user(const char *pubid, const char *linkid, acetables *g_ape)
 {
 	USERS *suser;
 	CHANLIST *clist;
+	ape_id id;
 
-	if ((suser = seek_user_simple(pubid, g_ape)) == NULL) {
+	if (!ape_id_decode(linkid, &id) || (suser = seek_user_simple(pubid, g_ape)) == NULL) {
 		return NULL;
 	}
 	
 	clist = suser->chan_foot;
 	
 	while (clist != NULL) {
-		if (strcasecmp(clist->chaninfo->pipe->pubid, linkid) == 0) {
+		if (APE_ID_EQUAL(&clist->chaninfo->pipe->id, &id)) {
 			return suser;
 		}
 		clist = clist->next;
@@ -102,18 +93,100 @@ USERS *seek_user_simple(const char *pubid, acetables *g_ape)
 
 USERS *seek_user_id(const char *sessid, acetables *g_ape)
 {
-	if (strlen(sessid) != 32) {
+	ape_id id;
+	
+	if (!ape_id_decode(sessid, &id)) {
 		return NULL;
 	}
-	return ((USERS *)hashtbl_seek(g_ape->hSessid, sessid));
+	return ((USERS *)idtbl_seek(g_ape->hSessid, &id));
+}
+
+
+/*
+	Idle lists : touching an user (or subuser) moves it to the foot of its list.
+	The list is thus sorted by idle time and check_timeout() only looks at the head.
+*/
+static void user_idle_link(USERS *user, acetables *g_ape)
+{
+	user->idle_next = NULL;
+	if ((user->idle_prev = g_ape->idle.ufoot) != NULL) {
+		user->idle_prev->idle_next = user;
+	} else {
+		g_ape->idle.uhead = user;
+	}
+	g_ape->idle.ufoot = user;
+}
+
+static void user_idle_unlink(USERS *user, acetables *g_ape)
+{
+	if (user->idle_prev == NULL && g_ape->idle.uhead != user) {
+		return; /* not linked */
+	}
+	if (user->idle_prev != NULL) {
+		user->idle_prev->idle_next = user->idle_next;
+	} else {
+		g_ape->idle.uhead = user->idle_next;
+	}
+	if (user->idle_next != NULL) {
+		user->idle_next->idle_prev = user->idle_prev;
+	} else {
+		g_ape->idle.ufoot = user->idle_prev;
+	}
+	user->idle_next = NULL;
+	user->idle_prev = NULL;
+}
+
+static void subuser_idle_link(subuser *sub, acetables *g_ape)
+{
+	sub->idle_next = NULL;
+	if ((sub->idle_prev = g_ape->idle.sfoot) != NULL) {
+		sub->idle_prev->idle_next = sub;
+	} else {
+		g_ape->idle.shead = sub;
+	}
+	g_ape->idle.sfoot = sub;
+}
+
+static void subuser_idle_unlink(subuser *sub, acetables *g_ape)
+{
+	if (sub->idle_prev == NULL && g_ape->idle.shead != sub) {
+		return;
+	}
+	if (sub->idle_prev != NULL) {
+		sub->idle_prev->idle_next = sub->idle_next;
+	} else {
+		g_ape->idle.shead = sub->idle_next;
+	}
+	if (sub->idle_next != NULL) {
+		sub->idle_next->idle_prev = sub->idle_prev;
+	} else {
+		g_ape->idle.sfoot = sub->idle_prev;
+	}
+	sub->idle_next = NULL;
+	sub->idle_prev = NULL;
 }
 
+void touch_user(USERS *user, acetables *g_ape)
+{
+	user->idle = (long int)time(NULL);
+	
+	user_idle_unlink(user, g_ape);
+	user_idle_link(user, g_ape);
+}
+
+void touch_subuser(subuser *sub, acetables *g_ape)
+{
+	sub->idle = (long int)time(NULL);
+	
+	subuser_idle_unlink(sub, g_ape);
+	subuser_idle_link(sub, g_ape);
+}
 
 USERS *init_user(acetables *g_ape)
 {
 	USERS *nuser;
 	
-	nuser = xmalloc(sizeof(*nuser));
+	nuser = slab_alloc(&users_cache);
 
 
 	nuser->idle = time(NULL);
@@ -138,11 +211,15 @@ USERS *init_user(acetables *g_ape)
 	
 	nuser->lastping[0] = '\0';
 	
+	nuser->idle_prev = NULL;
+	nuser->idle_next = NULL;
+	user_idle_link(nuser, g_ape);
+	
 	if (nuser->next != NULL) {
 		nuser->next->prev = nuser;
 	}
 
-	gen_sessid_new(nuser->sessid, g_ape);
+	gen_sessid_new(&nuser->id, g_ape->hSessid, (void *)nuser);
 	
 	return nuser;
 }
@@ -162,8 +239,6 @@ USERS *adduser(unsigned int fdclient, char *host, acetables *g_ape)
 	g_ape->uHead = nuser;
 	
 	nuser->pipe = init_pipe(nuser, USER_PIPE, g_ape);
-
-	hashtbl_append(g_ape->hSessid, nuser->sessid, (void *)nuser);
 	
 	g_ape->nConnected++;
 	
@@ -187,9 +262,10 @@ void deluser(USERS *user, acetables *g_ape)
 	
 	/* kill all users connections */
 	
-	clear_subusers(user);
+	clear_subusers(user, g_ape);
+	user_idle_unlink(user, g_ape);
 
-	hashtbl_erase(g_ape->hSessid, user->sessid);
+	idtbl_erase(g_ape->hSessid, &user->id);
 
 	
 	g_ape->nConnected--;
@@ -208,112 +284,172 @@ void deluser(USERS *user, acetables *g_ape)
 	clear_properties(&user->properties);
 	destroy_pipe(user->pipe, g_ape);
 	
-	free(user);
+	slab_free(&users_cache, user);
 
 	user = NULL;
 }
 
-void do_died(subuser *user)
+void do_died(subuser *user, acetables *g_ape)
 {
 
 	if (user->state == ALIVE && user->user->type == HUMAN && !(user->user->flags & FLG_PCONNECT)) {
 		user->state = ADIED;
 		user->headers_sent = 0;
 		
-		shutdown(user->fd, 2);
+		http_end(user->fd, g_ape);
 	}
 }
 
+/* Send the queued RAWs to a waiting subuser */
+static void subuser_flush(subuser *sub, acetables *g_ape)
+{
+	/* Data completetly sent => closed */
+	if (send_raws(sub, g_ape)) {
+
+		do_died(sub, g_ape);
+	} else {
+
+		sub->burn_after_writing = 1;
+	}
+}
+
+static void subuser_unready(subuser *sub)
+{
+	if (sub->ready_pprev == NULL) {
+		return;
+	}
+	if ((*sub->ready_pprev = sub->ready_next) != NULL) {
+		sub->ready_next->ready_pprev = sub->ready_pprev;
+	}
+	sub->ready_next = NULL;
+	sub->ready_pprev = NULL;
+}
+
+/* Mark a subuser as having RAWs to send, flushed by flush_ready() without waiting for the next tick */
+void subuser_ready(subuser *sub, acetables *g_ape)
+{
+	if (sub->ready_pprev != NULL) {
+		return;
+	}
+	if ((sub->ready_next = g_ape->ready.head) != NULL) {
+		sub->ready_next->ready_pprev = &sub->ready_next;
+	}
+	g_ape->ready.head = sub;
+	sub->ready_pprev = &g_ape->ready.head;
+}
+
+/* Called by the epoll() loop (sock.c) */
+void flush_ready(acetables *g_ape)
+{
+	subuser *sub;
+	
+	while ((sub = g_ape->ready.head) != NULL) {
+		subuser_unready(sub);
+		
+		if (sub->state == ALIVE && sub->nraw && !sub->need_update && sub->user->type == HUMAN) {
+			subuser_flush(sub, g_ape);
+		}
+	}
+}
+
+/* Remove timed out users and subusers (called each second) */
 void check_timeout(acetables *g_ape)
 {
-	USERS *list, *wait;
+	USERS *user;
+	subuser *sub, **n;
 	long int ctime = time(NULL);
 	
-	list = g_ape->uHead;
+	while ((user = g_ape->idle.uhead) != NULL && (ctime - user->idle) >= TIMEOUT_SEC) {
+		if (user->type != HUMAN) {
+			touch_user(user, g_ape);
+			continue;
+		}
+		/* deluser() can be intercepted by a module : the user is then retried after a new timeout */
+		touch_user(user, g_ape);
+		deluser(user, g_ape);
+	}
 	
-	while (list != NULL) {
+	while ((sub = g_ape->idle.shead) != NULL && (ctime - sub->idle) >= TIMEOUT_SEC) {
+		if (sub->user->type != HUMAN) {
+			touch_subuser(sub, g_ape);
+			continue;
+		}
+		for (n = &sub->user->subuser; *n != sub; n = &(*n)->next);
 		
-		wait = list->next;
-		if ((ctime - list->idle) >= TIMEOUT_SEC && list->type == HUMAN) {
-			deluser(list, g_ape);
-		} else if (list->type == HUMAN) {
-			subuser **n = &(list->subuser);
-			while (*n != NULL)
-			{
-				if ((ctime - (*n)->idle) >= TIMEOUT_SEC)
-				{
-					delsubuser(n);
-					continue;
-				}
-				if ((*n)->state == ALIVE && (*n)->nraw && !(*n)->need_update) {
-
-					/* Data completetly sent => closed */
-					if (send_raws(*n, g_ape)) {
-
-						do_died(*n);
-					} else {
+		delsubuser(n, g_ape);
+	}
+}
 
-						(*n)->burn_after_writing = 1;
-					}
-				} else {
-					FIRE_EVENT_NONSTOP(tickuser, *n, g_ape);
-				}
-				n = &(*n)->next;
+/* Fire the "tickuser" event on each subuser (only if a module is listening) */
+void tick_users(acetables *g_ape)
+{
+	ace_plugins *cplug;
+	USERS *list;
+	subuser *sub;
+	
+	for (cplug = g_ape->plugins; cplug != NULL; cplug = cplug->next) {
+		if (cplug->cb != NULL && cplug->cb->c_tickuser != NULL) {
+			break;
+		}
+	}
+	if (cplug == NULL) {
+		return;
+	}
+	
+	for (list = g_ape->uHead; list != NULL; list = list->next) {
+		if (list->type != HUMAN) {
+			continue;
+		}
+		for (sub = list->subuser; sub != NULL; sub = sub->next) {
+			if (!(sub->state == ALIVE && sub->nraw && !sub->need_update)) {
+				FIRE_EVENT_NONSTOP(tickuser, sub, g_ape);
 			}
 		}
-		
-		list = wait;
 	}
-
 }
 
 void send_error(USERS *user, const char *msg, const char *code, acetables *g_ape)
 {
-	RAW *newraw;
-	json *jlist = NULL;
+	json_writer w;
 	
-	set_json("value", msg, &jlist);
-	set_json("code", code, &jlist);
+	forge_raw_begin(&w, RAW_ERR);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "code");
+	json_writer_string(&w, code);
+	json_writer_key(&w, "value");
+	json_writer_string(&w, msg);
+	json_writer_end_object(&w);
 	
-	newraw = forge_raw(RAW_ERR, jlist);
-	
-	post_raw(newraw, user, g_ape);	
+	post_raw(forge_raw_end(&w), user, g_ape);
 }
 
-void send_msg(USERS *user, const char *msg, const char *type, acetables *g_ape)
+/* {"value":msg} RAW */
+static RAW *forge_msg(const char *msg, const char *type)
 {
-	RAW *newraw;
-	json *jlist = NULL;
-	
-	set_json("value", msg, &jlist);
+	json_writer w;
 	
-	newraw = forge_raw(type, jlist);
+	forge_raw_begin(&w, type);
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "value");
+	json_writer_string(&w, msg);
+	json_writer_end_object(&w);
 	
-	post_raw(newraw, user, g_ape);	
+	return forge_raw_end(&w);
+}
+
+void send_msg(USERS *user, const char *msg, const char *type, acetables *g_ape)
+{
+	post_raw(forge_msg(msg, type), user, g_ape);
 }
 
 void send_msg_channel(CHANNEL *chan, const char *msg, const char *type, acetables *g_ape)
 {
-	RAW *newraw;
-	json *jlist = NULL;
-	
-	set_json("value", msg, &jlist);
-	
-	newraw = forge_raw(type, jlist);
-	
-	post_raw_channel(newraw, chan, g_ape);
+	post_raw_channel(forge_msg(msg, type), chan, g_ape);
 }
 
 void send_msg_sub(subuser *sub, const char *msg, const char *type, acetables *g_ape)
 {
-	RAW *newraw;
-	json *jlist = NULL;
-	
-	set_json("value", msg, &jlist);
-	
-	newraw = forge_raw(type, jlist);
-	
-	post_raw_sub(newraw, sub, g_ape);		
+	post_raw_sub(forge_msg(msg, type), sub, g_ape);
 }
 
 session *get_session(USERS *user, const char *key)
@@ -419,7 +555,7 @@ subuser *addsubuser(int fd, const char *channel, USERS *user, acetables *g_ape)
 		return NULL;
 	}
 
-	sub = xmalloc(sizeof(*sub));
+	sub = slab_alloc(&subuser_cache);
 	sub->fd = fd;
 	sub->state = ADIED;
 	sub->user = user;
@@ -432,11 +568,17 @@ subuser *addsubuser(int fd, const char *channel, USERS *user, acetables *g_ape)
 	sub->nraw = 0;
 	sub->wait_for_free = 0;
 	sub->headers_sent = 0;
+	sub->sse = NULL;
 	
 	sub->burn_after_writing = 0;
 	
 	sub->idle = time(NULL);
 	sub->need_update = 0;
+	
+	sub->ready_next = NULL;
+	sub->ready_pprev = NULL;
+	
+	subuser_idle_link(sub, g_ape);
 
 	
 	(user->nsub)++;
@@ -462,61 +604,23 @@ subuser *addsubuser(int fd, const char *channel, USERS *user, acetables *g_ape)
 void subuser_restor(subuser *sub, acetables *g_ape)
 {
 	CHANLIST *chanl;
-	CHANNEL *chan;
-	
-	json *jlist = NULL;
+	json_writer w;
 	RAW *newraw;
 	USERS *user = sub->user;
-	userslist *ulist;
-	
-	char level[8];
-	
-	chanl = user->chan_foot;
-
-	while (chanl != NULL) {
-		jlist = NULL;
-		chan = chanl->chaninfo;
-		
-		if (chan->interactive) {
-
-			ulist = chan->head;
-			set_json("users", NULL, &jlist);
-			
-			while (ulist != NULL) {
 	
-				struct json *juser = NULL;
-		
-				if (ulist->userinfo != user) {
-					//make_link(user, ulist->userinfo);
-				}
-		
-				sprintf(level, "%i", ulist->level);
-				set_json("level", level, &juser);
-				
-				json_concat(juser, get_json_object_user(ulist->userinfo));
-	
-				json_attach(jlist, juser, JSON_ARRAY);
-
-				ulist = ulist->next;
-			}
-		}
-		set_json("pipe", NULL, &jlist);
-		
-		json_attach(jlist, get_json_object_channel(chan), JSON_OBJECT);
-
-		newraw = forge_raw(RAW_CHANNEL, jlist);
+	for (chanl = user->chan_foot; chanl != NULL; chanl = chanl->next) {
+		newraw = forge_channel_raw(chanl->chaninfo, g_ape);
 		newraw->priority = 1;
 		post_raw_sub(newraw, sub, g_ape);
-		chanl = chanl->next;
 	}
-
-	
-	jlist = NULL;
 	
-	set_json("user", NULL, &jlist);
-	json_attach(jlist, get_json_object_user(user), JSON_OBJECT);	
+	forge_raw_begin(&w, "IDENT");
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "user");
+	get_json_object_user_writer(user, &w);
+	json_writer_end_object(&w);
 	
-	newraw = forge_raw("IDENT", jlist);
+	newraw = forge_raw_end(&w);
 	newraw->priority = 1;
 	post_raw_sub(newraw, sub, g_ape);
 	
@@ -538,7 +642,7 @@ subuser *getsubuser(USERS *user, const char *channel)
 	return NULL;
 }
 
-void delsubuser(subuser **current)
+void delsubuser(subuser **current, acetables *g_ape)
 {
 	subuser *del = *current;
 	
@@ -546,22 +650,31 @@ void delsubuser(subuser **current)
 	
 	*current = (*current)->next;
 	clear_subuser_raws(del);
+	subuser_unready(del);
+	subuser_idle_unlink(del, g_ape);
 
 	
 	if (del->state == ALIVE) {
+		/* Its connection is closed (even a persistent one), "del" is freed once detached (see http_end()) */
 		del->wait_for_free = 1;
-		do_died(del);
+		http_end(del->fd, g_ape);
 	} else {
-		do_died(del);
-		free(del);
+		free_subuser(del);
 	}
 	
 }
 
-void clear_subusers(USERS *user)
+/* Release a subuser once its socket is closed (see delsubuser()) */
+void free_subuser(subuser *sub)
+{
+	sse_free(sub);
+	slab_free(&subuser_cache, sub);
+}
+
+void clear_subusers(USERS *user, acetables *g_ape)
 {
 	while (user->subuser != NULL) {
-		delsubuser(&(user->subuser));
+		delsubuser(&(user->subuser), g_ape);
 	}
 }
 
@@ -573,8 +686,7 @@ void clear_subuser_raws(subuser *sub)
 	while(raw != NULL) {
 		older = raw;
 		raw = raw->next;
-		free(older->data);
-		free(older);
+		free_raw(older);
 	}
 	sub->rawhead = NULL;
 	sub->rawfoot = NULL;
@@ -627,6 +739,7 @@ void make_link(USERS *a, USERS *b)
 {
 	struct _users_link *link;
 	struct _link_list *link_a, *link_b;
+	char apubid[APE_ID_HEX_LEN + 1], bpubid[APE_ID_HEX_LEN + 1];
 	
 	if (are_linked(a, b) != NULL) {	
 		link = xmalloc(sizeof(*link));
@@ -650,9 +763,9 @@ void make_link(USERS *a, USERS *b)
 		(b->links.nlink)++;
 	
 		link->link_type = 0;
-		printf("Link etablished between %s and %s\n", a->pipe->pubid, b->pipe->pubid);
+		printf("Link etablished between %s and %s\n", ape_id_encode(&a->pipe->id, apubid), ape_id_encode(&b->pipe->id, bpubid));
 	} else {
-		printf("%s and %s are already linked\n", a->pipe->pubid, b->pipe->pubid);
+		printf("%s and %s are already linked\n", ape_id_encode(&a->pipe->id, apubid), ape_id_encode(&b->pipe->id, bpubid));
 	}
 }
 
@@ -668,10 +781,11 @@ void destroy_link(USERS *a, USERS *b)
 struct json *get_json_object_user(USERS *user)
 {
 	json *jstr = NULL;
+	char pubid[APE_ID_HEX_LEN + 1];
 	
 	if (user != NULL) {
 	
-		set_json("pubid", user->pipe->pubid, &jstr);
+		set_json("pubid", ape_id_encode(&user->pipe->id, pubid), &jstr);
 		set_json("casttype", "uni", &jstr);
 		
 		if (user->properties != NULL) {
@@ -710,3 +824,70 @@ struct json *get_json_object_user(USERS *user)
 	return jstr;
 }
 
+/* Serialized get_json_object_user(), cached on the user until its properties change */
+extend_cache *get_json_object_user_cache(USERS *user)
+{
+	extend_cache *cache;
+	extend *eTmp;
+	json_writer w;
+	int has_prop = 0;
+	char pubid[APE_ID_HEX_LEN + 1];
+	
+	if ((cache = get_property_cache(user->properties)) != NULL) {
+		return cache;
+	}
+	
+	json_writer_init(&w);
+	json_writer_begin_object(&w);
+	
+	for (eTmp = user->properties; eTmp != NULL; eTmp = eTmp->next) {
+		if (eTmp->visibility != EXTEND_ISPUBLIC) {
+			continue;
+		}
+		if (!has_prop) {
+			has_prop = 1;
+			json_writer_key(&w, "properties");
+			json_writer_begin_object(&w);
+		}
+		json_writer_key(&w, eTmp->key);
+		
+		if (eTmp->type == EXTEND_JSON) {
+			json_writer_json(&w, eTmp->val);
+		} else {
+			json_writer_string(&w, eTmp->val);
+		}
+	}
+	if (has_prop) {
+		json_writer_end_object(&w);
+	}
+	json_writer_key(&w, "casttype");
+	json_writer_string(&w, "uni");
+	json_writer_key(&w, "pubid");
+	json_writer_string(&w, ape_id_encode(&user->pipe->id, pubid));
+	
+	json_writer_end_object(&w);
+	
+	cache = set_property_cache(&user->properties, w.buf, w.len);
+	json_writer_release(&w);
+	
+	return cache;
+}
+
+/* Same as get_json_object_user() but written by a json_writer */
+void get_json_object_user_writer(USERS *user, json_writer *w)
+{
+	extend_cache *cache;
+	
+	if (user == NULL) {
+		json_writer_begin_object(w);
+		json_writer_key(w, "pubid");
+		json_writer_string(w, SERVER_NAME);
+		json_writer_end_object(w);
+		
+		return;
+	}
+	cache = get_json_object_user_cache(user);
+	
+	json_writer_raw(w, cache->data, cache->len);
+}
+
@@ -44,7 +44,9 @@ enum {
 	TRANSPORT_LONGPOLLING,
 	TRANSPORT_POLLING,
 	TRANSPORT_JSONP,
-	TRANSPORT_IFRAME
+	TRANSPORT_IFRAME,
+	TRANSPORT_WEBSOCKET,
+	TRANSPORT_SSE
 };
 
 // Le 25/12/2006  02:15:19 Joyeux Nol
@@ -56,7 +58,7 @@ typedef struct USERS
 	unsigned int flags;
 	unsigned int type;
 
-	char sessid[33];
+	ape_id id; /* sessid (hSessid key), sent as hex */
 	
 
 	char ip[16]; // ipv4
@@ -88,6 +90,10 @@ typedef struct USERS
 	int nsub;
 	
 	char lastping[24];
+	
+	/* g_ape->idle list */
+	struct USERS *idle_next;
+	struct USERS *idle_prev;
 
 } USERS;
 
@@ -117,14 +123,28 @@ struct _subuser
 	int burn_after_writing;
 	
 	long int idle;
+	
+	/* g_ape->ready list */
+	struct _subuser *ready_next;
+	struct _subuser **ready_pprev;
+	
+	/* g_ape->idle list */
+	struct _subuser *idle_next;
+	struct _subuser *idle_prev;
+	
+	/* TRANSPORT_SSE (see sse.c) */
+	struct _sse *sse;
 };
 
 
+/* A channel joined by a user (user->chan_foot) */
 typedef struct CHANLIST
 {
 	struct CHANNEL *chaninfo;
 	struct CHANLIST *next;
+	struct CHANLIST *prev;
 	
+	struct userslist *member; /* Membership in chaninfo */
 } CHANLIST;
 
 
@@ -143,11 +163,13 @@ struct _link_list
 };
 
 
+/* A member of a channel (see CHANNEL members) */
 typedef struct userslist
 {
 	struct USERS *userinfo;
-	struct userslist *next;
-		
+	struct CHANLIST *chanl; /* Entry in userinfo->chan_foot */
+	
+	unsigned int index; /* In chan->members */
 	unsigned int level;
 	/* TODO: it can be intersting to extend this */
 } userslist;
@@ -197,6 +219,8 @@ enum {
 #define RAW_USER 		"USER"
 #define RAW_ERR 		"ERR"
 #define RAW_CHANNEL		"CHANNEL"
+#define RAW_ROSTER		"ROSTER"
+#define RAW_PRESENCE		"PRESENCE"
 #define RAW_KICK		"KICKED"
 #define RAW_BAN			"BANNED"
 #define RAW_PROXY		"PROXY"
@@ -211,9 +235,14 @@ USERS *seek_user_simple(const char *nick, acetables *g_ape);
 
 void deluser(USERS *user, acetables *g_ape);
 
-void do_died(subuser *user);
+void do_died(subuser *user, acetables *g_ape);
 
 void check_timeout(acetables *g_ape);
+void tick_users(acetables *g_ape);
+void touch_user(USERS *user, acetables *g_ape);
+void touch_subuser(subuser *sub, acetables *g_ape);
+void subuser_ready(subuser *sub, acetables *g_ape);
+void flush_ready(acetables *g_ape);
 void grant_aceop(USERS *user);
 
 void send_error(USERS *user, const char *msg, const char *code, acetables *g_ape);
@@ -224,6 +253,8 @@ void send_msg_channel(CHANNEL *chan, const char *msg, const char *type, acetable
 unsigned int isonchannel(USERS *user, CHANNEL *chan);
 
 struct json *get_json_object_user(USERS *user);
+extend_cache *get_json_object_user_cache(USERS *user);
+void get_json_object_user_writer(USERS *user, json_writer *w);
 
 session *get_session(USERS *user, const char *key);
 session *set_session(USERS *user, const char *key, const char *val, int update, acetables *g_ape);
@@ -232,10 +263,11 @@ void sendback_session(USERS *user, session *sess, acetables *g_ape);
 
 subuser *addsubuser(int fd, const char *channel, USERS *user, acetables *g_ape);
 subuser *getsubuser(USERS *user, const char *channel);
-void delsubuser(subuser **current);
+void delsubuser(subuser **current, acetables *g_ape);
+void free_subuser(subuser *sub);
 void subuser_restor(subuser *sub, acetables *g_ape);
 
-void clear_subusers(USERS *user);
+void clear_subusers(USERS *user, acetables *g_ape);
 void clear_subuser_raws(subuser *sub);
 void ping_request(USERS *user, acetables *g_ape);
 
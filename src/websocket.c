@@ -0,0 +1,319 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* websocket.c */
+
+#include <stdint.h>
+
+#include "websocket.h"
+#include "sock.h"
+#include "cmd.h"
+#include "users.h"
+#include "utils.h"
+#include "base64.h"
+#include "sha1.h"
+#include "compress.h"
+
+#define WS_REFUSED "HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+/* 
+	Answer the upgrade request read on cget->fdclient.
+	From now on, the connection carries WebSocket frames (see websocket_process())
+*/
+int websocket_accept(connection *co, clientget *cget, acetables *g_ape)
+{
+	char key[WS_KEY_MAX + sizeof(WS_GUID)], buf[256], *accept;
+	unsigned char digest[SHA1_DIGEST_LENGTH];
+	int len = co->http.ws_key_len;
+	
+	if (co->http.upgrade != 1 || co->http.ws_key == -1 || len > WS_KEY_MAX) {
+		sendbin(cget->fdclient, WS_REFUSED, strlen(WS_REFUSED), g_ape);
+		return 0;
+	}
+	memcpy(key, &co->buffer.data[co->http.ws_key], len);
+	
+	while (len && key[len-1] == ' ') {
+		len--;
+	}
+	memcpy(&key[len], WS_GUID, sizeof(WS_GUID) - 1);
+	
+	sha1((unsigned char *)key, len + sizeof(WS_GUID) - 1, digest);
+	accept = base64_encode((char *)digest, SHA1_DIGEST_LENGTH);
+	
+	len = sprintf(buf, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n", accept);
+	free(accept);
+	
+	/* Our context is kept from one message to the next, the client one is not (a single inflater is shared) */
+	if (co->http.ws_deflate && g_ape->compress->min >= 0) {
+		len += sprintf(&buf[len], "Sec-WebSocket-Extensions: permessage-deflate; client_no_context_takeover\r\n");
+		compress_ws_start(co, g_ape);
+	}
+	len += sprintf(&buf[len], "\r\n");
+	
+	sendbin(cget->fdclient, buf, len, g_ape);
+	
+	co->websocket = xmalloc(sizeof(*co->websocket));
+	co->websocket->cget = *cget;
+	co->websocket->msg = NULL;
+	co->websocket->msg_len = 0;
+	co->websocket->msg_deflate = 0;
+	co->websocket->closing = 0;
+	
+	return 1;
+}
+
+/* Server frames are never masked nor fragmented */
+int websocket_frame_header(char *buf, int opcode, int len)
+{
+	int i;
+	
+	buf[0] = 0x80 | opcode;
+	
+	if (len < 126) {
+		buf[1] = len;
+		return 2;
+	} else if (len < 65536) {
+		buf[1] = 126;
+		buf[2] = (len >> 8) & 0xff;
+		buf[3] = len & 0xff;
+		return 4;
+	}
+	buf[1] = 127;
+	for (i = 0; i < 8; i++) {
+		buf[9 - i] = (i < 4 ? (len >> (i * 8)) & 0xff : 0);
+	}
+	return 10;
+}
+
+static void websocket_send(int fd, int opcode, char *payload, int len, acetables *g_ape)
+{
+	char header[WS_FRAME_HEADER_MAX];
+	
+	sendbin(fd, header, websocket_frame_header(header, opcode, len), g_ape);
+	
+	if (len) {
+		sendbin(fd, payload, len, g_ape);
+	}
+}
+
+int websocket_is_open(int fd, acetables *g_ape)
+{
+	return (g_ape->co[fd].websocket != NULL && !g_ape->co[fd].websocket->closing);
+}
+
+/* Closing handshake (normal closure), the socket is then shut down */
+static void websocket_shutdown(int fd, char *status, acetables *g_ape)
+{
+	g_ape->co[fd].websocket->closing = 1;
+	
+	websocket_send(fd, WS_CLOSE, status, 2, g_ape);
+	sockshutdown(fd, g_ape);
+}
+
+void websocket_close(int fd, acetables *g_ape)
+{
+	if (websocket_is_open(fd, g_ape)) {
+		websocket_shutdown(fd, "\x03\xe8", g_ape); /* 1000 */
+	}
+}
+
+/* Called when the socket is closed */
+void websocket_free(connection *co)
+{
+	if (co->websocket != NULL) {
+		free(co->websocket->msg);
+		free(co->websocket);
+		co->websocket = NULL;
+	}
+}
+
+/* A complete message is a command (like the query string of a HTTP request) */
+static void websocket_message(connection *co, int fd, char *msg, int len, int deflate, acetables *g_ape)
+{
+	struct _websocket *ws = co->websocket;
+	subuser *user = NULL;
+	char next;
+	
+	/* The inflated copy is NUL terminated */
+	if (deflate && (len = compress_inflate(msg, len, &msg, g_ape)) == -1) {
+		websocket_shutdown(fd, "\x03\xef", g_ape); /* 1007 : invalid data */
+		return;
+	}
+	next = msg[len];
+	
+	msg[len] = '\0';
+	ws->cget.get = msg;
+	
+	/* No response to end : errors are sent as messages too */
+	checkcmd(&ws->cget, &user, g_ape);
+	
+	msg[len] = next;
+	
+	if (user != NULL) {
+		co->attach = user;
+	}
+}
+
+/* Answer to our ping (see websocket_ping()) */
+static void websocket_pong(connection *co, int fd, acetables *g_ape)
+{
+	subuser *sub = co->attach;
+	
+	if (sub != NULL && sub->fd == fd && !sub->wait_for_free) {
+		touch_subuser(sub, g_ape);
+		touch_user(sub->user, g_ape);
+	}
+}
+
+/* Frames read on "fd" : complete ones are processed, what is left stays in the buffer */
+void websocket_process(connection *co, int fd, acetables *g_ape)
+{
+	struct _websocket *ws = co->websocket;
+	unsigned char *data, *mask;
+	char *payload;
+	unsigned int off = 0, hlen, avail, i;
+	uint64_t len;
+	int fin, opcode, rsv;
+	
+	while (!ws->closing && (avail = co->buffer.length - off) >= 2) {
+		data = (unsigned char *)&co->buffer.data[off];
+		
+		fin = data[0] & 0x80;
+		opcode = data[0] & 0x0f;
+		len = data[1] & 0x7f;
+		hlen = 2;
+		
+		if (len == 126) {
+			if (avail < 4) {
+				break;
+			}
+			len = (data[2] << 8) | data[3];
+			hlen = 4;
+		} else if (len == 127) {
+			if (avail < 10) {
+				break;
+			}
+			for (len = 0, i = 2; i < 10; i++) {
+				len = (len << 8) | data[i];
+			}
+			hlen = 10;
+		}
+		
+		/* RSV1 : first frame of a compressed message (if negotiated) */
+		rsv = data[0] & 0x70;
+		
+		if (rsv == WS_RSV1 && co->deflate != NULL && (opcode == WS_TEXT || opcode == WS_BINARY)) {
+			rsv = 0;
+		}
+		
+		/* Client frames are masked, control frames are short and not fragmented */
+		if (rsv || !(data[1] & 0x80) || len > MAX_CONTENT_LENGTH || 
+			(opcode >= WS_CLOSE && (!fin || len > 125))) {
+			
+			websocket_shutdown(fd, "\x03\xea", g_ape); /* 1002 : protocol error */
+			break;
+		}
+		if (avail < hlen + 4 + len) {
+			break;
+		}
+		mask = &data[hlen];
+		payload = (char *)&data[hlen + 4];
+		
+		for (i = 0; i < len; i++) {
+			payload[i] ^= mask[i & 3];
+		}
+		off += hlen + 4 + len;
+		
+		switch(opcode) {
+			case WS_TEXT:
+			case WS_BINARY:
+				if (ws->msg != NULL) {
+					websocket_shutdown(fd, "\x03\xea", g_ape);
+				} else if (fin) {
+					websocket_message(co, fd, payload, len, (data[0] & WS_RSV1), g_ape);
+				} else {
+					ws->msg = xmalloc(sizeof(char) * (len + 1));
+					ws->msg_len = len;
+					ws->msg_deflate = (data[0] & WS_RSV1);
+					memcpy(ws->msg, payload, len);
+				}
+				break;
+			case WS_CONTINUATION:
+				if (ws->msg == NULL || ws->msg_len + len > MAX_CONTENT_LENGTH) {
+					websocket_shutdown(fd, "\x03\xea", g_ape);
+					break;
+				}
+				ws->msg = xrealloc(ws->msg, sizeof(char) * (ws->msg_len + len + 1));
+				memcpy(&ws->msg[ws->msg_len], payload, len);
+				ws->msg_len += len;
+				
+				if (fin) {
+					websocket_message(co, fd, ws->msg, ws->msg_len, ws->msg_deflate, g_ape);
+					
+					free(ws->msg);
+					ws->msg = NULL;
+					ws->msg_len = 0;
+				}
+				break;
+			case WS_PING:
+				websocket_send(fd, WS_PONG, payload, len, g_ape);
+				break;
+			case WS_PONG:
+				websocket_pong(co, fd, g_ape);
+				break;
+			case WS_CLOSE:
+				/* Echo the status code */
+				websocket_shutdown(fd, (len >= 2 ? payload : "\x03\xe8"), g_ape);
+				break;
+			default:
+				websocket_shutdown(fd, "\x03\xea", g_ape);
+				break;
+		}
+	}
+	
+	if (ws->closing) {
+		co->buffer.length = 0;
+	} else if (off) {
+		/* An incomplete frame is moved to the beginning of the buffer */
+		co->buffer.length -= off;
+		memmove(co->buffer.data, co->buffer.data + off, co->buffer.length);
+	}
+}
+
+/*
+	Called every WS_PING_SEC.
+	Idle WebSocket subusers are pinged (their pong touches them) instead of timing out,
+	those which didn't answer the previous pings are closed.
+*/
+void websocket_ping(acetables *g_ape)
+{
+	subuser *sub;
+	long int ctime = time(NULL);
+	
+	for (sub = g_ape->idle.shead; sub != NULL && (ctime - sub->idle) >= WS_PING_SEC; sub = sub->idle_next) {
+		if (sub->state != ALIVE || !websocket_is_open(sub->fd, g_ape)) {
+			continue;
+		}
+		if (ctime - sub->idle >= TIMEOUT_SEC - WS_PING_SEC) {
+			websocket_close(sub->fd, g_ape);
+		} else {
+			websocket_send(sub->fd, WS_PING, NULL, 0, g_ape);
+		}
+	}
+}
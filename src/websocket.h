@@ -0,0 +1,66 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* websocket.h */
+
+#ifndef _WEBSOCKET_H
+#define _WEBSOCKET_H
+
+#include "main.h"
+#include "handle_http.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_MAX 64
+#define WS_FRAME_HEADER_MAX 10
+#define WS_RSV1 0x40 // Compressed message (permessage-deflate)
+
+#define WS_PING_SEC 15 // Idle WebSocket subusers are pinged, those silent for TIMEOUT_SEC - WS_PING_SEC are closed
+
+enum {
+	WS_CONTINUATION = 0x0,
+	WS_TEXT = 0x1,
+	WS_BINARY = 0x2,
+	WS_CLOSE = 0x8,
+	WS_PING = 0x9,
+	WS_PONG = 0xA
+};
+
+/* RFC 6455 connection (see connection::websocket) */
+struct _websocket
+{
+	/* Filled by the handshake, each message is given to checkcmd() with it */
+	clientget cget;
+	
+	/* Fragmented message being reassembled */
+	char *msg;
+	int msg_len;
+	int msg_deflate;
+	
+	int closing;
+};
+
+int websocket_accept(connection *co, clientget *cget, acetables *g_ape);
+void websocket_process(connection *co, int fd, acetables *g_ape);
+int websocket_frame_header(char *buf, int opcode, int len);
+int websocket_is_open(int fd, acetables *g_ape);
+void websocket_close(int fd, acetables *g_ape);
+void websocket_free(connection *co);
+void websocket_ping(acetables *g_ape);
+
+#endif